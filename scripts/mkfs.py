@@ -36,19 +36,36 @@ DENTRY_PB = BLOCK_SIZE / DENTRY_SIZE
 UINT32_PB = BLOCK_SIZE / 4
 
 FS_BLOCKS = 262144
-INODE_BITMAP_START = 1
-INODE_BITMAP_BLOCKS = 6
-DATA_BITMAP_START = 7
-DATA_BITMAP_BLOCKS = 32
-INODE_START = 39
-INODE_BLOCKS = 6105
-DATA_START = 6144
-DATA_BLOCKS = 256000
+LOG_START = 1
+LOG_BLOCKS = 256
+DATA_START = LOG_START + LOG_BLOCKS     # Start of block group 0
+
+GROUP_BLOCKS = 32768
+GROUP_INODES = 8192
+NUM_GROUPS = (FS_BLOCKS - DATA_START + GROUP_BLOCKS - 1) // GROUP_BLOCKS
+DATA_BLOCKS = NUM_GROUPS * GROUP_BLOCKS
+
+BITMAP_BITS_PB = BLOCK_SIZE * 8
+GROUP_IBITMAP_BLOCKS = GROUP_INODES // BITMAP_BITS_PB
+GROUP_DBITMAP_BLOCKS = GROUP_BLOCKS // BITMAP_BITS_PB
+GROUP_INODE_BLOCKS = GROUP_INODES // (BLOCK_SIZE // INODE_SIZE)
+GROUP_META_BLOCKS = GROUP_IBITMAP_BLOCKS + GROUP_DBITMAP_BLOCKS \
+                    + GROUP_INODE_BLOCKS
 
 NUM_DIRECT    = 16
 NUM_INDIRECT1 = 8
 NUM_INDIRECT2 = 1
 
+EXTENT_SIZE = 12
+EXTENT_HEADER_SIZE = 4
+EXTENTS_INLINE = 8
+EXTENTS_PB = (BLOCK_SIZE - EXTENT_HEADER_SIZE) // EXTENT_SIZE
+EXTENT_MAX_DEPTH = 3
+
+INODE_FLAGS_OFFSET = 108
+INODE_FLAG_EXTENTS = 0x1
+USE_EXTENTS = True      # Map initial files through extents
+
 MAX_FILENAME = 120
 
 INODE_TYPE_EMPTY = 0
@@ -61,8 +78,9 @@ ENDIANESS = 'little'    # x86 IA32 is little endian
 # FS image bytearray.
 img = bytearray(FS_BLOCKS * BLOCK_SIZE)     # Zero bytes by default
 
-# Current inode slots & data blocks used.
-curr_data_block = 0
+# Current inode slots & data blocks used, data blocks are counted in data
+# bitmap slots and the metadata blocks of each group are skipped.
+curr_data_block = GROUP_META_BLOCKS
 curr_inumber = 1        # 0 is reserved for the root directory
 
 # Initial directory tree as a dictionary, see `build_dtree()`.
@@ -96,19 +114,25 @@ def put_bytearray(offset, barray):
     img[offset:offset+len(barray)] = barray
 
 
+def group_start(group):
+    """
+    Get the first block of a block group.
+    """
+    return DATA_START + group * GROUP_BLOCKS
+
 def gen_superblock():
     """
     Generate the superblock.
     """
-    put_uint32(0 , FS_BLOCKS          )
-    put_uint32(4 , INODE_BITMAP_START )
-    put_uint32(8 , INODE_BITMAP_BLOCKS)
-    put_uint32(12, DATA_BITMAP_START  )
-    put_uint32(16, DATA_BITMAP_BLOCKS )
-    put_uint32(20, INODE_START        )
-    put_uint32(24, INODE_BLOCKS       )
-    put_uint32(28, DATA_START         )
-    put_uint32(32, DATA_BLOCKS        )
+    assert FS_BLOCKS > group_start(NUM_GROUPS - 1) + GROUP_META_BLOCKS
+    put_uint32(0 , FS_BLOCKS   )
+    put_uint32(4 , LOG_START   )
+    put_uint32(8 , LOG_BLOCKS  )
+    put_uint32(12, DATA_START  )
+    put_uint32(16, DATA_BLOCKS )
+    put_uint32(20, NUM_GROUPS  )
+    put_uint32(24, GROUP_BLOCKS)
+    put_uint32(28, GROUP_INODES)
 
 
 def add_data_block(block):
@@ -117,11 +141,62 @@ def add_data_block(block):
     Returns the address of the block allocated.
     """
     global curr_data_block
+    if curr_data_block % GROUP_BLOCKS == 0:
+        curr_data_block += GROUP_META_BLOCKS
+    if DATA_START + curr_data_block >= FS_BLOCKS:
+        print("Error: file system image is full")
+        exit(1)
     addr = (DATA_START + curr_data_block) * BLOCK_SIZE
     put_bytearray(addr, block)
     curr_data_block += 1
     return addr
 
+def extent_node_bytes(entries, depth, capacity):
+    """
+    Encode an extent tree node of given depth, holding given list of
+    (lstart, pstart, len) entries.
+    """
+    assert len(entries) <= capacity
+    node = bytearray(EXTENT_HEADER_SIZE + capacity * EXTENT_SIZE)
+    node[0:2] = len(entries).to_bytes(2, byteorder=ENDIANESS)
+    node[2:4] = depth.to_bytes(2, byteorder=ENDIANESS)
+    for i, (lstart, pstart, length) in enumerate(entries):
+        off = EXTENT_HEADER_SIZE + i * EXTENT_SIZE
+        node[off:off+4] = uint32_to_bytes(lstart)
+        node[off+4:off+8] = uint32_to_bytes(pstart)
+        node[off+8:off+12] = uint32_to_bytes(length)
+    return node
+
+def put_extents(addr, data_blocks):
+    """
+    Map the data blocks of the inode at given address through extents,
+    merging blocks that are consecutive on disk, adding index node blocks
+    below the inline root as needed.
+    """
+    entries = []
+    for idx, block_addr in enumerate(data_blocks):
+        block_no = block_addr // BLOCK_SIZE
+        if len(entries) > 0 and entries[-1][1] + entries[-1][2] == block_no:
+            lstart, pstart, length = entries[-1]
+            entries[-1] = (lstart, pstart, length + 1)
+        else:
+            entries.append((idx, block_no, 1))
+
+    depth = 0
+    while len(entries) > EXTENTS_INLINE:
+        assert depth < EXTENT_MAX_DEPTH
+        parents = []
+        for beg in range(0, len(entries), EXTENTS_PB):
+            children = entries[beg:beg+EXTENTS_PB]
+            node_addr = add_data_block(extent_node_bytes(children, depth,
+                                                         EXTENTS_PB))
+            parents.append((children[0][0], node_addr // BLOCK_SIZE, 0))
+        entries = parents
+        depth += 1
+
+    put_bytearray(addr + 8, extent_node_bytes(entries, depth, EXTENTS_INLINE))
+    put_uint32(addr + INODE_FLAGS_OFFSET, INODE_FLAG_EXTENTS)
+
 def add_inode(file_size, data_blocks, inode_type, inumber):
     """
     Put an inode into given inode slot, also given file size and allocated
@@ -131,11 +206,18 @@ def add_inode(file_size, data_blocks, inode_type, inumber):
     assert file_size <= len(data_blocks) * BLOCK_SIZE
     assert inode_type == INODE_TYPE_FILE or inode_type == INODE_TYPE_DIR
 
-    addr = INODE_START * BLOCK_SIZE + inumber * INODE_SIZE
+    group = inumber // GROUP_INODES
+    inode_start = group_start(group) + GROUP_IBITMAP_BLOCKS \
+                  + GROUP_DBITMAP_BLOCKS
+    addr = inode_start * BLOCK_SIZE + (inumber % GROUP_INODES) * INODE_SIZE
     
     put_uint32(addr,     inode_type)
     put_uint32(addr + 4, file_size)
 
+    if USE_EXTENTS:
+        put_extents(addr, data_blocks)
+        return
+
     # Direct.
     idx = 0
     while idx < NUM_DIRECT:
@@ -218,7 +300,7 @@ def add_dir(content, my_inumber, parent_inumber):
             if len(names[idx]) > MAX_FILENAME:
                 print("Error: file name '{}' exceeds max length".format(names[idx]))
                 exit(1)
-            if inumbers[idx] < 0 or inumbers[idx] >= INODE_BLOCKS * INODES_PB:
+            if inumbers[idx] < 0 or inumbers[idx] >= NUM_GROUPS * GROUP_INODES:
                 print("Error: detected invalid inumber {}".format(inumbers[idx]))
                 exit(1)
             dir_block[i:i+4]   = uint32_to_bytes(1)
@@ -234,35 +316,36 @@ def add_dir(content, my_inumber, parent_inumber):
 
 def gen_bitmaps():
     """
-    Generate the inode bitmap and data bitmap according to the number of
-    inode slots and data blocks used.
+    Generate the inode bitmap and data bitmap slices of every block group
+    according to the number of inode slots and data blocks used. Metadata
+    blocks of each group and blocks past the end of disk are marked used
+    in the data bitmap.
     """
-    def prefix_bits(num):
+    def set_bit(bitmap, slot):
         """
-        Get a byte with prefix of NUM bits.
+        Mark a slot used, the lowest slot in a byte is its MSB.
         """
-        assert num >= 0 and num < 8
-        prefix_dict = { 0: b'\x00',
-                        1: b'\x80',
-                        2: b'\xC0',
-                        3: b'\xE0',
-                        4: b'\xF0',
-                        5: b'\xF8',
-                        6: b'\xFC',
-                        7: b'\xFE' }
-        return prefix_dict[num]
-
-    inode_bitmap = bytearray(0)
-    for i in range(curr_inumber // 8):
-        inode_bitmap.extend(b'\xFF')
-    inode_bitmap.extend(prefix_bits(curr_inumber % 8))
-    put_bytearray(INODE_BITMAP_START * BLOCK_SIZE, inode_bitmap)
-
-    data_bitmap = bytearray(0)
-    for i in range(curr_data_block // 8):
-        data_bitmap.extend(b'\xFF')
-    data_bitmap.extend(prefix_bits(curr_data_block % 8))
-    put_bytearray(DATA_BITMAP_START * BLOCK_SIZE, data_bitmap)
+        bitmap[slot // 8] |= 0x80 >> (slot % 8)
+
+    inode_bitmap = bytearray(NUM_GROUPS * GROUP_INODES // 8)
+    for inumber in range(curr_inumber):
+        set_bit(inode_bitmap, inumber)
+
+    data_bitmap = bytearray(DATA_BLOCKS // 8)
+    for slot in range(DATA_BLOCKS):
+        if slot % GROUP_BLOCKS < GROUP_META_BLOCKS \
+           or slot < curr_data_block or DATA_START + slot >= FS_BLOCKS:
+            set_bit(data_bitmap, slot)
+
+    ibitmap_bytes = GROUP_IBITMAP_BLOCKS * BLOCK_SIZE
+    dbitmap_bytes = GROUP_DBITMAP_BLOCKS * BLOCK_SIZE
+    for group in range(NUM_GROUPS):
+        addr = group_start(group) * BLOCK_SIZE
+        put_bytearray(addr, inode_bitmap[group * ibitmap_bytes:
+                                         (group+1) * ibitmap_bytes])
+        put_bytearray(addr + ibitmap_bytes,
+                      data_bitmap[group * dbitmap_bytes:
+                                  (group+1) * dbitmap_bytes])
 
 
 def build_dtree(bins):
@@ -12,43 +12,92 @@
 #include "spinlock.h"
 
 
-/** Set a slot as used. */
-inline void
-bitmap_set(bitmap_t *bitmap, uint32_t slot_no)
+/**
+ * Get the W-th 32-bit word of bits in slot order, i.e., with slot W * 32
+ * at the most significant bit. Bits are stored MSB-first in each byte,
+ * so a little-endian load just needs a byte swap.
+ */
+static inline uint32_t
+_bitmap_word(bitmap_t *bitmap, uint32_t w)
 {
-    assert(slot_no < bitmap->slots);
+    return __builtin_bswap32(((uint32_t *) bitmap->bits)[w]);
+}
+
+/** Count the set bits of a word. */
+static inline uint32_t
+_bitmap_popcount(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
 
-    bool was_locked = spinlock_locked(&(bitmap->lock));
-    if (!was_locked)
-        spinlock_acquire(&(bitmap->lock));
 
+/** Flip a slot's bit and account it, must hold the lock. */
+static void
+_bitmap_set_locked(bitmap_t *bitmap, uint32_t slot_no)
+{
     size_t outer_idx = BITMAP_OUTER_IDX(slot_no);
-    size_t inner_idx = BITMAP_INNER_IDX(slot_no);
-    bitmap->bits[outer_idx] |= (1 << (7 - inner_idx));
+    uint8_t mask = 1 << (7 - BITMAP_INNER_IDX(slot_no));
+    if ((bitmap->bits[outer_idx] & mask) != 0)
+        return;
 
-    if (!was_locked)
-        spinlock_release(&(bitmap->lock));
+    bitmap->bits[outer_idx] |= mask;
+    bitmap->region_free[slot_no / BITMAP_REGION_SLOTS]--;
+    bitmap->num_free--;
+}
+
+static void
+_bitmap_clear_locked(bitmap_t *bitmap, uint32_t slot_no)
+{
+    size_t outer_idx = BITMAP_OUTER_IDX(slot_no);
+    uint8_t mask = 1 << (7 - BITMAP_INNER_IDX(slot_no));
+    if ((bitmap->bits[outer_idx] & mask) == 0)
+        return;
+
+    bitmap->bits[outer_idx] &= ~mask;
+    bitmap->region_free[slot_no / BITMAP_REGION_SLOTS]++;
+    bitmap->num_free++;
+}
+
+
+/** Set a slot as used. */
+void
+bitmap_set(bitmap_t *bitmap, uint32_t slot_no)
+{
+    assert(slot_no < bitmap->slots);
+
+    spinlock_acquire(&(bitmap->lock));
+    _bitmap_set_locked(bitmap, slot_no);
+    spinlock_release(&(bitmap->lock));
 }
 
 /** Clear a slot as free. */
-inline void
+void
 bitmap_clear(bitmap_t *bitmap, uint32_t slot_no)
 {
     assert(slot_no < bitmap->slots);
-    if (slot_no == 0)
-        info("clearing 0");
 
     spinlock_acquire(&(bitmap->lock));
+    _bitmap_clear_locked(bitmap, slot_no);
+    spinlock_release(&(bitmap->lock));
+}
 
-    size_t outer_idx = BITMAP_OUTER_IDX(slot_no);
-    size_t inner_idx = BITMAP_INNER_IDX(slot_no);
-    bitmap->bits[outer_idx] &= ~(1 << (7 - inner_idx));
+/** Clear COUNT slots starting at SLOT_NO as free. */
+void
+bitmap_clear_range(bitmap_t *bitmap, uint32_t slot_no, uint32_t count)
+{
+    assert(slot_no + count <= bitmap->slots);
 
+    spinlock_acquire(&(bitmap->lock));
+    for (uint32_t i = 0; i < count; ++i)
+        _bitmap_clear_locked(bitmap, slot_no + i);
     spinlock_release(&(bitmap->lock));
 }
 
 /** Returns true if a slot is in use, otherwise false. */
-inline bool
+bool
 bitmap_check(bitmap_t *bitmap, uint32_t slot_no)
 {
     assert(slot_no < bitmap->slots);
@@ -64,41 +113,220 @@ bitmap_check(bitmap_t *bitmap, uint32_t slot_no)
     return result;
 }
 
+
 /**
- * Allocate a slot and mark as used. Returns the slot number of
- * the allocated slot, or `num_slots` if there is no free slot.
+ * Find the first free slot in [FROM, TO) by scanning whole words. Returns
+ * `slots` if none. Must hold the lock.
  */
-uint32_t
-bitmap_alloc(bitmap_t *bitmap)
+static uint32_t
+_bitmap_scan(bitmap_t *bitmap, uint32_t from, uint32_t to)
 {
-    spinlock_acquire(&(bitmap->lock));
+    for (uint32_t w = from / 32; w * 32 < to; ++w) {
+        uint32_t used = _bitmap_word(bitmap, w);
+        if (w == from / 32)     /** Treat slots before FROM as used. */
+            used |= ~(0xFFFFFFFF >> (from % 32));
+        if (used == 0xFFFFFFFF)
+            continue;
+
+        uint32_t slot_no = w * 32 + __builtin_clz(~used);
+        return slot_no < to ? slot_no : bitmap->slots;
+    }
+
+    return bitmap->slots;
+}
 
-    for (size_t i = 0; i < (bitmap->slots / 8); ++i) {
-        if (bitmap->bits[i] == 0xFF)
+/**
+ * Find the first used slot in [FROM, TO) by scanning whole words. Returns
+ * TO if none. Must hold the lock.
+ */
+static uint32_t
+_bitmap_scan_used(bitmap_t *bitmap, uint32_t from, uint32_t to)
+{
+    for (uint32_t w = from / 32; w * 32 < to; ++w) {
+        uint32_t used = _bitmap_word(bitmap, w);
+        if (w == from / 32)     /** Ignore slots before FROM. */
+            used &= 0xFFFFFFFF >> (from % 32);
+        if (used == 0)
             continue;
-        for (size_t j = 0; j < 8; ++j) {
-            if ((bitmap->bits[i] & (1 << (7 - j))) == 0) {
-                /** Found a free slot. */
-                uint32_t slot_no = i * 8 + j;
-                bitmap_set(bitmap, slot_no);
 
-                spinlock_release(&(bitmap->lock));
+        uint32_t slot_no = w * 32 + __builtin_clz(used);
+        return slot_no < to ? slot_no : to;
+    }
+
+    return to;
+}
+
+/**
+ * Find the first free slot in [FROM, TO), skipping regions that have
+ * no free slot. Returns `slots` if none. Must hold the lock.
+ */
+static uint32_t
+_bitmap_search(bitmap_t *bitmap, uint32_t from, uint32_t to)
+{
+    uint32_t region = from / BITMAP_REGION_SLOTS;
+    while (region * BITMAP_REGION_SLOTS < to) {
+        if (bitmap->region_free[region] > 0) {
+            uint32_t start = region * BITMAP_REGION_SLOTS;
+            uint32_t end = start + BITMAP_REGION_SLOTS;
+            uint32_t slot_no = _bitmap_scan(bitmap, from > start ? from : start,
+                                            end < to ? end : to);
+            if (slot_no < bitmap->slots)
                 return slot_no;
-            }
         }
+        region++;
     }
 
-    spinlock_release(&(bitmap->lock));
     return bitmap->slots;
 }
 
+/**
+ * Find COUNT free slots in a row within [FROM, TO), starting at a
+ * multiple of ALIGN. Returns the first slot, or `slots` if none. Must
+ * hold the lock.
+ */
+static uint32_t
+_bitmap_search_range(bitmap_t *bitmap, uint32_t count, uint32_t align,
+                     uint32_t from, uint32_t to)
+{
+    while (true) {
+        uint32_t start = _bitmap_search(bitmap, from, to);
+        if (start == bitmap->slots)
+            return bitmap->slots;
+        start = ((start + align - 1) / align) * align;
+        if (start >= to || count > to - start)
+            return bitmap->slots;
 
-/** Initialize the bitmap. BITS must have been allocated. */
+        uint32_t used = _bitmap_scan_used(bitmap, start, start + count);
+        if (used == start + count)
+            return start;
+        from = used + 1;
+    }
+}
+
+/**
+ * Allocate COUNT contiguous slots, the first being a multiple of ALIGN,
+ * and mark them as used. Searches first-fit from slot HINT, wrapping
+ * around; with `BITMAP_NO_HINT` (or an out-of-range hint), searches
+ * next-fit from where the last allocation ended. Returns the first slot
+ * allocated, or `num_slots` if there is no such free range.
+ */
+uint32_t
+bitmap_alloc_range(bitmap_t *bitmap, uint32_t count, uint32_t align,
+                   uint32_t hint)
+{
+    assert(count > 0 && align > 0);
+
+    spinlock_acquire(&(bitmap->lock));
+
+    if (bitmap->num_free < count) {
+        spinlock_release(&(bitmap->lock));
+        return bitmap->slots;
+    }
+
+    if (hint >= bitmap->slots)
+        hint = bitmap->hint;
+    uint32_t slot_no = _bitmap_search_range(bitmap, count, align, hint,
+                                            bitmap->slots);
+    if (slot_no == bitmap->slots && hint > 0)
+        slot_no = _bitmap_search_range(bitmap, count, align, 0, bitmap->slots);
+    if (slot_no == bitmap->slots) {
+        spinlock_release(&(bitmap->lock));
+        return bitmap->slots;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        _bitmap_set_locked(bitmap, slot_no + i);
+    bitmap->hint = slot_no + count < bitmap->slots ? slot_no + count : 0;
+
+    spinlock_release(&(bitmap->lock));
+    return slot_no;
+}
+
+/**
+ * Allocate a slot and mark as used. Searches next-fit from the slot
+ * after the last allocated one, wrapping around. Returns the slot number
+ * of the allocated slot, or `num_slots` if there is no free slot.
+ */
+uint32_t
+bitmap_alloc(bitmap_t *bitmap)
+{
+    return bitmap_alloc_range(bitmap, 1, 1, BITMAP_NO_HINT);
+}
+
+/** Returns the number of free slots. */
+uint32_t
+bitmap_num_free(bitmap_t *bitmap)
+{
+    return bitmap->num_free;
+}
+
+/**
+ * Returns the number of free slots among COUNT slots starting at SLOT_NO,
+ * from the summary layer. The range must consist of whole regions.
+ */
+uint32_t
+bitmap_range_free(bitmap_t *bitmap, uint32_t slot_no, uint32_t count)
+{
+    assert(slot_no % BITMAP_REGION_SLOTS == 0);
+    assert((slot_no + count) % BITMAP_REGION_SLOTS == 0
+           || slot_no + count == bitmap->slots);
+
+    uint32_t num_free = 0;
+
+    spinlock_acquire(&(bitmap->lock));
+    for (uint32_t region = slot_no / BITMAP_REGION_SLOTS;
+         region < BITMAP_NUM_REGIONS(slot_no + count); ++region) {
+        num_free += bitmap->region_free[region];
+    }
+    spinlock_release(&(bitmap->lock));
+
+    return num_free;
+}
+
+
+/**
+ * Recompute the summary layer from the bits, after they have been filled
+ * in by other means than the functions above (e.g., read from disk).
+ */
 void
-bitmap_init(bitmap_t *bitmap, uint8_t *bits, uint32_t slots)
+bitmap_rebuild(bitmap_t *bitmap)
+{
+    spinlock_acquire(&(bitmap->lock));
+
+    memset(bitmap->region_free, 0,
+           BITMAP_NUM_REGIONS(bitmap->slots) * sizeof(uint16_t));
+    bitmap->num_free = 0;
+
+    for (uint32_t w = 0; w * 32 < bitmap->slots; ++w) {
+        uint32_t valid = bitmap->slots - w * 32;
+        uint32_t used = _bitmap_word(bitmap, w);
+        if (valid < 32)     /** Slots past the end count as used. */
+            used |= 0xFFFFFFFF >> valid;
+
+        uint32_t free = 32 - _bitmap_popcount(used);
+        bitmap->region_free[(w * 32) / BITMAP_REGION_SLOTS] += free;
+        bitmap->num_free += free;
+    }
+
+    bitmap->hint = 0;
+
+    spinlock_release(&(bitmap->lock));
+}
+
+/**
+ * Initialize the bitmap with all slots free. BITS must have been
+ * allocated with `BITMAP_BITS_SIZE(slots)` bytes, and REGION_FREE with
+ * `BITMAP_NUM_REGIONS(slots)` entries.
+ */
+void
+bitmap_init(bitmap_t *bitmap, uint8_t *bits, uint16_t *region_free,
+            uint32_t slots)
 {
     bitmap->slots = slots;
     bitmap->bits = bits;
-    memset(bits, 0, slots / 8);
+    bitmap->region_free = region_free;
+    memset(bits, 0, BITMAP_BITS_SIZE(slots));
     spinlock_init(&(bitmap->lock), "bitmap's spinlock");
+
+    bitmap_rebuild(bitmap);
 }
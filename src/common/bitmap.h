@@ -13,29 +13,56 @@
 #include "../common/spinlock.h"
 
 
-/** Bitmap is simply a contiguous array of bits. */
+/**
+ * Bitmap is simply a contiguous array of bits, searched a 32-bit word at
+ * a time. On top of it sits a summary layer counting the free slots of
+ * each region of BITMAP_REGION_SLOTS slots, so that searches skip full
+ * regions without looking at their bits. Allocation is next-fit: it
+ * continues from where the last one ended.
+ */
 struct bitmap {
-    uint8_t *bits;      /** Must ensure zero'ed out at intialization. */
-    uint32_t slots;     /** Must be a multiple of 8. */
-    spinlock_t lock;    /** Lock protecting this bitmap. */
+    uint8_t *bits;          /** Must be dword-aligned & span whole dwords. */
+    uint32_t slots;         /** Must be a multiple of 8. */
+    uint16_t *region_free;  /** Free slots count of each region. */
+    uint32_t num_free;      /** Total free slots count. */
+    uint32_t hint;          /** Next-fit cursor, where to search next. */
+    spinlock_t lock;        /** Lock protecting this bitmap. */
 };
 typedef struct bitmap bitmap_t;
 
 
 /**
  * Every bit indicates the free/used state of a corresponding slot
- * of something. Slot number one-one maps to bit index.
+ * of something. Slot number one-one maps to bit index. Within a byte,
+ * the lowest slot is the most significant bit.
  */
 #define BITMAP_OUTER_IDX(slot_num) ((slot_num) / 8)
 #define BITMAP_INNER_IDX(slot_num) ((slot_num) % 8)
 
+#define BITMAP_REGION_SLOTS 1024
+#define BITMAP_NUM_REGIONS(slots) \
+    (((slots) + BITMAP_REGION_SLOTS - 1) / BITMAP_REGION_SLOTS)
+
+/** Bytes of bits storage needed for SLOTS slots, in whole dwords. */
+#define BITMAP_BITS_SIZE(slots) ((((slots) + 31) / 32) * 4)
+
+/** Hint value for continuing from the next-fit cursor. */
+#define BITMAP_NO_HINT 0xFFFFFFFF
+
 
 void bitmap_set(bitmap_t *bitmap, uint32_t slot_no);
 void bitmap_clear(bitmap_t *bitmap, uint32_t slot_no);
 bool bitmap_check(bitmap_t *bitmap, uint32_t slot_no);
 uint32_t bitmap_alloc(bitmap_t *bitmap);
+uint32_t bitmap_alloc_range(bitmap_t *bitmap, uint32_t count, uint32_t align,
+                            uint32_t hint);
+void bitmap_clear_range(bitmap_t *bitmap, uint32_t slot_no, uint32_t count);
+uint32_t bitmap_num_free(bitmap_t *bitmap);
+uint32_t bitmap_range_free(bitmap_t *bitmap, uint32_t slot_no, uint32_t count);
 
-void bitmap_init(bitmap_t *bitmap, uint8_t *bits, uint32_t slots);
+void bitmap_init(bitmap_t *bitmap, uint8_t *bits, uint16_t *region_free,
+                 uint32_t slots);
+void bitmap_rebuild(bitmap_t *bitmap);
 
 
 #endif
@@ -1,6 +1,7 @@
 /**
  * Parallel ATA (IDE) hard disk driver.
- * Assumes only port I/O (PIO) mode without DMA for now.
+ * Uses PCI bus-master DMA if the controller and the disk support it,
+ * otherwise falls back to port I/O (PIO) mode.
  */
 
 
@@ -9,6 +10,8 @@
 #include <stdbool.h>
 
 #include "idedisk.h"
+#include "pci.h"
+#include "iosched.h"
 
 #include "../common/port.h"
 #include "../common/debug.h"
@@ -17,6 +20,9 @@
 
 #include "../interrupt/isr.h"
 
+#include "../memory/paging.h"
+#include "../memory/slabs.h"
+
 #include "../filesys/block.h"
 
 #include "../process/process.h"
@@ -26,10 +32,44 @@
 /** Data returned by the IDENTIFY command during initialization. */
 static uint16_t ide_identify_data[256];
 
+/**
+ * Sectors moved per interrupt by READ/WRITE MULTIPLE, set up through
+ * SET MULTIPLE MODE at initialization. 0 means multiple mode is not
+ * available, so plain READ/WRITE SECTORS with one sector per interrupt
+ * is used instead.
+ */
+static uint8_t ide_multiple = 0;
+
+/**
+ * Bus-master DMA state. If DMA is enabled, BM_BASE is the I/O port base
+ * of the bus-master registers and PRD_TABLE is the (identity-mapped) page
+ * holding the PRD table of the request on the fly.
+ */
+static bool ide_dma_enabled = false;
+static uint16_t ide_bm_base = 0;
+static ide_prd_t *ide_prd_table = NULL;
+
+#define IDE_PRD_MAX (PAGE_SIZE / sizeof(ide_prd_t))
+
+
+/**
+ * Request currently on the fly, with its MERGE_NEXT chain of requests
+ * merged into the same disk command. Pending requests wait in the I/O
+ * scheduler.
+ */
+static block_request_t *ide_active = NULL;
+
+/**
+ * Memory of each block covered by the active disk command, flattened
+ * across the merged requests. Number of sectors transferred so far in
+ * PIO mode, and whether the command goes through DMA instead.
+ */
+#define IDE_MAX_BLOCKS_PER_CMD (IDE_MAX_SECTORS_PER_CMD / (BLOCK_SIZE / IDE_SECTOR_SIZE))
 
-/** IDE pending requests software queue. */
-static block_request_t *ide_queue_head = NULL;
-static block_request_t *ide_queue_tail = NULL;
+static uint8_t *ide_xfer_blocks[IDE_MAX_BLOCKS_PER_CMD];
+static uint32_t ide_xfer_num_blocks = 0;
+static uint32_t ide_xfer_sectors = 0;
+static bool ide_xfer_dma = false;
 
 static spinlock_t ide_lock;
 
@@ -53,55 +93,279 @@ _ide_wait_ready(void)
 }
 
 
+/** Total number of sectors covered by the active command. */
+static inline uint32_t
+_ide_xfer_total_sectors(void)
+{
+    return ide_xfer_num_blocks * (BLOCK_SIZE / IDE_SECTOR_SIZE);
+}
+
 /**
- * Start a request to IDE disk.
+ * Flatten the memory of blocks of a request and all requests merged
+ * after it into `ide_xfer_blocks`.
+ */
+static void
+_ide_xfer_collect(block_request_t *req)
+{
+    ide_xfer_num_blocks = 0;
+    for (; req != NULL; req = req->merge_next) {
+        for (uint32_t i = 0; i < req->num_blocks; ++i) {
+            assert(ide_xfer_num_blocks < IDE_MAX_BLOCKS_PER_CMD);
+            ide_xfer_blocks[ide_xfer_num_blocks++] =
+                (req->data_blocks != NULL) ? req->data_blocks[i]
+                                           : req->data + i * BLOCK_SIZE;
+        }
+    }
+}
+
+/**
+ * Move the next DRQ data block of the head request between its memory
+ * and the data port. Returns true if the whole request has then been
+ * transferred.
+ */
+static bool
+_ide_xfer_chunk(block_request_t *req)
+{
+    uint8_t sectors_per_block = BLOCK_SIZE / IDE_SECTOR_SIZE;
+    uint32_t total = _ide_xfer_total_sectors();
+    uint32_t chunk = ide_multiple > 0 ? ide_multiple : 1;
+    if (chunk > total - ide_xfer_sectors)
+        chunk = total - ide_xfer_sectors;
+
+    /** Must be a stream in 32-bit dwords, can't be in 8-bit bytes. */
+    for (uint32_t i = 0; i < chunk; ++i) {
+        uint32_t sector = ide_xfer_sectors + i;
+        uint8_t *data = ide_xfer_blocks[sector / sectors_per_block]
+                        + (sector % sectors_per_block) * IDE_SECTOR_SIZE;
+        if (req->dirty)
+            outsl(IDE_PORT_RW_DATA, data, IDE_SECTOR_SIZE / sizeof(uint32_t));
+        else
+            insl(IDE_PORT_RW_DATA, data, IDE_SECTOR_SIZE / sizeof(uint32_t));
+    }
+
+    ide_xfer_sectors += chunk;
+    return ide_xfer_sectors == total;
+}
+
+
+/**
+ * Fill the PRD table with the memory regions of the active command,
+ * merging physically adjacent blocks and splitting at 64KiB boundaries.
+ * Returns false if the memory is not suitable for DMA.
+ */
+static bool
+_ide_dma_prepare(void)
+{
+    uint32_t num_prds = 0;
+    uint32_t last_end = 0;
+    uint32_t last_size = 0;
+
+    for (uint32_t i = 0; i < ide_xfer_num_blocks; ++i) {
+        uint32_t addr = (uint32_t) ide_xfer_blocks[i];
+        if ((addr & 0x3) != 0 || addr + BLOCK_SIZE > PHYS_MAX)
+            return false;
+
+        uint32_t len = BLOCK_SIZE;
+        while (len > 0) {
+            uint32_t size = IDE_PRD_BOUNDARY - (addr % IDE_PRD_BOUNDARY);
+            if (size > len)
+                size = len;
+
+            /** Extend last region if contiguous and in the same 64KiB. */
+            if (num_prds > 0 && last_end == addr
+                && (addr % IDE_PRD_BOUNDARY) != 0) {
+                last_size += size;
+            } else {
+                if (num_prds >= IDE_PRD_MAX)
+                    return false;
+                ide_prd_table[num_prds].addr = addr;
+                ide_prd_table[num_prds].flags = 0;
+                num_prds++;
+                last_size = size;
+            }
+            ide_prd_table[num_prds - 1].size = (uint16_t) last_size;  /** 64KiB wraps to 0. */
+
+            last_end = addr + size;
+            addr += size;
+            len -= size;
+        }
+    }
+
+    ide_prd_table[num_prds - 1].flags = IDE_PRD_EOT;
+    return true;
+}
+
+
+/**
+ * Start a request to IDE disk, together with requests merged after it
+ * in its MERGE_NEXT chain, as one disk command. Uses DMA if enabled,
+ * allowed by the caller, and the memory is suitable.
  * Must be called with interrupts off.
  */
 static void
-_ide_start_req(block_request_t *req)
+_ide_start_req(block_request_t *req, bool allow_dma)
 {
     assert(req != NULL);
+    assert(req->num_blocks > 0 && req->num_blocks <= BLOCK_MAX_RUN);
     // if (req->block_no >= FILESYS_SIZE)
     //     error("idedisk: request block number exceeds file system size");
 
     uint8_t sectors_per_block = BLOCK_SIZE / IDE_SECTOR_SIZE;
     uint32_t sector_no = req->block_no * sectors_per_block;
 
+    _ide_xfer_collect(req);
+    uint32_t num_sectors = _ide_xfer_total_sectors();
+    assert(num_sectors <= IDE_MAX_SECTORS_PER_CMD);
+
+    ide_xfer_sectors = 0;
+    ide_xfer_dma = allow_dma && ide_dma_enabled && _ide_dma_prepare();
+
     /** Wait for disk to be in ready state. */
     _ide_wait_ready();
 
-    outb(IDE_PORT_RW_SECTORS, sectors_per_block);   /** Number of sectors. */
+    if (ide_xfer_dma) {
+        /** Point bus master at the PRD table and clear stale status. */
+        uint8_t bm_dir = req->dirty ? 0 : IDE_BM_CMD_READ;
+        outl(ide_bm_base + IDE_BM_REG_PRDT, (uint32_t) ide_prd_table);
+        outb(ide_bm_base + IDE_BM_REG_COMMAND, bm_dir);
+        outb(ide_bm_base + IDE_BM_REG_STATUS,
+             inb(ide_bm_base + IDE_BM_REG_STATUS)
+             | IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+    }
+
+    outb(IDE_PORT_RW_SECTORS, (uint8_t) num_sectors);      /** 256 wraps to 0. */
     outb(IDE_PORT_RW_LBA_LO,  sector_no         & 0xFF);   /** LBA address - low  bits. */
     outb(IDE_PORT_RW_LBA_MID, (sector_no >> 8)  & 0xFF);   /** LBA address - mid  bits. */
     outb(IDE_PORT_RW_LBA_HI,  (sector_no >> 16) & 0xFF);   /** LBA address - high bits. */
     outb(IDE_PORT_RW_SELECT, ide_select_entry(true, 0, sector_no)); /** LBA bits 24-27. */
 
-    /** If dirty, kick off a write with data, otherwise kick off a read. */
+    /**
+     * In DMA mode, issue the command and then start the bus master;
+     * the controller raises one interrupt when it's all done.
+     */
+    if (ide_xfer_dma) {
+        uint8_t bm_dir = req->dirty ? 0 : IDE_BM_CMD_READ;
+        outb(IDE_PORT_W_COMMAND, req->dirty ? IDE_CMD_WRITE_DMA
+                                            : IDE_CMD_READ_DMA);
+        outb(ide_bm_base + IDE_BM_REG_COMMAND, bm_dir | IDE_BM_CMD_START);
+        return;
+    }
+
+    /**
+     * If dirty, kick off a write and feed in the first DRQ block of data,
+     * the rest goes in the interrupt handler. Otherwise kick off a read.
+     */
     if (req->dirty) {
-        outb(IDE_PORT_W_COMMAND, (sectors_per_block == 1) ? IDE_CMD_WRITE
-                                                          : IDE_CMD_WRITE_MULTIPLE);
-        /** Must be a stream in 32-bit dwords, can't be in 8-bit bytes. */
-        outsl(IDE_PORT_RW_DATA, req->data, BLOCK_SIZE / sizeof(uint32_t));
+        outb(IDE_PORT_W_COMMAND, (ide_multiple > 0) ? IDE_CMD_WRITE_MULTIPLE
+                                                    : IDE_CMD_WRITE);
+        _ide_wait_ready();
+        _ide_xfer_chunk(req);
+    } else {
+        outb(IDE_PORT_W_COMMAND, (ide_multiple > 0) ? IDE_CMD_READ_MULTIPLE
+                                                    : IDE_CMD_READ);
+    }
+}
+
+/**
+ * Finish a DMA request upon its interrupt. Returns false if the interrupt
+ * is not from the bus master, in which case the request is still on the
+ * fly.
+ */
+static bool
+_ide_dma_finish(block_request_t *req)
+{
+    uint8_t bm_status = inb(ide_bm_base + IDE_BM_REG_STATUS);
+    if ((bm_status & IDE_BM_STATUS_IRQ) == 0)
+        return false;
+
+    /** Stop bus master, clear its status, and ack the disk interrupt. */
+    outb(ide_bm_base + IDE_BM_REG_COMMAND, 0);
+    outb(ide_bm_base + IDE_BM_REG_STATUS,
+         bm_status | IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+    uint8_t status = inb(IDE_PORT_R_STATUS);
+
+    if ((bm_status & IDE_BM_STATUS_ERR) != 0
+        || (status & (IDE_STATUS_DF | IDE_STATUS_ERR)) != 0) {
+        return true;    /** Error, leaves valid/dirty flags as-is. */
+    }
+
+    if (req->dirty)
+        req->dirty = false;
+    else
+        req->valid = true;
+    return true;
+}
+
+/**
+ * Continue a request after the disk signals readiness. Returns true if
+ * the request has been finished (successfully or not), or false if more
+ * data blocks are still to come.
+ */
+static bool
+_ide_continue_req(block_request_t *req)
+{
+    if (ide_xfer_dma)
+        return _ide_dma_finish(req);
+
+    if (!_ide_wait_ready())
+        return true;    /** Error, leaves valid/dirty flags as-is. */
+
+    if (!req->dirty) {
+        if (_ide_xfer_chunk(req))
+            req->valid = true;
+        else
+            return false;
     } else {
-        outb(IDE_PORT_W_COMMAND, (sectors_per_block == 1) ? IDE_CMD_READ
-                                                          : IDE_CMD_READ_MULTIPLE);
+        if (ide_xfer_sectors < _ide_xfer_total_sectors()) {
+            _ide_xfer_chunk(req);
+            return false;
+        }
+        req->dirty = false;
     }
+
+    return true;
 }
 
 /** Poll until an IDE request has been served. */
 static void
 _ide_poll_req(block_request_t *req)
 {
-    /** If is a read, get data now. */
-    if (!req->dirty) {
-        if (_ide_wait_ready()) {
-            /** Must be a stream in 32-bit dwords, can't be in 8-bit bytes. */
-            insl(IDE_PORT_RW_DATA, req->data, BLOCK_SIZE / sizeof(uint32_t));
-            req->valid = true;
+    while (!_ide_continue_req(req)) {}
+}
+
+
+/**
+ * Complete a served request: call its END_IO callback and account it in
+ * its batch, waking up the processes waiting on the batch if it is the
+ * last one. The request may not be touched afterwards, as the callback
+ * or the waiters could reuse it.
+ * Must be called with IDE lock held.
+ */
+static void
+_ide_complete_req(block_request_t *req)
+{
+    bool ok = req->valid && !req->dirty;
+    block_batch_t *batch = req->batch;
+
+    if (req->end_io != NULL)
+        req->end_io(req, ok);
+
+    if (batch != NULL) {
+        if (!ok)
+            batch->failed = true;
+        assert(batch->pending > 0);
+        batch->pending--;
+
+        if (batch->pending == 0) {
+            spinlock_acquire(&ptable_lock);
+            for (process_t *proc = ptable; proc < &ptable[MAX_PROCS]; ++proc) {
+                if (proc->state == BLOCKED && proc->block_on == ON_IDEDISK
+                    && proc->wait_batch == batch) {
+                    process_unblock(proc);
+                }
+            }
+            spinlock_release(&ptable_lock);
         }
-    } else {
-        if (_ide_wait_ready())
-            req->dirty = false;
     }
 }
 
@@ -114,41 +378,110 @@ idedisk_interrupt_handler(interrupt_state_t *state)
 
     spinlock_acquire(&ide_lock);
 
-    /** Head of queue is the active request currently on the fly. */
-    block_request_t *req = ide_queue_head;
+    /** The active request currently on the fly. */
+    block_request_t *req = ide_active;
     if (req == NULL) {
         spinlock_release(&ide_lock);
         return;
     }
 
-    ide_queue_head = ide_queue_head->next;
-
     /**
-     * This "poll" should finish immediately, as the interrupt indicates
-     * that the disk must have been ready.
+     * The interrupt indicates that the disk must have been ready for the
+     * next DRQ data block. If more blocks are to come, keep the request
+     * active and wait for the next interrupt.
      */
-    _ide_poll_req(req);
+    if (!_ide_continue_req(req)) {
+        spinlock_release(&ide_lock);
+        return;
+    }
 
-    /** Wake up the process waiting on this request. */
-    spinlock_acquire(&ptable_lock);
-    for (process_t *proc = ptable; proc < &ptable[MAX_PROCS]; ++proc) {
-        if (proc->state == BLOCKED && proc->block_on == ON_IDEDISK
-            && proc->wait_req == req) {
-            process_unblock(proc);
-        }
+    /** Merged requests finish together with the first one. */
+    bool valid = req->valid, dirty = req->dirty;
+    block_request_t *done = req;
+    while (done != NULL) {
+        block_request_t *next = done->merge_next;
+        done->valid = valid;
+        done->dirty = dirty;
+        _ide_complete_req(done);
+        done = next;
     }
-    spinlock_release(&ptable_lock);
 
-    /** If more requests in queue, start the disk on the next one. */
-    if (ide_queue_head != NULL)
-        _ide_start_req(ide_queue_head);
-    else
-        ide_queue_tail = NULL;
+    /** If more requests are pending, start the disk on the next one. */
+    ide_active = iosched_dispatch();
+    if (ide_active != NULL)
+        _ide_start_req(ide_active, true);
 
     spinlock_release(&ide_lock);
 }
 
 
+/**
+ * Set up bus-master DMA if both the disk and the PCI IDE controller
+ * support it. Leaves DMA disabled (i.e., uses PIO) otherwise.
+ */
+static void
+_ide_dma_init(void)
+{
+    ide_dma_enabled = false;
+
+    uint16_t mwdma = ide_identify_data[IDE_IDENT_MWDMA_MODES];
+    uint16_t udma = ide_identify_data[IDE_IDENT_UDMA_MODES];
+    if ((ide_identify_data[IDE_IDENT_CAPABILITIES] & IDE_IDENT_CAP_DMA) == 0
+        || ((mwdma & 0x07) == 0 && (udma & 0x7F) == 0)) {
+        return;
+    }
+
+    /** Find the bus-master capable IDE controller on PCI. */
+    pci_dev_t dev;
+    if (!pci_find_class(IDE_PCI_CLASS, IDE_PCI_SUBCLASS, &dev))
+        return;
+    uint8_t prog_if = (pci_config_read(&dev, PCI_CONFIG_CLASS) >> 8) & 0xFF;
+    if ((prog_if & IDE_PCI_PROGIF_BM) == 0)
+        return;
+    uint32_t bar4 = pci_config_read(&dev, PCI_CONFIG_BAR4);
+    if ((bar4 & 0x1) == 0)      /** Must be in I/O space. */
+        return;
+
+    /** Enable I/O space access and bus mastering of the controller. */
+    uint32_t command = pci_config_read(&dev, PCI_CONFIG_COMMAND);
+    command |= PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER;
+    pci_config_write(&dev, PCI_CONFIG_COMMAND, command);
+
+    /**
+     * If firmware has not selected any DMA transfer mode on the disk,
+     * select the highest supported multiword DMA mode.
+     */
+    if ((mwdma & 0x0700) == 0 && (udma & 0x7F00) == 0) {
+        if ((mwdma & 0x07) == 0)
+            return;
+        uint8_t mode = (mwdma & 0x04) ? 2 : (mwdma & 0x02) ? 1 : 0;
+        _ide_wait_ready();
+        outb(IDE_PORT_W_FEATURES, IDE_FEATURE_XFER_MODE);
+        outb(IDE_PORT_RW_SECTORS, IDE_XFER_MODE_MWDMA | mode);
+        outb(IDE_PORT_RW_SELECT, ide_select_entry(true, 0, 0));
+        outb(IDE_PORT_W_COMMAND, IDE_CMD_SET_FEATURES);
+        if (!_ide_wait_ready()) {
+            warn("idedisk_init: failed to select DMA mode, using PIO");
+            return;
+        }
+    }
+
+    ide_prd_table = (ide_prd_t *) salloc_page();
+    if (ide_prd_table == NULL) {
+        warn("idedisk_init: failed to allocate PRD table, using PIO");
+        return;
+    }
+
+    ide_bm_base = bar4 & 0xFFFC;
+    outb(ide_bm_base + IDE_BM_REG_COMMAND, 0);
+    outb(ide_bm_base + IDE_BM_REG_STATUS,
+         inb(ide_bm_base + IDE_BM_REG_STATUS) | IDE_BM_STATUS_DRV0_DMA
+         | IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+
+    ide_dma_enabled = true;
+}
+
+
 /**
  * Initialize a single IDE disk 0 on the default primary bus. Registers the
  * IDE request interrupt ISR handler.
@@ -156,8 +489,8 @@ idedisk_interrupt_handler(interrupt_state_t *state)
 void
 idedisk_init(void)
 {
-    ide_queue_head = NULL;
-    ide_queue_tail = NULL;
+    ide_active = NULL;
+    iosched_init(&iosched_deadline);
 
     spinlock_init(&ide_lock, "ide_lock");
     
@@ -195,62 +528,118 @@ idedisk_init(void)
     /** Must be a stream in 32-bit dwords. */
     memset(ide_identify_data, 0, 256 * sizeof(uint16_t));
     insl(IDE_PORT_RW_DATA, ide_identify_data, 256 * sizeof(uint16_t) / sizeof(uint32_t));
+
+    /**
+     * Enable multiple mode with the largest supported DRQ block size (up
+     * to a cap), so that a multi-block request raises one interrupt per
+     * DRQ block instead of one per sector. The setting is a power of two.
+     */
+    uint8_t max_multiple = ide_identify_data[IDE_IDENT_MAX_MULTIPLE] & 0xFF;
+    if (max_multiple > IDE_MAX_MULTIPLE)
+        max_multiple = IDE_MAX_MULTIPLE;
+    uint8_t multiple = 1;
+    while (multiple * 2 <= max_multiple)
+        multiple *= 2;
+
+    ide_multiple = 0;
+    if (max_multiple > 0) {
+        _ide_wait_ready();
+        outb(IDE_PORT_RW_SECTORS, multiple);
+        outb(IDE_PORT_RW_SELECT, ide_select_entry(true, 0, 0));
+        outb(IDE_PORT_W_COMMAND, IDE_CMD_SET_MULTIPLE);
+        if (_ide_wait_ready())
+            ide_multiple = multiple;
+        else
+            warn("idedisk_init: SET MULTIPLE MODE failed, using single sectors");
+    }
+
+    _ide_dma_init();
 }
 
 
 /**
- * Start and wait for a block request to complete. If request is dirty,
- * write to disk, clear dirty, and set valid. Else if request is not
- * valid, read from disk into data and set valid. Returns true on success
- * and false if error appears in IDE port communications.
+ * Submit a block request asynchronously, returning without waiting for
+ * it to be served. If request is dirty, it will be written to disk, then
+ * dirty cleared. Else if request is not valid, data will be read from
+ * disk into it, then valid set. Upon completion, the request's END_IO
+ * callback (set by caller, may be NULL) is called and BATCH (may be NULL)
+ * is accounted. The request must stay alive until then.
  */
-bool
-idedisk_do_req(block_request_t *req)
+void
+idedisk_submit(block_request_t *req, block_batch_t *batch)
 {
-    process_t *proc = running_proc();
-
     if (req->valid && !req->dirty)
-        error("idedisk_do_req: request valid and not dirty, nothing to do");
+        error("idedisk_submit: request valid and not dirty, nothing to do");
     if (!req->valid && req->dirty)
-        error("idedisk_do_req: caught a dirty request that is not valid");
+        error("idedisk_submit: caught a dirty request that is not valid");
 
     spinlock_acquire(&ide_lock);
 
-    /** Append to IDE pending requests queue. */
-    req->next = NULL;
-    if (ide_queue_tail != NULL)
-        ide_queue_tail->next = req;
-    else
-        ide_queue_head = req;
-    ide_queue_tail = req;
+    req->batch = batch;
+    if (batch != NULL)
+        batch->pending++;
 
-    /** Start he disk device if it was idle. */
-    if (ide_queue_head == req)
-        _ide_start_req(req);
+    /** Hand to the I/O scheduler, and start the disk if it was idle. */
+    iosched_add(req);
+    if (ide_active == NULL) {
+        ide_active = iosched_dispatch();
+        _ide_start_req(ide_active, true);
+    }
 
-    /** Wait for this request to have been served. */
-    spinlock_acquire(&ptable_lock);
     spinlock_release(&ide_lock);
+}
 
-    proc->wait_req = req;
-    process_block(ON_IDEDISK);
-    proc->wait_req = NULL;
+/**
+ * Wait for all requests submitted in a batch to complete. Returns true
+ * if all of them succeeded, or false if any failed.
+ *
+ * Keeps waiting even if the process gets killed in the meantime, since
+ * the requests might refer to memory that must stay alive till they are
+ * served.
+ */
+bool
+idedisk_wait(block_batch_t *batch)
+{
+    process_t *proc = running_proc();
 
-    spinlock_release(&ptable_lock);
     spinlock_acquire(&ide_lock);
 
-    /**
-     * Could be re=scheduld when an IDE interrupt comes saying that this
-     * request has been served. If valid is not set at this time, it means
-     * error occurred.
-     */
-    if (!req->valid || req->dirty) {
-        warn("idedisk_do_req: error occurred in IDE disk request");
+    while (batch->pending > 0) {
+        spinlock_acquire(&ptable_lock);
         spinlock_release(&ide_lock);
-        return false;
+
+        proc->wait_batch = batch;
+        process_block(ON_IDEDISK);
+        proc->wait_batch = NULL;
+
+        spinlock_release(&ptable_lock);
+        spinlock_acquire(&ide_lock);
     }
 
+    bool success = !batch->failed;
     spinlock_release(&ide_lock);
+    return success;
+}
+
+/**
+ * Start and wait for a block request to complete, as a batch of one.
+ * Returns true on success and false if error appears in IDE port
+ * communications.
+ */
+bool
+idedisk_do_req(block_request_t *req)
+{
+    block_batch_t batch;
+    block_batch_init(&batch);
+
+    req->end_io = NULL;
+    idedisk_submit(req, &batch);
+
+    if (!idedisk_wait(&batch)) {
+        warn("idedisk_do_req: error occurred in IDE disk request");
+        return false;
+    }
+
     return true;
 }
 
@@ -263,7 +652,8 @@ idedisk_do_req_at_boot(block_request_t *req)
     if (!req->valid && req->dirty)
         error("idedisk_do_req: caught a dirty request that is not valid");
 
-    _ide_start_req(req);
+    req->merge_next = NULL;
+    _ide_start_req(req, false);
     _ide_poll_req(req);
 
     if (!req->valid || req->dirty) {
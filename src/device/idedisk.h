@@ -1,6 +1,7 @@
 /**
  * Parallel ATA (IDE) hard disk driver.
- * Assumes only port I/O (PIO) mode without DMA for now.
+ * Uses PCI bus-master DMA if the controller and the disk support it,
+ * otherwise falls back to port I/O (PIO) mode.
  */
 
 
@@ -75,7 +76,71 @@
 #define IDE_CMD_WRITE          0x30
 #define IDE_CMD_READ_MULTIPLE  0xC4
 #define IDE_CMD_WRITE_MULTIPLE 0xC5
+#define IDE_CMD_SET_MULTIPLE   0xC6
+#define IDE_CMD_READ_DMA       0xC8
+#define IDE_CMD_WRITE_DMA      0xCA
 #define IDE_CMD_IDENTIFY       0xEC
+#define IDE_CMD_SET_FEATURES   0xEF
+
+/** SET FEATURES subcommand for setting the transfer mode. */
+#define IDE_FEATURE_XFER_MODE  0x03
+#define IDE_XFER_MODE_MWDMA    0x20     /** OR'ed with the mode number. */
+
+
+/**
+ * A single command transfers at most 256 sectors (sector count register
+ * value 0 means 256). READ/WRITE MULTIPLE moves up to `ide_multiple`
+ * sectors per interrupt, capped at the value below.
+ */
+#define IDE_MAX_SECTORS_PER_CMD 256
+#define IDE_MAX_MULTIPLE        16
+
+/** Fields of interest in IDENTIFY data words. */
+#define IDE_IDENT_MAX_MULTIPLE  47      /** Bits 7:0: max sectors per DRQ. */
+#define IDE_IDENT_CAPABILITIES  49      /** Bit 8: DMA supported. */
+#define IDE_IDENT_MWDMA_MODES   63      /** Bits 2:0 supported, 10:8 selected. */
+#define IDE_IDENT_UDMA_MODES    88      /** Bits 6:0 supported, 14:8 selected. */
+
+#define IDE_IDENT_CAP_DMA       (1 << 8)
+
+
+/**
+ * PCI bus-master IDE controller (e.g., Intel PIIX, as emulated by QEMU),
+ * found by its PCI class code. Its registers are I/O ports at offsets
+ * from the base given in BAR4; only the primary channel is used.
+ * See https://wiki.osdev.org/ATA/ATAPI_using_DMA.
+ */
+#define IDE_PCI_CLASS           0x01    /** Mass storage controller. */
+#define IDE_PCI_SUBCLASS        0x01    /** IDE controller. */
+#define IDE_PCI_PROGIF_BM       (1 << 7)
+
+#define IDE_BM_REG_COMMAND      0x0
+#define IDE_BM_REG_STATUS       0x2
+#define IDE_BM_REG_PRDT         0x4
+
+#define IDE_BM_CMD_START        (1 << 0)
+#define IDE_BM_CMD_READ         (1 << 3)    /** Direction disk -> memory. */
+
+#define IDE_BM_STATUS_ACTIVE    (1 << 0)
+#define IDE_BM_STATUS_ERR       (1 << 1)    /** Write 1 to clear. */
+#define IDE_BM_STATUS_IRQ       (1 << 2)    /** Write 1 to clear. */
+#define IDE_BM_STATUS_DRV0_DMA  (1 << 5)
+
+
+/**
+ * Physical region descriptor (PRD) of a DMA scatter-gather list. A region
+ * must be dword aligned and must not cross a 64KiB boundary. Size 0 means
+ * 64KiB. The PRD table itself lives in one page.
+ */
+struct ide_prd {
+    uint32_t addr;
+    uint16_t size;
+    uint16_t flags;
+} __attribute__((packed));
+typedef struct ide_prd ide_prd_t;
+
+#define IDE_PRD_EOT             (1 << 15)   /** Last entry of table. */
+#define IDE_PRD_BOUNDARY        0x10000
 
 
 /**
@@ -100,6 +165,9 @@ ide_select_entry(bool use_lba, uint8_t drive, uint32_t sector_no)
 
 void idedisk_init();
 
+void idedisk_submit(block_request_t *req, block_batch_t *batch);
+bool idedisk_wait(block_batch_t *batch);
+
 bool idedisk_do_req(block_request_t *req);
 bool idedisk_do_req_at_boot(block_request_t *req);
 
@@ -0,0 +1,266 @@
+/**
+ * I/O scheduler in front of the IDE disk request queue, with pluggable
+ * policies. Adjacent requests are merged into one disk command.
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "iosched.h"
+#include "timer.h"
+
+#include "../common/debug.h"
+
+#include "../filesys/block.h"
+
+
+/** Policy in use. */
+static iosched_ops_t *iosched = NULL;
+
+
+/**
+ * Queued requests sorted by block number, linked through `next`. Shared
+ * by both policies. HEAD_POS is the disk head position, i.e., the block
+ * right after the last dispatched request.
+ */
+static block_request_t *sorted_head = NULL;
+static uint32_t head_pos = 0;
+
+
+static void
+_sorted_insert(block_request_t *req)
+{
+    block_request_t **link = &sorted_head;
+    while (*link != NULL && (*link)->block_no <= req->block_no)
+        link = &((*link)->next);
+    req->next = *link;
+    *link = req;
+}
+
+static void
+_sorted_remove(block_request_t *req)
+{
+    block_request_t **link = &sorted_head;
+    while (*link != NULL && *link != req)
+        link = &((*link)->next);
+    assert(*link == req);
+    *link = req->next;
+    req->next = NULL;
+}
+
+/**
+ * C-LOOK pick: the first request at or after the head position, wrapping
+ * around to the lowest block if there is none.
+ */
+static block_request_t *
+_sorted_pick_clook(void)
+{
+    for (block_request_t *req = sorted_head; req != NULL; req = req->next) {
+        if (req->block_no >= head_pos)
+            return req;
+    }
+    return sorted_head;
+}
+
+static block_request_t *
+_sorted_find(uint32_t block_no, bool write, uint32_t max_blocks)
+{
+    for (block_request_t *req = sorted_head; req != NULL; req = req->next) {
+        if (req->block_no > block_no)
+            break;
+        if (req->block_no == block_no && req->dirty == write
+            && req->num_blocks <= max_blocks) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+
+/** C-LOOK policy: one-way elevator sweep in block number order. */
+static void
+_clook_add(block_request_t *req)
+{
+    _sorted_insert(req);
+}
+
+static block_request_t *
+_clook_dispatch(void)
+{
+    block_request_t *req = _sorted_pick_clook();
+    if (req != NULL)
+        _sorted_remove(req);
+    return req;
+}
+
+static block_request_t *
+_clook_take(uint32_t block_no, bool write, uint32_t max_blocks)
+{
+    block_request_t *req = _sorted_find(block_no, write, max_blocks);
+    if (req != NULL)
+        _sorted_remove(req);
+    return req;
+}
+
+iosched_ops_t iosched_clook = {
+    .name     = "c-look",
+    .add      = _clook_add,
+    .dispatch = _clook_dispatch,
+    .take     = _clook_take,
+};
+
+
+/**
+ * Deadline policy: C-LOOK order normally, but a request whose deadline
+ * has passed is served first, reads before writes. Requests are also
+ * kept in per-direction arrival FIFOs linked through `fifo_next`, so the
+ * oldest one is at the front.
+ */
+static block_request_t *read_fifo = NULL;
+static block_request_t *write_fifo = NULL;
+
+static void
+_fifo_append(block_request_t **fifo, block_request_t *req)
+{
+    block_request_t **link = fifo;
+    while (*link != NULL)
+        link = &((*link)->fifo_next);
+    req->fifo_next = NULL;
+    *link = req;
+}
+
+static void
+_fifo_remove(block_request_t **fifo, block_request_t *req)
+{
+    block_request_t **link = fifo;
+    while (*link != NULL && *link != req)
+        link = &((*link)->fifo_next);
+    assert(*link == req);
+    *link = req->fifo_next;
+    req->fifo_next = NULL;
+}
+
+static void
+_deadline_add(block_request_t *req)
+{
+    spinlock_acquire(&timer_tick_lock);
+    uint32_t now = timer_tick;
+    spinlock_release(&timer_tick_lock);
+
+    if (req->dirty) {
+        req->deadline = now + IOSCHED_WRITE_EXPIRE;
+        _fifo_append(&write_fifo, req);
+    } else {
+        req->deadline = now + IOSCHED_READ_EXPIRE;
+        _fifo_append(&read_fifo, req);
+    }
+    _sorted_insert(req);
+}
+
+static void
+_deadline_remove(block_request_t *req)
+{
+    _fifo_remove(req->dirty ? &write_fifo : &read_fifo, req);
+    _sorted_remove(req);
+}
+
+static block_request_t *
+_deadline_dispatch(void)
+{
+    spinlock_acquire(&timer_tick_lock);
+    uint32_t now = timer_tick;
+    spinlock_release(&timer_tick_lock);
+
+    block_request_t *req = NULL;
+    if (read_fifo != NULL && (int32_t) (now - read_fifo->deadline) >= 0)
+        req = read_fifo;
+    else if (write_fifo != NULL && (int32_t) (now - write_fifo->deadline) >= 0)
+        req = write_fifo;
+    else
+        req = _sorted_pick_clook();
+
+    if (req != NULL)
+        _deadline_remove(req);
+    return req;
+}
+
+static block_request_t *
+_deadline_take(uint32_t block_no, bool write, uint32_t max_blocks)
+{
+    block_request_t *req = _sorted_find(block_no, write, max_blocks);
+    if (req != NULL)
+        _deadline_remove(req);
+    return req;
+}
+
+iosched_ops_t iosched_deadline = {
+    .name     = "deadline",
+    .add      = _deadline_add,
+    .dispatch = _deadline_dispatch,
+    .take     = _deadline_take,
+};
+
+
+/** Queue a request to the current policy. Must hold the IDE lock. */
+void
+iosched_add(block_request_t *req)
+{
+    req->next = NULL;
+    req->fifo_next = NULL;
+    req->merge_next = NULL;
+    iosched->add(req);
+}
+
+/**
+ * Pick the next request to serve, and chain queued requests of the same
+ * direction that continue right after it into its MERGE_NEXT list, so
+ * they are served by one disk command. Returns NULL if nothing queued.
+ * Must hold the IDE lock.
+ */
+block_request_t *
+iosched_dispatch(void)
+{
+    block_request_t *req = iosched->dispatch();
+    if (req == NULL)
+        return NULL;
+
+    uint32_t num_blocks = req->num_blocks;
+    block_request_t *last = req;
+    while (true) {
+        block_request_t *next = iosched->take(req->block_no + num_blocks,
+                                              req->dirty,
+                                              IOSCHED_MAX_MERGE_BLOCKS - num_blocks);
+        if (next == NULL)
+            break;
+
+        last->merge_next = next;
+        last = next;
+        num_blocks += next->num_blocks;
+    }
+    last->merge_next = NULL;
+
+    head_pos = req->block_no + num_blocks;
+    return req;
+}
+
+/** Name of the policy in use. */
+const char *
+iosched_name(void)
+{
+    return iosched->name;
+}
+
+
+/** Initialize the I/O scheduler to use given policy. */
+void
+iosched_init(iosched_ops_t *ops)
+{
+    sorted_head = NULL;
+    read_fifo = NULL;
+    write_fifo = NULL;
+    head_pos = 0;
+
+    iosched = ops;
+}
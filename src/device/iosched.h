@@ -0,0 +1,62 @@
+/**
+ * I/O scheduler in front of the IDE disk request queue, with pluggable
+ * policies. Adjacent requests are merged into one disk command.
+ */
+
+
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../filesys/block.h"
+
+
+/**
+ * Operations of a scheduling policy. All are called with the IDE lock
+ * held.
+ *   - add:      queue a new request
+ *   - dispatch: remove and return the request to serve next, or NULL if
+ *               nothing is queued
+ *   - take:     remove and return a queued request starting exactly at
+ *               BLOCK_NO in the given direction and of at most MAX_BLOCKS
+ *               blocks, or NULL if none; used for merging
+ */
+struct iosched_ops {
+    const char *name;
+    void (*add)(block_request_t *req);
+    block_request_t *(*dispatch)(void);
+    block_request_t *(*take)(uint32_t block_no, bool write,
+                             uint32_t max_blocks);
+};
+typedef struct iosched_ops iosched_ops_t;
+
+
+/** Available policies. */
+extern iosched_ops_t iosched_clook;
+extern iosched_ops_t iosched_deadline;
+
+
+/**
+ * Deadline policy expiry times in timer ticks. Reads are what processes
+ * usually block on, so they expire much sooner than writes.
+ */
+#define IOSCHED_READ_EXPIRE  5      /** 50ms. */
+#define IOSCHED_WRITE_EXPIRE 50     /** 500ms. */
+
+
+/** Max number of blocks merged into one dispatched disk command. */
+#define IOSCHED_MAX_MERGE_BLOCKS 128
+
+
+void iosched_init(iosched_ops_t *ops);
+
+void iosched_add(block_request_t *req);
+block_request_t *iosched_dispatch(void);
+
+const char *iosched_name(void);
+
+
+#endif
@@ -0,0 +1,80 @@
+/**
+ * PCI configuration space access through the legacy configuration
+ * mechanism #1 (I/O ports 0xCF8 and 0xCFC).
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pci.h"
+
+#include "../common/port.h"
+
+
+/** Configuration address of the dword at OFFSET of a device function. */
+static inline uint32_t
+_pci_config_addr(pci_dev_t *dev, uint8_t offset)
+{
+    return (1 << 31)                            /** Enable bit. */
+           | ((uint32_t) dev->bus  << 16)
+           | ((uint32_t) dev->slot << 11)
+           | ((uint32_t) dev->func << 8)
+           | (offset & 0xFC);
+}
+
+
+/** Read the configuration dword at OFFSET of a device function. */
+uint32_t
+pci_config_read(pci_dev_t *dev, uint8_t offset)
+{
+    outl(PCI_PORT_CONFIG_ADDR, _pci_config_addr(dev, offset));
+    return inl(PCI_PORT_CONFIG_DATA);
+}
+
+/** Write the configuration dword at OFFSET of a device function. */
+void
+pci_config_write(pci_dev_t *dev, uint8_t offset, uint32_t val)
+{
+    outl(PCI_PORT_CONFIG_ADDR, _pci_config_addr(dev, offset));
+    outl(PCI_PORT_CONFIG_DATA, val);
+}
+
+
+/**
+ * Brute-force scan all buses for the first device function with given
+ * CLASS and SUBCLASS code. Fills DEV and returns true if found.
+ */
+bool
+pci_find_class(uint8_t class, uint8_t subclass, pci_dev_t *dev)
+{
+    for (uint32_t bus = 0; bus < PCI_MAX_BUSES; ++bus) {
+        for (uint8_t slot = 0; slot < PCI_MAX_SLOTS; ++slot) {
+            dev->bus = bus;
+            dev->slot = slot;
+            dev->func = 0;
+            if ((pci_config_read(dev, PCI_CONFIG_VENDOR_ID) & 0xFFFF) == 0xFFFF)
+                continue;
+
+            uint8_t num_funcs = 1;
+            if (((pci_config_read(dev, PCI_CONFIG_HEADER_TYPE) >> 16)
+                 & PCI_HEADER_MULTI_FUNC) != 0) {
+                num_funcs = PCI_MAX_FUNCS;
+            }
+
+            for (uint8_t func = 0; func < num_funcs; ++func) {
+                dev->func = func;
+                if ((pci_config_read(dev, PCI_CONFIG_VENDOR_ID) & 0xFFFF) == 0xFFFF)
+                    continue;
+
+                uint32_t class_reg = pci_config_read(dev, PCI_CONFIG_CLASS);
+                if (((class_reg >> 24) & 0xFF) == class
+                    && ((class_reg >> 16) & 0xFF) == subclass) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,61 @@
+/**
+ * PCI configuration space access through the legacy configuration
+ * mechanism #1 (I/O ports 0xCF8 and 0xCFC).
+ */
+
+
+#ifndef PCI_H
+#define PCI_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/**
+ * Configuration address and data ports.
+ * See https://wiki.osdev.org/PCI#Configuration_Space_Access_Mechanism_.231.
+ */
+#define PCI_PORT_CONFIG_ADDR 0xCF8
+#define PCI_PORT_CONFIG_DATA 0xCFC
+
+#define PCI_MAX_BUSES 256
+#define PCI_MAX_SLOTS 32
+#define PCI_MAX_FUNCS 8
+
+
+/**
+ * Offsets of fields of interest in a type-0 configuration header. Reads
+ * and writes are always done on the aligned dword containing them.
+ * See https://wiki.osdev.org/PCI#Common_Header_Fields.
+ */
+#define PCI_CONFIG_VENDOR_ID   0x00     /** Low 16 bits, 0xFFFF if absent. */
+#define PCI_CONFIG_COMMAND     0x04     /** Low 16 bits. */
+#define PCI_CONFIG_CLASS       0x08     /** Class, subclass, prog IF, rev. */
+#define PCI_CONFIG_HEADER_TYPE 0x0C     /** Bits 23:16. */
+#define PCI_CONFIG_BAR4        0x20
+
+/** Command register flags. */
+#define PCI_COMMAND_IO_SPACE   (1 << 0)
+#define PCI_COMMAND_BUS_MASTER (1 << 2)
+
+/** Header type bit 7 set means a multi-function device. */
+#define PCI_HEADER_MULTI_FUNC  (1 << 7)
+
+
+/** Location of a PCI device function. */
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+};
+typedef struct pci_dev pci_dev_t;
+
+
+uint32_t pci_config_read(pci_dev_t *dev, uint8_t offset);
+void pci_config_write(pci_dev_t *dev, uint8_t offset, uint32_t val);
+
+bool pci_find_class(uint8_t class, uint8_t subclass, pci_dev_t *dev);
+
+
+#endif
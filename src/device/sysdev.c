@@ -35,7 +35,7 @@ syscall_kbdstr(void)
 
     if (!sysarg_get_uint(1, &len))
         return SYS_FAIL_RC;
-    if (!sysarg_get_mem(0, &buf, len))
+    if (!sysarg_get_mem(0, &buf, len, true))
         return SYS_FAIL_RC;
 
     return (int32_t) (keyboard_getstr(buf, len));
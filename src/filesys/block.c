@@ -8,22 +8,761 @@
 
 #include "block.h"
 #include "vsfs.h"
+#include "journal.h"
 
 #include "../common/debug.h"
 #include "../common/string.h"
+#include "../common/spinlock.h"
+#include "../common/parklock.h"
 
 #include "../device/idedisk.h"
 
+#include "../memory/kheap.h"
+#include "../memory/paging.h"
+
+#include "../process/process.h"
+#include "../process/scheduler.h"
+
+
+/**
+ * Block buffer cache - a fixed number of block buffers, indexed by a
+ * hash table on block number and kept on a doubly-linked LRU list. The
+ * head of the LRU list is the most recently used buffer, and eviction
+ * picks the unreferenced buffer closest to the tail.
+ *
+ * The `bcache_lock` protects the hash chains, the LRU list, and the
+ * `block_no` & `ref_cnt` fields of all buffers. A buffer's own parking
+ * lock protects its data and is held across disk I/O.
+ */
+static block_request_t *bcache;
+static uint8_t *bcache_data;
+static uint32_t bcache_size;
+
+static block_request_t *bcache_hash[BLOCK_CACHE_HASH_SIZE];
+static block_request_t *bcache_lru_head;
+static block_request_t *bcache_lru_tail;
+
+static spinlock_t bcache_lock;
+
+/** Number of dirty buffers, protected by `bcache_lock`. */
+static uint32_t bcache_dirty_cnt;
+
+/** The background flusher thread. */
+static process_t *flusher;
+
+
+/**
+ * Data blocks whose content on disk is stale: free blocks, and allocated
+ * blocks not written since allocation. A stale block reads as zeros
+ * without touching the disk, and gets zeroed on disk only if a commit is
+ * about to point to it before its real content has been written. Built
+ * from the data bitmap at mount, as free blocks hold garbage.
+ */
+static bitmap_t stale_bitmap;
+
+/** An all-zero block, source of writes that zero out stale blocks. */
+static uint8_t zero_block[BLOCK_SIZE] __attribute__((aligned(4)));
+
+
+/** LRU list & hash chain manipulations, must hold `bcache_lock`. */
+static void
+_bcache_lru_remove(block_request_t *buf)
+{
+    if (buf->lru_prev != NULL)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        bcache_lru_head = buf->lru_next;
+    if (buf->lru_next != NULL)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        bcache_lru_tail = buf->lru_prev;
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+}
+
+static void
+_bcache_lru_push_head(block_request_t *buf)
+{
+    buf->lru_prev = NULL;
+    buf->lru_next = bcache_lru_head;
+    if (bcache_lru_head != NULL)
+        bcache_lru_head->lru_prev = buf;
+    else
+        bcache_lru_tail = buf;
+    bcache_lru_head = buf;
+}
+
+static void
+_bcache_hash_remove(block_request_t *buf)
+{
+    block_request_t **link = &bcache_hash[BLOCK_CACHE_HASH(buf->block_no)];
+    while (*link != NULL) {
+        if (*link == buf) {
+            *link = buf->hash_next;
+            break;
+        }
+        link = &((*link)->hash_next);
+    }
+    buf->hash_next = NULL;
+}
+
+static void
+_bcache_hash_insert(block_request_t *buf)
+{
+    block_request_t **link = &bcache_hash[BLOCK_CACHE_HASH(buf->block_no)];
+    buf->hash_next = *link;
+    *link = buf;
+}
+
+static block_request_t *
+_bcache_hash_lookup(uint32_t block_no)
+{
+    block_request_t *buf = bcache_hash[BLOCK_CACHE_HASH(block_no)];
+    while (buf != NULL && buf->block_no != block_no)
+        buf = buf->hash_next;
+    return buf;
+}
+
+
+/**
+ * Dirty buffers hold file data only: metadata blocks go through the
+ * journal, which keeps them pinned in the cache until their transaction
+ * commits and installs them. Allocated blocks still stale on disk are
+ * written back or zeroed right before a commit, so that committed
+ * pointers never refer to a block holding an old owner's content.
+ */
+static bool _block_flush(bool stale_only, bool wait_locked);
+
+
+/** Stale data block tracking. Blocks outside the data region never are. */
+static bool
+_block_stale(uint32_t block_no)
+{
+    if (block_no < superblock.data_start)
+        return false;
+    return bitmap_check(&stale_bitmap, block_no - superblock.data_start);
+}
+
+static void
+_block_set_stale(uint32_t block_no)
+{
+    bitmap_set(&stale_bitmap, block_no - superblock.data_start);
+}
+
+static void
+_block_clear_stale(uint32_t block_no)
+{
+    if (block_no >= superblock.data_start)
+        bitmap_clear(&stale_bitmap, block_no - superblock.data_start);
+}
+
+/**
+ * Fill a locked invalid buffer with zeros instead of reading the disk if
+ * its block is stale. Returns true if done so.
+ */
+static bool
+_bcache_fill_stale(block_request_t *buf)
+{
+    if (!_block_stale(buf->block_no))
+        return false;
+
+    memset(buf->data, 0, BLOCK_SIZE);
+    buf->valid = true;
+    buf->dirty = false;
+    return true;
+}
+
+
+/**
+ * Find the buffer caching the given block, or recycle the least recently
+ * used unreferenced clean buffer for it. If all unreferenced buffers are
+ * dirty, writes them back first. Returns the buffer locked, with its
+ * data possibly not valid yet. Returns NULL if all buffers are in use.
+ */
+static block_request_t *
+_bcache_acquire(uint32_t block_no)
+{
+    bool flushed = false;
+
+    spinlock_acquire(&bcache_lock);
+
+    block_request_t *buf;
+    while ((buf = _bcache_hash_lookup(block_no)) == NULL) {
+        /** Not cached, recycle a clean unreferenced buffer from LRU tail. */
+        for (buf = bcache_lru_tail; buf != NULL; buf = buf->lru_prev) {
+            if (buf->ref_cnt == 0 && !buf->dirty)
+                break;
+        }
+        if (buf != NULL) {
+            _bcache_hash_remove(buf);
+            buf->block_no = block_no;
+            buf->valid = false;
+            _bcache_hash_insert(buf);
+            break;
+        }
+
+        spinlock_release(&bcache_lock);
+        if (flushed) {
+            warn("block_get: no free buffer in block cache for %u", block_no);
+            return NULL;
+        }
+        _block_flush(false, false);
+        flushed = true;
+        spinlock_acquire(&bcache_lock);
+    }
+
+    buf->ref_cnt++;
+    spinlock_release(&bcache_lock);
+
+    parklock_acquire(&(buf->lock));
+    return buf;
+}
+
+/**
+ * Look for a block in the cache without recycling any buffer. Returns the
+ * buffer locked if it holds valid data of the block, otherwise NULL.
+ */
+static block_request_t *
+_bcache_acquire_cached(uint32_t block_no)
+{
+    spinlock_acquire(&bcache_lock);
+
+    block_request_t *buf = _bcache_hash_lookup(block_no);
+    if (buf == NULL) {
+        spinlock_release(&bcache_lock);
+        return NULL;
+    }
+
+    buf->ref_cnt++;
+    spinlock_release(&bcache_lock);
+
+    parklock_acquire(&(buf->lock));
+    if (!buf->valid) {
+        block_put(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * Get the buffer of a block with valid data, reading it from disk if not
+ * cached and not stale. The returned buffer is locked and must be put
+ * back through `block_put()`. Returns NULL on failures.
+ */
+block_request_t *
+block_get(uint32_t block_no)
+{
+    block_request_t *buf = _bcache_acquire(block_no);
+    if (buf == NULL)
+        return NULL;
+
+    if (!buf->valid && !_bcache_fill_stale(buf)) {
+        buf->dirty = false;
+        if (!idedisk_do_req(buf)) {
+            warn("block_get: reading IDE disk block %u failed", block_no);
+            block_put(buf);
+            return NULL;
+        }
+    }
+
+    return buf;
+}
+
+/**
+ * Put back a buffer got from `block_get()`. If nobody references it any
+ * more, moves it to the most recently used end of the LRU list.
+ */
+void
+block_put(block_request_t *buf)
+{
+    parklock_release(&(buf->lock));
+
+    spinlock_acquire(&bcache_lock);
+    assert(buf->ref_cnt > 0);
+    buf->ref_cnt--;
+    if (buf->ref_cnt == 0) {
+        _bcache_lru_remove(buf);
+        _bcache_lru_push_head(buf);
+    }
+    spinlock_release(&bcache_lock);
+}
+
+/** Wake up the flusher thread if it is sleeping. */
+static void
+_block_flusher_wake(void)
+{
+    if (flusher == NULL)
+        return;
+
+    spinlock_acquire(&ptable_lock);
+    if (flusher->state == BLOCKED && flusher->block_on == ON_SLEEP)
+        process_unblock(flusher);
+    spinlock_release(&ptable_lock);
+}
+
+/**
+ * Mark a modified buffer dirty, to be written back to disk later. Wakes
+ * up the flusher early if too many buffers are dirty.
+ * Must be called with the buffer locked.
+ */
+void
+block_dirty(block_request_t *buf)
+{
+    assert(parklock_holding(&(buf->lock)));
+
+    buf->valid = true;
+    if (buf->dirty || buf->logged)
+        return;
+    buf->dirty = true;
+
+    spinlock_acquire(&bcache_lock);
+    bool pressure = ++bcache_dirty_cnt > bcache_size * BLOCK_DIRTY_HIGH / 100;
+    spinlock_release(&bcache_lock);
+
+    if (pressure)
+        _block_flusher_wake();
+}
+
+/**
+ * Account a dirty buffer that has been written back. Its block now holds
+ * real content on disk.
+ */
+static void
+_bcache_cleaned(block_request_t *buf)
+{
+    _block_clear_stale(buf->block_no);
+
+    spinlock_acquire(&bcache_lock);
+    assert(bcache_dirty_cnt > 0);
+    bcache_dirty_cnt--;
+    spinlock_release(&bcache_lock);
+}
+
+/**
+ * Write a modified buffer through to disk now. On failure, the buffer
+ * stays dirty to be retried later.
+ * Must be called with the buffer locked and not logged in the journal.
+ */
+bool
+block_sync(block_request_t *buf)
+{
+    block_dirty(buf);
+
+    if (!idedisk_do_req(buf)) {
+        warn("block_sync: writing IDE disk block %u failed", buf->block_no);
+        return false;
+    }
+
+    _bcache_cleaned(buf);
+    return true;
+}
+
+
+/**
+ * Write NUM locked buffers through to disk at once, submitting them to
+ * BATCH and then waiting for the whole batch, including requests the
+ * caller has submitted to it before. Failed buffers stay dirty. Returns
+ * false if anything in the batch failed.
+ */
+bool
+block_sync_many(block_request_t **bufs, uint32_t num, block_batch_t *batch)
+{
+    for (uint32_t i = 0; i < num; ++i) {
+        block_dirty(bufs[i]);
+        bufs[i]->end_io = NULL;
+        idedisk_submit(bufs[i], batch);
+    }
+
+    bool success = idedisk_wait(batch);
+
+    for (uint32_t i = 0; i < num; ++i) {
+        if (!bufs[i]->dirty)
+            _bcache_cleaned(bufs[i]);
+    }
+
+    return success;
+}
+
+
+/**
+ * Write back dirty buffers (only those of stale blocks if STALE_ONLY). Unreferenced
+ * ones are taken up to FLUSH_BATCH_BUFS at a time and written in one
+ * batch. If WAIT_LOCKED, then waits for the ones currently held by
+ * others and writes them as well, skipping those held by the caller
+ * itself. Returns false if any write failed.
+ */
+#define FLUSH_BATCH_BUFS 32
+
+static bool
+_block_flush(bool stale_only, bool wait_locked)
+{
+    bool success = true;
+
+    uint32_t i = 0;
+    while (i < bcache_size) {
+        block_request_t *bufs[FLUSH_BATCH_BUFS];
+        uint32_t num = 0;
+
+        /**
+         * An unreferenced buffer is never locked, so acquiring its lock
+         * while holding `bcache_lock` won't block. Logged buffers are
+         * pinned, so never taken here.
+         */
+        spinlock_acquire(&bcache_lock);
+        for (; i < bcache_size && num < FLUSH_BATCH_BUFS; ++i) {
+            block_request_t *buf = &bcache[i];
+            if (buf->ref_cnt == 0 && buf->dirty
+                && (!stale_only || _block_stale(buf->block_no))) {
+                buf->ref_cnt++;
+                parklock_acquire(&(buf->lock));
+                bufs[num++] = buf;
+            }
+        }
+        spinlock_release(&bcache_lock);
+        if (num == 0)
+            break;
+
+        block_batch_t batch;
+        block_batch_init(&batch);
+        if (!block_sync_many(bufs, num, &batch))
+            success = false;
+
+        for (uint32_t j = 0; j < num; ++j)
+            block_put(bufs[j]);
+    }
+
+    if (!wait_locked)
+        return success;
+
+    for (i = 0; i < bcache_size; ++i) {
+        block_request_t *buf = &bcache[i];
+
+        spinlock_acquire(&bcache_lock);
+        bool take = buf->dirty && !buf->logged
+                    && (!stale_only || _block_stale(buf->block_no))
+                    && !parklock_holding(&(buf->lock));
+        if (take)
+            buf->ref_cnt++;
+        spinlock_release(&bcache_lock);
+        if (!take)
+            continue;
+
+        parklock_acquire(&(buf->lock));
+        if (buf->dirty && !buf->logged && !block_sync(buf))
+            success = false;
+        block_put(buf);
+    }
+
+    return success;
+}
+
+/** Write back all dirty buffers. Returns false if any write failed. */
+bool
+block_flush_all(void)
+{
+    return _block_flush(false, true);
+}
+
+/**
+ * Whether a data slot is allocated but still stale on disk, and is not
+ * logged in the running transaction (whose installation writes it).
+ */
+static bool
+_block_needs_zeroing(uint32_t slot)
+{
+    if (!bitmap_check(&data_bitmap, slot) || !bitmap_check(&stale_bitmap, slot))
+        return false;
+
+    spinlock_acquire(&bcache_lock);
+    block_request_t *buf = _bcache_hash_lookup(superblock.data_start + slot);
+    bool logged = buf != NULL && buf->logged;
+    spinlock_release(&bcache_lock);
+
+    return !logged;
+}
+
+/**
+ * Write zeros to allocated blocks that are still stale on disk, merging
+ * adjacent ones into one request. If SUBMIT is false, just clear their
+ * stale marks instead.
+ */
+static void
+_block_zero_stale_scan(bool submit, block_batch_t *batch)
+{
+    uint8_t *zero_blocks[BLOCK_MAX_RUN];
+    for (uint32_t i = 0; i < BLOCK_MAX_RUN; ++i)
+        zero_blocks[i] = zero_block;
+
+    uint32_t run_start = 0, run_len = 0;
+    for (uint32_t i = 0; i < data_bitmap.slots / 8; ++i) {
+        if ((data_bitmap.bits[i] & stale_bitmap.bits[i]) == 0)
+            continue;
+
+        for (uint32_t slot = i * 8; slot < (i + 1) * 8; ++slot) {
+            if (!_block_needs_zeroing(slot))
+                continue;
+            if (!submit) {
+                bitmap_clear(&stale_bitmap, slot);
+                continue;
+            }
+
+            if (run_len > 0 && slot == run_start + run_len
+                && run_len < BLOCK_MAX_RUN) {
+                run_len++;
+                continue;
+            }
+            if (run_len > 0) {
+                block_write_direct(zero_blocks, superblock.data_start + run_start,
+                                   run_len, batch);
+            }
+            run_start = slot;
+            run_len = 1;
+        }
+    }
+
+    if (run_len > 0) {
+        block_write_direct(zero_blocks, superblock.data_start + run_start,
+                           run_len, batch);
+    }
+}
+
+/**
+ * Make every allocated block hold real content or zeros on disk, done by
+ * the journal right before a commit: writes back dirty buffers of stale
+ * blocks, then zeroes the remaining stale ones that are not about to be
+ * installed by the commit itself. Must be called with no journal
+ * operation in progress. Returns false if any write failed.
+ */
+bool
+block_flush_stale(void)
+{
+    if (!_block_flush(true, true))
+        return false;
+
+    block_batch_t batch;
+    block_batch_init(&batch);
+    _block_zero_stale_scan(true, &batch);
+    if (!block_batch_wait(&batch))
+        return false;
+
+    _block_zero_stale_scan(false, NULL);
+    return true;
+}
+
+
+/** Pin a buffer in the cache so that it won't be recycled. */
+void
+block_pin(block_request_t *buf)
+{
+    spinlock_acquire(&bcache_lock);
+    buf->ref_cnt++;
+    spinlock_release(&bcache_lock);
+}
+
+/** Unpin a buffer pinned by `block_pin()`. */
+void
+block_unpin(block_request_t *buf)
+{
+    spinlock_acquire(&bcache_lock);
+    assert(buf->ref_cnt > 0);
+    buf->ref_cnt--;
+    if (buf->ref_cnt == 0) {
+        _bcache_lru_remove(buf);
+        _bcache_lru_push_head(buf);
+    }
+    spinlock_release(&bcache_lock);
+}
+
 
 /**
- * Helper function for reading blocks of data from disk into memory.
- * Uses an internal request buffer, so not zero-copy I/O. DST is the
- * destination buffer, and DISK_ADDR and LEN are both in bytes.
+ * The flusher thread: periodically commits the running journal
+ * transaction and writes back dirty buffers, or earlier if woken up by
+ * memory pressure.
+ */
+static void
+_block_flusher(void)
+{
+    while (1) {
+        process_sleep(BLOCK_FLUSH_INTERVAL);
+        journal_commit();
+        _block_flush(false, false);
+    }
+}
+
+/** Start the background flusher thread. */
+void
+block_flusher_init(void)
+{
+    flusher = kthread_create("bflush", &_block_flusher);
+    if (flusher == NULL)
+        error("block_flusher_init: failed to create flusher thread");
+}
+
+
+/** Completion callback of prefetch reads, puts back the buffer. */
+static void
+_block_prefetch_end_io(block_request_t *buf, bool ok)
+{
+    (void) ok;      /** Left invalid on failure, to be read again. */
+    block_put(buf);
+}
+
+/**
+ * Start reading a block into the buffer cache without waiting for it.
+ * The buffer stays locked while the read is on the fly and is put back
+ * by the completion callback. Does nothing if the block is already
+ * cached or being read.
+ */
+void
+block_prefetch(uint32_t block_no)
+{
+    spinlock_acquire(&bcache_lock);
+    bool cached = _bcache_hash_lookup(block_no) != NULL;
+    spinlock_release(&bcache_lock);
+    if (cached)
+        return;
+
+    block_request_t *buf = _bcache_acquire(block_no);
+    if (buf == NULL)
+        return;
+    if (buf->valid || _bcache_fill_stale(buf)) {
+        block_put(buf);
+        return;
+    }
+
+    buf->dirty = false;
+    buf->end_io = &_block_prefetch_end_io;
+    idedisk_submit(buf, NULL);
+}
+
+
+/**
+ * Translate a memory buffer of one block size into an address that the
+ * disk driver could transfer into/out of directly. Kernel memory is
+ * mapped identically in every address space, so is used as-is. A user
+ * buffer is translated to its physical address if it does not span
+ * across pages. Returns NULL if zero-copy is not possible.
+ */
+static uint8_t *
+_block_direct_addr(char *buf)
+{
+    uint32_t vaddr = (uint32_t) buf;
+    if ((vaddr & 0x3) != 0)     /** DMA and dword port I/O want alignment. */
+        return NULL;
+    if (vaddr + BLOCK_SIZE <= PHYS_MAX)
+        return (uint8_t *) buf;
+
+    if (ADDR_PAGE_OFFSET(vaddr) + BLOCK_SIZE > PAGE_SIZE)
+        return NULL;
+    process_t *proc = running_proc();
+    if (proc == NULL)
+        return NULL;
+    pte_t *pte = paging_walk_pgdir(proc->pgdir, vaddr, false);
+    if (pte == NULL || pte->present == 0)
+        return NULL;
+
+    return (uint8_t *) (ENTRY_FRAME_ADDR(*pte) + ADDR_PAGE_OFFSET(vaddr));
+}
+
+/**
+ * Given a whole block at MEM that is not cached and can be transferred
+ * directly at DIRECT, count how many following blocks could be merged
+ * into the same disk request: they must also miss in the cache, not be
+ * stale, and be directly transferrable, but need not be physically contiguous as the
+ * driver does scatter-gather. Fills the direct addresses of the blocks
+ * into BLOCKS and returns the run length, at least 1 and at most
+ * MAX_BLOCKS.
+ */
+static uint32_t
+_block_direct_run(char *mem, uint8_t *direct, uint32_t block_no,
+                  uint32_t max_blocks, uint8_t **blocks)
+{
+    if (max_blocks > BLOCK_MAX_RUN)
+        max_blocks = BLOCK_MAX_RUN;
+
+    blocks[0] = direct;
+    uint32_t num_blocks = 1;
+    while (num_blocks < max_blocks) {
+        uint8_t *next = _block_direct_addr(mem + num_blocks * BLOCK_SIZE);
+        if (next == NULL)
+            break;
+
+        spinlock_acquire(&bcache_lock);
+        bool cached = _bcache_hash_lookup(block_no + num_blocks) != NULL;
+        spinlock_release(&bcache_lock);
+        if (cached || _block_stale(block_no + num_blocks))
+            break;
+
+        blocks[num_blocks++] = next;
+    }
+
+    return num_blocks;
+}
+
+/** Completion callback of asynchronous direct requests. */
+static void
+_block_direct_end_io(block_request_t *req, bool ok)
+{
+    (void) ok;      /** Accounted in the batch. */
+    kfree(req);
+}
+
+/**
+ * Transfer NUM_BLOCKS whole blocks directly between disk and memory at
+ * BLOCKS, bypassing the buffer cache, in a single disk request. Reads
+ * are only done on cache misses, so these blocks have no newer dirty
+ * copy in the cache. Writes are only done for blocks never cached.
+ *
+ * If BATCH is not NULL, the request is allocated from the kernel heap
+ * and submitted to BATCH without waiting (falling back to waiting if
+ * out of heap memory).
  */
 static bool
-_block_read(char *dst, uint32_t disk_addr, uint32_t len, bool boot)
+_block_do_direct(uint8_t **blocks, uint32_t block_no, uint32_t num_blocks,
+                 bool write, block_batch_t *batch)
+{
+    if (batch != NULL) {
+        block_request_t *req = (block_request_t *)
+            kalloc(sizeof(block_request_t) + num_blocks * sizeof(uint8_t *));
+        if (req != NULL) {
+            uint8_t **req_blocks = (uint8_t **) (req + 1);
+            memcpy(req_blocks, blocks, num_blocks * sizeof(uint8_t *));
+            req->valid = write;
+            req->dirty = write;
+            req->block_no = block_no;
+            req->num_blocks = num_blocks;
+            req->data = req_blocks[0];
+            req->data_blocks = req_blocks;
+            req->end_io = &_block_direct_end_io;
+            idedisk_submit(req, batch);
+            return true;
+        }
+    }
+
+    block_request_t req;
+    req.valid = write;
+    req.dirty = write;
+    req.block_no = block_no;
+    req.num_blocks = num_blocks;
+    req.data = blocks[0];
+    req.data_blocks = blocks;
+    return idedisk_do_req(&req);
+}
+
+
+/**
+ * Helper function for reading blocks of data from disk into memory,
+ * used at boot time only and bypasses the buffer cache. Uses an internal
+ * request buffer, so not zero-copy I/O. DST is the destination buffer,
+ * and DISK_ADDR and LEN are both in bytes.
+ */
+bool
+block_read_at_boot(char *dst, uint32_t disk_addr, uint32_t len)
 {
     block_request_t req;
+    uint8_t req_data[BLOCK_SIZE] __attribute__((aligned(4)));
+    req.data = req_data;
+    req.data_blocks = NULL;
 
     uint32_t bytes_read = 0;
     while (len > bytes_read) {
@@ -41,9 +780,8 @@ _block_read(char *dst, uint32_t disk_addr, uint32_t len, bool boot)
         req.valid = false;
         req.dirty = false;
         req.block_no = block_no;
-        bool success = boot ? idedisk_do_req_at_boot(&req)
-                            : idedisk_do_req(&req);
-        if (!success) {
+        req.num_blocks = 1;
+        if (!idedisk_do_req_at_boot(&req)) {
             warn("block_read: reading IDE disk block %u failed", block_no);
             return false;
         }
@@ -55,28 +793,139 @@ _block_read(char *dst, uint32_t disk_addr, uint32_t len, bool boot)
     return true;
 }
 
+/**
+ * Write whole blocks of data from memory into disk, used at boot time
+ * only (journal recovery) and bypasses the buffer cache. SRC is the
+ * source buffer, and DISK_ADDR and LEN are both in bytes and must be
+ * block-aligned.
+ */
 bool
-block_read(char *dst, uint32_t disk_addr, uint32_t len)
+block_write_at_boot(char *src, uint32_t disk_addr, uint32_t len)
+{
+    assert(ADDR_BLOCK_ALIGNED(disk_addr) && ADDR_BLOCK_ALIGNED(len));
+
+    block_request_t req;
+    uint8_t req_data[BLOCK_SIZE] __attribute__((aligned(4)));
+    req.data = req_data;
+    req.data_blocks = NULL;
+
+    for (uint32_t bytes_written = 0; bytes_written < len;
+         bytes_written += BLOCK_SIZE) {
+        memcpy(req_data, src + bytes_written, BLOCK_SIZE);
+
+        req.valid = true;
+        req.dirty = true;
+        req.block_no = ADDR_BLOCK_NUMBER(disk_addr + bytes_written);
+        req.num_blocks = 1;
+        if (!idedisk_do_req_at_boot(&req)) {
+            warn("block_write: writing IDE disk block %u failed", req.block_no);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Read blocks of data from disk into memory through the buffer cache.
+ * Whole blocks that miss in the cache are read directly into DST if
+ * possible. DST is the destination buffer, and DISK_ADDR and LEN are
+ * both in bytes. If BATCH is not NULL, direct reads are submitted to it
+ * without waiting.
+ */
+static bool
+_block_read_helper(char *dst, uint32_t disk_addr, uint32_t len,
+                   block_batch_t *batch)
 {
-    return _block_read(dst, disk_addr, len, false);
+    uint8_t *direct_blocks[BLOCK_MAX_RUN];
+
+    uint32_t bytes_read = 0;
+    while (len > bytes_read) {
+        uint32_t bytes_left = len - bytes_read;
+
+        uint32_t start_addr = disk_addr + bytes_read;
+        uint32_t block_no = ADDR_BLOCK_NUMBER(start_addr);
+        uint32_t req_offset = ADDR_BLOCK_OFFSET(start_addr);
+
+        uint32_t next_addr = ADDR_BLOCK_ROUND_DN(start_addr) + BLOCK_SIZE;
+        uint32_t effective = next_addr - start_addr;
+        if (bytes_left < effective)
+            effective = bytes_left;
+
+        /**
+         * Zero-copy path for whole blocks not in cache. Following blocks
+         * that also miss are merged into one multi-block request. Stale
+         * blocks are just zeroed in memory.
+         */
+        if (effective == BLOCK_SIZE) {
+            uint8_t *direct = _block_direct_addr(dst + bytes_read);
+            if (direct != NULL) {
+                block_request_t *buf = _bcache_acquire_cached(block_no);
+                if (buf != NULL) {
+                    memcpy(dst + bytes_read, buf->data, BLOCK_SIZE);
+                    block_put(buf);
+                } else if (_block_stale(block_no)) {
+                    memset(dst + bytes_read, 0, BLOCK_SIZE);
+                } else {
+                    uint32_t num_blocks = _block_direct_run(dst + bytes_read,
+                        direct, block_no, bytes_left / BLOCK_SIZE, direct_blocks);
+                    if (!_block_do_direct(direct_blocks, block_no, num_blocks,
+                                          false, batch)) {
+                        warn("block_read: reading IDE disk blocks %u-%u failed",
+                             block_no, block_no + num_blocks - 1);
+                        return false;
+                    }
+                    effective = num_blocks * BLOCK_SIZE;
+                }
+
+                bytes_read += effective;
+                continue;
+            }
+        }
+
+        block_request_t *buf = block_get(block_no);
+        if (buf == NULL) {
+            warn("block_read: failed to get block %u", block_no);
+            return false;
+        }
+        memcpy(dst + bytes_read, buf->data + req_offset, effective);
+        block_put(buf);
+
+        bytes_read += effective;
+    }
+
+    return true;
 }
 
+/** Read blocks of data from disk into memory, waiting for it. */
 bool
-block_read_at_boot(char *dst, uint32_t disk_addr, uint32_t len)
+block_read(char *dst, uint32_t disk_addr, uint32_t len)
 {
-    return _block_read(dst, disk_addr, len, true);
+    return _block_read_helper(dst, disk_addr, len, NULL);
 }
 
 /**
- * Helper function for writing blocks of data from memory into disk.
- * Uses an internal request buffer, so not zero-copy I/O. SRC is the
- * source buffer, and DISK_ADDR and LEN are both in bytes.
+ * Read blocks of data from disk into memory, submitting reads that go
+ * directly into DST to BATCH. DST must not be touched until the batch
+ * has been waited for.
  */
 bool
-block_write(char *src, uint32_t disk_addr, uint32_t len)
+block_read_async(char *dst, uint32_t disk_addr, uint32_t len,
+                 block_batch_t *batch)
 {
-    block_request_t req;
+    return _block_read_helper(dst, disk_addr, len, batch);
+}
 
+/**
+ * Write blocks of data from memory into the buffer cache. SRC is the
+ * source buffer, and DISK_ADDR and LEN are both in bytes. If JOURNALED,
+ * the modified buffers are logged in the running journal transaction,
+ * otherwise they are left dirty to be written back later.
+ */
+static bool
+_block_write_helper(char *src, uint32_t disk_addr, uint32_t len,
+                    bool journaled)
+{
     uint32_t bytes_written = 0;
     while (len > bytes_written) {
         uint32_t bytes_left = len - bytes_written;
@@ -91,81 +940,299 @@ block_write(char *src, uint32_t disk_addr, uint32_t len)
             effective = bytes_left;
 
         /**
-         * If writing less than a block, first read out the block to
-         * avoid corrupting what's already on disk.
+         * If writing less than a block, the block must be read in first
+         * to avoid corrupting what's already on disk (a stale one is just
+         * zeroed). A whole-block write needs no read nor zeroing.
          */
-        if (effective < BLOCK_SIZE) {
-            if (!block_read((char *) req.data, ADDR_BLOCK_ROUND_DN(start_addr),
-                            BLOCK_SIZE)) {
-                warn("block_write: failed to read out old block %u", block_no);
-                return false;
-            }
+        block_request_t *buf;
+        if (effective == BLOCK_SIZE)
+            buf = _bcache_acquire(block_no);
+        else
+            buf = block_get(block_no);
+        if (buf == NULL) {
+            warn("block_write: failed to get block %u", block_no);
+            return false;
         }
 
-        memcpy(req.data + req_offset, src + bytes_written, effective);
-        req.valid = true;
-        req.dirty = true;
-        req.block_no = block_no;
-        if (!idedisk_do_req(&req)) {
-            warn("block_write: writing IDE disk block %u failed", block_no);
+        memcpy(buf->data + req_offset, src + bytes_written, effective);
+        if (journaled)
+            journal_write(buf);
+        else
+            block_dirty(buf);
+        block_put(buf);
+
+        bytes_written += effective;
+    }
+
+    return true;
+}
+
+/** Write file data blocks, to be written back later. */
+bool
+block_write(char *src, uint32_t disk_addr, uint32_t len)
+{
+    return _block_write_helper(src, disk_addr, len, false);
+}
+
+/**
+ * Write metadata blocks as part of the running journal transaction.
+ * Must be called within a journal operation.
+ */
+bool
+block_write_journaled(char *src, uint32_t disk_addr, uint32_t len)
+{
+    return _block_write_helper(src, disk_addr, len, true);
+}
+
+/**
+ * Write NUM_BLOCKS whole blocks straight to disk starting at BLOCK_NO,
+ * bypassing the buffer cache, submitting the writes to BATCH. The i-th
+ * block is taken from BLOCKS[i]. Only for blocks that are never cached,
+ * e.g. the journal region. The blocks must be dword-aligned kernel
+ * memory and must not be modified until the batch has been waited for.
+ */
+bool
+block_write_direct(uint8_t **blocks, uint32_t block_no, uint32_t num_blocks,
+                   block_batch_t *batch)
+{
+    while (num_blocks > 0) {
+        uint32_t run = num_blocks < BLOCK_MAX_RUN ? num_blocks : BLOCK_MAX_RUN;
+        if (!_block_do_direct(blocks, block_no, run, true, batch)) {
+            warn("block_write: writing IDE disk blocks %u-%u failed",
+                 block_no, block_no + run - 1);
             return false;
         }
 
-        bytes_written += effective;
+        blocks += run;
+        block_no += run;
+        num_blocks -= run;
     }
 
     return true;
 }
 
+/**
+ * Wait for all asynchronous requests submitted to BATCH. Returns false
+ * if any of them failed.
+ */
+bool
+block_batch_wait(block_batch_t *batch)
+{
+    return idedisk_wait(batch);
+}
+
+
+/**
+ * Get the buffers of NUM distinct blocks at once, reading those not
+ * cached from disk in one batch so the disk serves them back to back.
+ * Fills BUFS with the locked buffers, which must each be put back by
+ * `block_put()`. Returns false on failures, with nothing held.
+ */
+bool
+block_get_many(const uint32_t *block_nos, uint32_t num, block_request_t **bufs)
+{
+    block_batch_t batch;
+    block_batch_init(&batch);
+
+    uint32_t got = 0;
+    for (; got < num; ++got) {
+        block_request_t *buf = _bcache_acquire(block_nos[got]);
+        if (buf == NULL)
+            break;
+        bufs[got] = buf;
+
+        if (!buf->valid && !_bcache_fill_stale(buf)) {
+            buf->dirty = false;
+            buf->end_io = NULL;
+            idedisk_submit(buf, &batch);
+        }
+    }
+
+    bool success = idedisk_wait(&batch) && got == num;
+    if (!success) {
+        warn("block_get_many: failed to get %u blocks", num);
+        for (uint32_t i = 0; i < got; ++i)
+            block_put(bufs[i]);
+    }
+
+    return success;
+}
+
 
 /**
- * Allocate a free data block and mark it in use. Returns the block
- * disk address allocated, or 0 (which is invalid for a data block)
- * on failures.
+ * Allocate NUM contiguous free data blocks and mark them in use,
+ * preferably starting at disk address HINT_ADDR or soon after it (0 for
+ * no preference). Returns the disk address of the first block, or 0
+ * (which is invalid for a data block) on failures. Free blocks are
+ * stale, so the new owner reads zeros from them until written, without
+ * any zeroing I/O here.
  */
 uint32_t
-block_alloc(void)
+block_alloc_run(uint32_t num, uint32_t hint_addr)
 {
-    /** Get a free block from data bitmap. */
-    uint32_t slot = bitmap_alloc(&data_bitmap);
+    uint32_t hint = BITMAP_NO_HINT;
+    if (hint_addr >= DISK_ADDR_DATA_BLOCK(0))
+        hint = hint_addr / BLOCK_SIZE - superblock.data_start;
+
+    /** Get a free run from data bitmap. */
+    uint32_t slot = bitmap_alloc_range(&data_bitmap, num, 1, hint);
     if (slot == data_bitmap.slots) {
-        warn("block_alloc: no free data block left");
+        warn("block_alloc: no run of %u free data blocks left", num);
         return 0;
     }
 
-    if (!data_bitmap_update(slot)) {
-        warn("block_alloc: failed to persist data bitmap");
-        return 0;
+    for (uint32_t i = 0; i < num; ++i)
+        data_bitmap_update(slot + i);
+
+    return DISK_ADDR_DATA_BLOCK(slot);
+}
+
+/** Allocate a free data block, wherever the allocation cursor is. */
+uint32_t
+block_alloc(void)
+{
+    return block_alloc_run(1, 0);
+}
+
+/**
+ * Free a disk data block. It becomes stale, so that a new owner never
+ * sees its old content.
+ */
+void
+block_free(uint32_t disk_addr)
+{
+    block_free_many(&disk_addr, 1);
+}
+
+/**
+ * Mark a block being freed stale. A cached copy is zeroed and its dirty
+ * content discarded, as no one should see or write it back any more.
+ * The stale mark is set with the buffer (or with `bcache_lock` if not
+ * cached) held, so that a concurrent write-back or prefetch read can't
+ * mix old content into the freed block.
+ */
+static void
+_block_make_stale(uint32_t block_no)
+{
+    spinlock_acquire(&bcache_lock);
+    block_request_t *buf = _bcache_hash_lookup(block_no);
+    if (buf == NULL) {
+        _block_set_stale(block_no);
+        spinlock_release(&bcache_lock);
+        return;
+    }
+    buf->ref_cnt++;
+    spinlock_release(&bcache_lock);
+
+    parklock_acquire(&(buf->lock));
+    memset(buf->data, 0, BLOCK_SIZE);
+    buf->valid = true;
+    if (buf->dirty) {
+        buf->dirty = false;
+        spinlock_acquire(&bcache_lock);
+        assert(bcache_dirty_cnt > 0);
+        bcache_dirty_cnt--;
+        spinlock_release(&bcache_lock);
     }
+    _block_set_stale(block_no);
+    block_put(buf);
+}
+
+/**
+ * Free NUM disk data blocks at ADDRS (0 entries are skipped). They are
+ * made stale instead of zeroed out on disk, and then marked free.
+ */
+void
+block_free_many(const uint32_t *addrs, uint32_t num)
+{
+    for (uint32_t i = 0; i < num; ++i) {
+        if (addrs[i] == 0)
+            continue;
+        assert(addrs[i] >= DISK_ADDR_DATA_BLOCK(0));
 
-    uint32_t disk_addr = DISK_ADDR_DATA_BLOCK(slot);
+        uint32_t block_no = ADDR_BLOCK_NUMBER(addrs[i]);
+        _block_make_stale(block_no);
 
-    /** Zero the block out for safety. */
-    char buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    if (!block_write(buf, disk_addr, BLOCK_SIZE)) {
-        warn("block_alloc: failed to zero out block %p", disk_addr);
+        uint32_t slot = block_no - superblock.data_start;
         bitmap_clear(&data_bitmap, slot);
-        data_bitmap_update(slot);   /** Ignores error. */
-        return 0;
+        data_bitmap_update(slot);
     }
-
-    return disk_addr;
 }
 
-/** Free a disk data block. */
+
+/**
+ * Free NUM contiguous disk data blocks starting at DISK_ADDR, e.g. the
+ * blocks of an extent, made stale like in `block_free_many()`.
+ */
 void
-block_free(uint32_t disk_addr)
+block_free_run(uint32_t disk_addr, uint32_t num)
 {
     assert(disk_addr >= DISK_ADDR_DATA_BLOCK(0));
-    uint32_t slot = (disk_addr / BLOCK_SIZE) - superblock.data_start;
+    uint32_t block_no = ADDR_BLOCK_NUMBER(disk_addr);
+    uint32_t slot = block_no - superblock.data_start;
+    assert(slot + num <= data_bitmap.slots);
+
+    for (uint32_t i = 0; i < num; ++i)
+        _block_make_stale(block_no + i);
+
+    bitmap_clear_range(&data_bitmap, slot, num);
+    for (uint32_t i = 0; i < num; ++i)
+        data_bitmap_update(slot + i);
+}
+
+
+/**
+ * Initialize the block buffer cache with NUM_BUFS buffers allocated
+ * from the kernel heap.
+ */
+void
+block_cache_init(uint32_t num_bufs)
+{
+    bcache = (block_request_t *) kalloc(num_bufs * sizeof(block_request_t));
+    bcache_data = (uint8_t *) kalloc(num_bufs * BLOCK_SIZE + 3);
+    if (bcache == NULL || bcache_data == NULL)
+        error("block_cache_init: failed to allocate %u buffers", num_bufs);
+    /** Dword-align the data arena so that it is usable for DMA. */
+    bcache_data = (uint8_t *) (((uint32_t) bcache_data + 3) & ~0x3);
+    bcache_size = num_bufs;
+
+    for (size_t i = 0; i < BLOCK_CACHE_HASH_SIZE; ++i)
+        bcache_hash[i] = NULL;
+    bcache_lru_head = NULL;
+    bcache_lru_tail = NULL;
+
+    /** Empty buffers are not on any hash chain until first used. */
+    for (size_t i = 0; i < num_bufs; ++i) {
+        block_request_t *buf = &bcache[i];
+        buf->valid = false;
+        buf->dirty = false;
+        buf->logged = false;
+        buf->next = NULL;
+        buf->block_no = 0;
+        buf->num_blocks = 1;
+        buf->ref_cnt = 0;
+        buf->hash_next = NULL;
+        buf->data = &bcache_data[i * BLOCK_SIZE];
+        buf->data_blocks = NULL;
+        parklock_init(&(buf->lock), "block buffer's parklock");
+        _bcache_lru_push_head(buf);
+    }
+
+    bcache_dirty_cnt = 0;
+    flusher = NULL;
 
-    bitmap_clear(&data_bitmap, slot);
-    data_bitmap_update(slot);   /** Ignores error. */
+    /** Free data blocks are stale, must be called after bitmaps loaded. */
+    uint32_t slots = data_bitmap.slots;
+    uint8_t *stale_bits = (uint8_t *) kalloc(BITMAP_BITS_SIZE(slots) + 3);
+    uint16_t *stale_regions = (uint16_t *)
+        kalloc(BITMAP_NUM_REGIONS(slots) * sizeof(uint16_t));
+    if (stale_bits == NULL || stale_regions == NULL)
+        error("block_cache_init: failed to allocate stale blocks bitmap");
+    stale_bits = (uint8_t *) (((uint32_t) stale_bits + 3) & ~0x3);
+    bitmap_init(&stale_bitmap, stale_bits, stale_regions, slots);
+    for (uint32_t i = 0; i < slots / 8; ++i)
+        stale_bits[i] = ~data_bitmap.bits[i];
+    bitmap_rebuild(&stale_bitmap);
 
-    /** Zero the block out for safety. */
-    char buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    if (!block_write(buf, ADDR_BLOCK_ROUND_DN(disk_addr), BLOCK_SIZE))
-        warn("block_free: failed to zero out block %p", disk_addr);
+    spinlock_init(&bcache_lock, "bcache_lock");
 }
@@ -10,6 +10,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "../common/parklock.h"
+
 
 /** All block requests are of size 1024 bytes. */
 #define BLOCK_SIZE 1024
@@ -25,29 +27,135 @@
 #define ADDR_BLOCK_ROUND_UP(addr) (ADDR_BLOCK_ROUND_DN((addr) + 0x000003FF))
 
 
+/**
+ * Maximum number of physically contiguous blocks a single request may
+ * carry, so that it always fits in one IDE command.
+ */
+#define BLOCK_MAX_RUN 64
+
+
+/**
+ * Batch of asynchronously submitted block requests: number of requests
+ * not yet completed, and whether any of them has failed. Waiters block
+ * until PENDING drops to 0.
+ */
+struct block_batch {
+    uint32_t pending;
+    bool failed;
+};
+typedef struct block_batch block_batch_t;
+
+static inline void
+block_batch_init(block_batch_t *batch)
+{
+    batch->pending = 0;
+    batch->failed = false;
+}
+
+
 /**
  * Block device request buffer.
- *   - valid && dirty:   waiting to be written to disk
+ *   - valid && dirty:   modified, waiting to be written to disk
  *   - !valid && !dirty: waiting to be read from disk
  *   - valid && !dirty:  normal buffer with valid data
  *   - !valid && dirty:  cannot happen
+ *
+ * A request covers NUM_BLOCKS contiguous blocks starting at BLOCK_NO.
+ * DATA points to the NUM_BLOCKS * BLOCK_SIZE bytes being transferred:
+ * a cache slot's own storage (always one block), or directly the caller's
+ * memory for zero-copy transfers, in which case it must be an address
+ * valid in every address space (i.e., below PHYS_MAX) since the transfer
+ * may happen in the interrupt handler. If DATA_BLOCKS is not NULL, the
+ * blocks are instead scattered in memory, the i-th block being at
+ * DATA_BLOCKS[i] (same address space rule applies).
+ *
+ * When the request completes, END_IO is called (if not NULL) from the
+ * disk interrupt handler with whether it succeeded, and then its BATCH
+ * (if not NULL) is accounted.
+ *
+ * The same structure also serves as a slot of the block buffer cache,
+ * in which case the cache fields below are meaningful.
  */
 struct block_request {
     bool valid;
     bool dirty;
-    struct block_request *next;     /** Next in device queue. */
+    struct block_request *next;     /** Next in I/O scheduler sorted queue. */
+    struct block_request *fifo_next;    /** Next in I/O scheduler FIFO. */
+    struct block_request *merge_next;   /** Next merged into the same command. */
+    uint32_t deadline;              /** Timer tick to be served by. */
+    void (*end_io)(struct block_request *req, bool ok);
+    block_batch_t *batch;           /** Batch it belongs to. */
     uint32_t block_no;              /** Block index on disk. */
-    uint8_t data[BLOCK_SIZE];
+    uint32_t num_blocks;            /** Number of contiguous blocks. */
+    uint8_t ref_cnt;                /** Reference count (from cache users). */
+    bool logged;                    /** In the running journal transaction. */
+    parklock_t lock;                /** Held when accessing data or doing I/O. */
+    struct block_request *hash_next;    /** Next in cache hash chain. */
+    struct block_request *lru_prev;     /** Towards most recently used. */
+    struct block_request *lru_next;     /** Towards least recently used. */
+    uint8_t *data;                  /** Data of NUM_BLOCKS blocks. */
+    uint8_t **data_blocks;          /** Scattered data of each block. */
 };
 typedef struct block_request block_request_t;
 
 
+/**
+ * Number of block buffers in the buffer cache, allocated from the kernel
+ * heap at boot. Lookups go through a small hash table keyed by block
+ * number.
+ */
+#define BLOCK_CACHE_BUFS 256
+
+#define BLOCK_CACHE_HASH_SIZE 64
+#define BLOCK_CACHE_HASH(block_no) ((block_no) % BLOCK_CACHE_HASH_SIZE)
+
+
+/**
+ * Write-back of dirty buffers. The flusher thread wakes up every
+ * BLOCK_FLUSH_INTERVAL timer ticks, or earlier once more than
+ * BLOCK_DIRTY_HIGH percent of the buffers are dirty.
+ */
+#define BLOCK_FLUSH_INTERVAL 300
+#define BLOCK_DIRTY_HIGH     50
+
+
+void block_cache_init(uint32_t num_bufs);
+void block_flusher_init();
+
+block_request_t *block_get(uint32_t block_no);
+void block_put(block_request_t *buf);
+void block_dirty(block_request_t *buf);
+bool block_sync(block_request_t *buf);
+
+bool block_sync_many(block_request_t **bufs, uint32_t num,
+                     block_batch_t *batch);
+bool block_flush_all();
+bool block_flush_stale();
+
+void block_pin(block_request_t *buf);
+void block_unpin(block_request_t *buf);
+
+void block_prefetch(uint32_t block_no);
+bool block_get_many(const uint32_t *block_nos, uint32_t num,
+                    block_request_t **bufs);
+
 bool block_read(char *dst, uint32_t disk_addr, uint32_t len);
 bool block_read_at_boot(char *dst, uint32_t disk_addr, uint32_t len);
 bool block_write(char *src, uint32_t disk_addr, uint32_t len);
+bool block_write_journaled(char *src, uint32_t disk_addr, uint32_t len);
+bool block_write_at_boot(char *src, uint32_t disk_addr, uint32_t len);
+
+bool block_read_async(char *dst, uint32_t disk_addr, uint32_t len,
+                      block_batch_t *batch);
+bool block_write_direct(uint8_t **blocks, uint32_t block_no,
+                        uint32_t num_blocks, block_batch_t *batch);
+bool block_batch_wait(block_batch_t *batch);
 
 uint32_t block_alloc();
+uint32_t block_alloc_run(uint32_t num, uint32_t hint_addr);
 void block_free(uint32_t disk_addr);
+void block_free_many(const uint32_t *addrs, uint32_t num);
+void block_free_run(uint32_t disk_addr, uint32_t num);
 
 
 #endif
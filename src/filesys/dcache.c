@@ -0,0 +1,294 @@
+/**
+ * Dentry cache for path resolution.
+ *
+ * Resolving a path element otherwise locks the directory and searches
+ * it on disk, and the shell looks up every command in the cwd first and
+ * then in its search path, mostly missing. Results, including misses,
+ * are cached here by (directory inumber, name). An entry for a name is
+ * changed only with the lock on its directory inode held, together with
+ * the dentry on disk.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dcache.h"
+#include "vsfs.h"
+
+#include "../common/debug.h"
+#include "../common/string.h"
+#include "../common/spinlock.h"
+
+
+static dcache_entry_t dcache[DCACHE_SIZE];
+
+static int16_t name_buckets[DCACHE_BUCKETS];
+static int16_t inum_buckets[DCACHE_BUCKETS];
+
+static int16_t lru_head;    /** Most recently used. */
+static int16_t lru_tail;    /** Least recently used, or invalid. */
+
+static spinlock_t dcache_lock;
+
+
+/** FNV-1a hash of a name in directory PARENT. */
+static uint32_t
+_dcache_name_hash(uint32_t parent, char *name)
+{
+    uint32_t hash = 2166136261u ^ parent;
+    for (size_t i = 0; i < MAX_FILENAME && name[i] != '\0'; ++i) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash % DCACHE_BUCKETS;
+}
+
+static uint32_t
+_dcache_inum_hash(uint32_t inumber)
+{
+    return inumber % DCACHE_BUCKETS;
+}
+
+
+static void
+_lru_unlink(int16_t idx)
+{
+    dcache_entry_t *entry = &dcache[idx];
+    if (entry->lru_prev >= 0)
+        dcache[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        lru_head = entry->lru_next;
+    if (entry->lru_next >= 0)
+        dcache[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        lru_tail = entry->lru_prev;
+}
+
+static void
+_lru_push_head(int16_t idx)
+{
+    dcache[idx].lru_prev = -1;
+    dcache[idx].lru_next = lru_head;
+    if (lru_head >= 0)
+        dcache[lru_head].lru_prev = idx;
+    else
+        lru_tail = idx;
+    lru_head = idx;
+}
+
+static void
+_lru_push_tail(int16_t idx)
+{
+    dcache[idx].lru_next = -1;
+    dcache[idx].lru_prev = lru_tail;
+    if (lru_tail >= 0)
+        dcache[lru_tail].lru_next = idx;
+    else
+        lru_head = idx;
+    lru_tail = idx;
+}
+
+/** Remove entry IDX from the chain starting at *HEAD, linked by NEXT. */
+static void
+_chain_remove(int16_t *head, int16_t idx, bool by_name)
+{
+    int16_t *link = head;
+    while (*link >= 0) {
+        dcache_entry_t *entry = &dcache[*link];
+        if (*link == idx) {
+            *link = by_name ? entry->name_next : entry->inum_next;
+            return;
+        }
+        link = by_name ? &(entry->name_next) : &(entry->inum_next);
+    }
+}
+
+static void
+_inum_chain_add(int16_t idx)
+{
+    uint32_t bucket = _dcache_inum_hash(dcache[idx].inumber);
+    dcache[idx].inum_next = inum_buckets[bucket];
+    inum_buckets[bucket] = idx;
+}
+
+static void
+_inum_chain_remove(int16_t idx)
+{
+    if (dcache[idx].inumber == DCACHE_NEGATIVE)
+        return;
+    _chain_remove(&inum_buckets[_dcache_inum_hash(dcache[idx].inumber)],
+                  idx, false);
+}
+
+/**
+ * Drop entry IDX out of its hash chains and move it to the LRU tail, to
+ * be reused first.
+ */
+static void
+_dcache_drop(int16_t idx)
+{
+    dcache_entry_t *entry = &dcache[idx];
+    _chain_remove(&name_buckets[_dcache_name_hash(entry->parent, entry->name)],
+                  idx, true);
+    _inum_chain_remove(idx);
+    entry->valid = false;
+
+    _lru_unlink(idx);
+    _lru_push_tail(idx);
+}
+
+/** Find the entry of NAME in PARENT. Returns -1 if not cached. */
+static int16_t
+_dcache_find(uint32_t parent, char *name)
+{
+    int16_t idx = name_buckets[_dcache_name_hash(parent, name)];
+    while (idx >= 0) {
+        dcache_entry_t *entry = &dcache[idx];
+        if (entry->parent == parent
+            && strncmp(entry->name, name, MAX_FILENAME) == 0) {
+            return idx;
+        }
+        idx = entry->name_next;
+    }
+    return -1;
+}
+
+
+/**
+ * Look up NAME in directory PARENT. Returns true if cached, setting
+ * *INUMBER to the result, which is DCACHE_NEGATIVE for a known miss.
+ */
+bool
+dcache_lookup(uint32_t parent, char *name, uint32_t *inumber)
+{
+    spinlock_acquire(&dcache_lock);
+
+    int16_t idx = _dcache_find(parent, name);
+    if (idx >= 0) {
+        *inumber = dcache[idx].inumber;
+        _lru_unlink(idx);
+        _lru_push_head(idx);
+    }
+
+    spinlock_release(&dcache_lock);
+    return idx >= 0;
+}
+
+/**
+ * Look up the name of INUMBER in directory PARENT, following parent
+ * links, copying it into NAME of MAX_FILENAME bytes. Returns true if
+ * cached. '.' and '..' are never returned.
+ */
+bool
+dcache_lookup_name(uint32_t parent, uint32_t inumber, char *name)
+{
+    spinlock_acquire(&dcache_lock);
+
+    int16_t idx = inum_buckets[_dcache_inum_hash(inumber)];
+    while (idx >= 0) {
+        dcache_entry_t *entry = &dcache[idx];
+        if (entry->inumber == inumber && entry->parent == parent
+            && strncmp(entry->name, ".", MAX_FILENAME) != 0
+            && strncmp(entry->name, "..", MAX_FILENAME) != 0) {
+            strncpy(name, entry->name, MAX_FILENAME);
+            _lru_unlink(idx);
+            _lru_push_head(idx);
+            break;
+        }
+        idx = entry->inum_next;
+    }
+
+    spinlock_release(&dcache_lock);
+    return idx >= 0;
+}
+
+/**
+ * Record the result of looking up NAME in directory PARENT, replacing
+ * the least recently used entry if it is not cached yet.
+ * Must be called with lock on the directory inode held.
+ */
+void
+dcache_insert(uint32_t parent, char *name, uint32_t inumber)
+{
+    spinlock_acquire(&dcache_lock);
+
+    int16_t idx = _dcache_find(parent, name);
+    if (idx >= 0) {
+        _inum_chain_remove(idx);
+    } else {
+        idx = lru_tail;
+        if (dcache[idx].valid)
+            _dcache_drop(idx);
+
+        dcache_entry_t *entry = &dcache[idx];
+        entry->valid = true;
+        entry->parent = parent;
+        strncpy(entry->name, name, MAX_FILENAME);
+        entry->name[MAX_FILENAME - 1] = '\0';
+        uint32_t bucket = _dcache_name_hash(parent, entry->name);
+        entry->name_next = name_buckets[bucket];
+        name_buckets[bucket] = idx;
+    }
+
+    dcache[idx].inumber = inumber;
+    if (inumber != DCACHE_NEGATIVE)
+        _inum_chain_add(idx);
+    _lru_unlink(idx);
+    _lru_push_head(idx);
+
+    spinlock_release(&dcache_lock);
+}
+
+/**
+ * Forget the entry of NAME in directory PARENT.
+ * Must be called with lock on the directory inode held.
+ */
+void
+dcache_invalidate(uint32_t parent, char *name)
+{
+    spinlock_acquire(&dcache_lock);
+
+    int16_t idx = _dcache_find(parent, name);
+    if (idx >= 0)
+        _dcache_drop(idx);
+
+    spinlock_release(&dcache_lock);
+}
+
+/**
+ * Forget all entries in directory PARENT, as its inumber is going to be
+ * freed and may be reused.
+ */
+void
+dcache_invalidate_dir(uint32_t parent)
+{
+    spinlock_acquire(&dcache_lock);
+
+    for (int16_t idx = 0; idx < DCACHE_SIZE; ++idx) {
+        if (dcache[idx].valid && dcache[idx].parent == parent)
+            _dcache_drop(idx);
+    }
+
+    spinlock_release(&dcache_lock);
+}
+
+
+/** Initialize the dentry cache to be empty. */
+void
+dcache_init(void)
+{
+    for (size_t i = 0; i < DCACHE_BUCKETS; ++i) {
+        name_buckets[i] = -1;
+        inum_buckets[i] = -1;
+    }
+
+    lru_head = -1;
+    lru_tail = -1;
+    for (int16_t idx = 0; idx < DCACHE_SIZE; ++idx) {
+        dcache[idx].valid = false;
+        _lru_push_tail(idx);
+    }
+
+    spinlock_init(&dcache_lock, "dcache_lock");
+}
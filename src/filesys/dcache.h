@@ -0,0 +1,51 @@
+/**
+ * Dentry cache for path resolution.
+ */
+
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vsfs.h"
+
+
+/**
+ * A cached lookup result of NAME in directory PARENT: the inumber found,
+ * or DCACHE_NEGATIVE if the name is known not to exist. Positive entries
+ * are also chained by inumber, so that the name of a directory in its
+ * parent can be found without scanning it, e.g., for `getcwd()`. All
+ * entries sit on an LRU list, and the least recently used one gets
+ * replaced when the cache is full.
+ */
+struct dcache_entry {
+    bool valid;
+    uint32_t parent;            /** Inumber of the directory. */
+    uint32_t inumber;           /** Inumber found, or DCACHE_NEGATIVE. */
+    char name[MAX_FILENAME];
+    int16_t name_next;          /** Next in (parent, name) hash chain. */
+    int16_t inum_next;          /** Next in inumber hash chain. */
+    int16_t lru_prev;           /** Towards most recently used. */
+    int16_t lru_next;           /** Towards least recently used. */
+};
+typedef struct dcache_entry dcache_entry_t;
+
+#define DCACHE_SIZE    256
+#define DCACHE_BUCKETS 128
+
+#define DCACHE_NEGATIVE 0xFFFFFFFF
+
+
+void dcache_init();
+
+bool dcache_lookup(uint32_t parent, char *name, uint32_t *inumber);
+bool dcache_lookup_name(uint32_t parent, uint32_t inumber, char *name);
+void dcache_insert(uint32_t parent, char *name, uint32_t inumber);
+void dcache_invalidate(uint32_t parent, char *name);
+void dcache_invalidate_dir(uint32_t parent);
+
+
+#endif
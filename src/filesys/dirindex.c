@@ -0,0 +1,476 @@
+/**
+ * Hashed directory index of VSFS, see `vsfs.h` for the layout.
+ *
+ * A lookup reads the root block, at most one index block, and the one
+ * leaf block the name hashes to, instead of every block of the directory.
+ * Adding a name to a full leaf splits the leaf by hash into a new block
+ * appended to the directory, and adds an entry for the new leaf to the
+ * parent index node. A full index node is split the same way, and a full
+ * root at depth 0 is pushed down into a new index block. Directories
+ * never shrink and removing a name just clears its dentry, so nodes are
+ * never merged.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dirindex.h"
+#include "file.h"
+#include "block.h"
+#include "vsfs.h"
+#include "journal.h"
+
+#include "../common/debug.h"
+#include "../common/string.h"
+
+
+/** Zeros written to grow a directory by a block. */
+static char zero_block[BLOCK_SIZE];
+
+
+/** Buffers on the path from the root to the leaf a hash falls in. */
+struct dx_path {
+    block_request_t *root_buf;
+    dx_slot_t *root;
+    uint32_t root_pos;
+    block_request_t *node_buf;  /** NULL at depth 0. */
+    dx_slot_t *node;
+    uint32_t node_pos;
+    block_request_t *leaf_buf;
+    uint32_t leaf;              /** Logical block number of the leaf. */
+};
+typedef struct dx_path dx_path_t;
+
+
+/** FNV-1a hash of a filename. */
+static uint32_t
+_dx_hash(char *filename)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILENAME && filename[i] != '\0'; ++i) {
+        hash ^= (uint8_t) filename[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** Entry I of the index node made of SLOTS. */
+static dx_entry_t *
+_dx_entry(dx_slot_t *slots, uint32_t i)
+{
+    return &(slots[i / DX_ENTRIES_PER_SLOT].entries[i % DX_ENTRIES_PER_SLOT]);
+}
+
+/** Position of the last entry of a node with hash <= HASH. */
+static uint32_t
+_dx_search(dx_slot_t *slots, uint32_t hash)
+{
+    uint32_t lo = 1, hi = slots[0].num;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (_dx_entry(slots, mid)->hash <= hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/** Insert entry HASH -> BLOCK at position POS of a node with room. */
+static void
+_dx_insert(dx_slot_t *slots, uint32_t pos, uint32_t hash, uint32_t block)
+{
+    for (uint32_t i = slots[0].num; i > pos; --i)
+        *_dx_entry(slots, i) = *_dx_entry(slots, i - 1);
+    _dx_entry(slots, pos)->hash = hash;
+    _dx_entry(slots, pos)->block = block;
+    slots[0].num++;
+}
+
+/** Root node inside the buffer of block 0. */
+static dx_slot_t *
+_dx_root(block_request_t *buf)
+{
+    return (dx_slot_t *) (buf->data + 2 * DENTRY_SIZE);
+}
+
+static void
+_dx_path_put(dx_path_t *path)
+{
+    if (path->leaf_buf != NULL)
+        block_put(path->leaf_buf);
+    if (path->node_buf != NULL)
+        block_put(path->node_buf);
+    block_put(path->root_buf);
+}
+
+/**
+ * Walk down the index of DIR_INODE to the leaf HASH falls in, holding
+ * the buffers on the way in PATH. Returns false on failures, in which
+ * case no buffer is held.
+ */
+static bool
+_dx_walk(mem_inode_t *dir_inode, uint32_t hash, dx_path_t *path)
+{
+    path->node_buf = NULL;
+    path->node = NULL;
+    path->leaf_buf = NULL;
+
+    path->root_buf = inode_block_get(dir_inode, 0);
+    if (path->root_buf == NULL)
+        return false;
+    path->root = _dx_root(path->root_buf);
+    if (path->root[0].num == 0 || path->root[0].num > DX_ROOT_ENTRIES
+        || path->root[0].depth > DX_MAX_DEPTH) {
+        warn("dir_index: corrupted index root of directory %u",
+             dir_inode->inumber);
+        _dx_path_put(path);
+        return false;
+    }
+    path->root_pos = _dx_search(path->root, hash);
+    uint32_t block = _dx_entry(path->root, path->root_pos)->block;
+
+    if (path->root[0].depth > 0) {
+        path->node_buf = inode_block_get(dir_inode, block);
+        if (path->node_buf == NULL) {
+            _dx_path_put(path);
+            return false;
+        }
+        path->node = (dx_slot_t *) path->node_buf->data;
+        if (path->node[0].num == 0 || path->node[0].num > DX_NODE_ENTRIES) {
+            warn("dir_index: corrupted index block %u of directory %u",
+                 block, dir_inode->inumber);
+            _dx_path_put(path);
+            return false;
+        }
+        path->node_pos = _dx_search(path->node, hash);
+        block = _dx_entry(path->node, path->node_pos)->block;
+    }
+
+    path->leaf = block;
+    path->leaf_buf = inode_block_get(dir_inode, block);
+    if (path->leaf_buf == NULL) {
+        _dx_path_put(path);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Append a zeroed block to an indexed directory. Returns its logical
+ * block number, or 0 on failures (as block 0 always exists).
+ */
+static uint32_t
+_dx_grow(mem_inode_t *dir_inode)
+{
+    uint32_t size = dir_inode->d_inode.size;
+    assert(size % BLOCK_SIZE == 0);
+    if (inode_write(dir_inode, zero_block, size, BLOCK_SIZE) != BLOCK_SIZE) {
+        warn("dir_index: failed to grow directory %u", dir_inode->inumber);
+        return 0;
+    }
+    return size / BLOCK_SIZE;
+}
+
+/** Index of an unused dentry in a leaf block, or -1 if full. */
+static int32_t
+_dx_free_slot(dentry_t *dentries)
+{
+    for (int32_t i = 0; i < (int32_t) DENTRIES_PB; ++i) {
+        if (dentries[i].valid == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void
+_dx_fill(dentry_t *dentry, char *filename, uint32_t inumber)
+{
+    memset(dentry, 0, sizeof(dentry_t));
+    strncpy(dentry->filename, filename, MAX_FILENAME);
+    dentry->inumber = inumber;
+    dentry->valid = 1;
+}
+
+/**
+ * Make sure the parent index node on PATH has room for one more entry,
+ * pushing down the root or splitting the index block if it is full.
+ * Returns false on failures.
+ */
+static bool
+_dx_make_room(mem_inode_t *dir_inode, dx_path_t *path)
+{
+    dx_slot_t *root = path->root;
+
+    if (root[0].depth == 0) {
+        if (root[0].num < DX_ROOT_ENTRIES)
+            return true;
+
+        /** Move all root entries into a new index block below it. */
+        uint32_t block = _dx_grow(dir_inode);
+        if (block == 0)
+            return false;
+        block_request_t *buf = inode_block_get(dir_inode, block);
+        if (buf == NULL)
+            return false;
+        dx_slot_t *node = (dx_slot_t *) buf->data;
+        for (uint32_t i = 0; i < root[0].num; ++i)
+            *_dx_entry(node, i) = *_dx_entry(root, i);
+        node[0].num = root[0].num;
+
+        root[0].num = 1;
+        root[0].depth = 1;
+        _dx_entry(root, 0)->hash = 0;
+        _dx_entry(root, 0)->block = block;
+        journal_write(buf);
+        journal_write(path->root_buf);
+
+        path->node_buf = buf;
+        path->node = node;
+        path->node_pos = path->root_pos;
+        path->root_pos = 0;
+        return true;
+    }
+
+    if (path->node[0].num < DX_NODE_ENTRIES)
+        return true;
+    if (root[0].num == DX_ROOT_ENTRIES) {
+        warn("dir_index: index of directory %u is full", dir_inode->inumber);
+        return false;
+    }
+
+    /** Split the index block, moving its upper half into a new one. */
+    uint32_t block = _dx_grow(dir_inode);
+    if (block == 0)
+        return false;
+    block_request_t *buf = inode_block_get(dir_inode, block);
+    if (buf == NULL)
+        return false;
+    dx_slot_t *node = (dx_slot_t *) buf->data;
+    uint32_t half = DX_NODE_ENTRIES / 2;
+    for (uint32_t i = half; i < path->node[0].num; ++i)
+        *_dx_entry(node, i - half) = *_dx_entry(path->node, i);
+    node[0].num = path->node[0].num - half;
+    path->node[0].num = half;
+    _dx_insert(root, path->root_pos + 1, _dx_entry(node, 0)->hash, block);
+    journal_write(buf);
+    journal_write(path->node_buf);
+    journal_write(path->root_buf);
+
+    if (path->node_pos >= half) {
+        block_put(path->node_buf);
+        path->node_buf = buf;
+        path->node = node;
+        path->node_pos -= half;
+        path->root_pos++;
+    } else
+        block_put(buf);
+    return true;
+}
+
+/**
+ * Split the full leaf on PATH by hash into a new leaf block, adding it
+ * to the parent index node, then add FILENAME of HASH -> INUMBER to the
+ * side it falls in. Returns false on failures.
+ */
+static bool
+_dx_split_add(mem_inode_t *dir_inode, dx_path_t *path, uint32_t hash,
+              char *filename, uint32_t inumber)
+{
+    dentry_t *dentries = (dentry_t *) path->leaf_buf->data;
+
+    /**
+     * Pick the split hash closest to the middle that leaves at most
+     * DENTRIES_PB names on either side.
+     */
+    uint32_t hashes[DENTRIES_PB + 1], sorted[DENTRIES_PB + 1];
+    for (size_t i = 0; i < DENTRIES_PB; ++i)
+        hashes[i] = _dx_hash(dentries[i].filename);
+    hashes[DENTRIES_PB] = hash;
+    for (size_t i = 0; i <= DENTRIES_PB; ++i) {
+        size_t j = i;
+        while (j > 0 && sorted[j - 1] > hashes[i]) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = hashes[i];
+    }
+
+    uint32_t split = 0;
+    bool found = false;
+    for (size_t d = 0; d < DENTRIES_PB && !found; ++d) {
+        size_t cands[2] = {(DENTRIES_PB + 1) / 2 + d, (DENTRIES_PB + 1) / 2 - d};
+        for (size_t c = 0; c < 2 && !found; ++c) {
+            size_t k = cands[c];
+            if (k >= 1 && k <= DENTRIES_PB && sorted[k - 1] != sorted[k]) {
+                split = sorted[k];
+                found = true;
+            }
+        }
+    }
+    if (!found) {
+        warn("dir_index: too many hash collisions in directory %u",
+             dir_inode->inumber);
+        return false;
+    }
+
+    dx_slot_t *parent = path->node != NULL ? path->node : path->root;
+    uint32_t parent_pos = path->node != NULL ? path->node_pos
+                                             : path->root_pos;
+    block_request_t *parent_buf = path->node != NULL ? path->node_buf
+                                                     : path->root_buf;
+
+    uint32_t block = _dx_grow(dir_inode);
+    if (block == 0)
+        return false;
+    block_request_t *buf = inode_block_get(dir_inode, block);
+    if (buf == NULL)
+        return false;
+    dentry_t *new_dentries = (dentry_t *) buf->data;
+
+    size_t moved = 0;
+    for (size_t i = 0; i < DENTRIES_PB; ++i) {
+        if (hashes[i] >= split) {
+            new_dentries[moved++] = dentries[i];
+            memset(&dentries[i], 0, sizeof(dentry_t));
+        }
+    }
+
+    dentry_t *side = hash >= split ? new_dentries : dentries;
+    _dx_fill(&side[_dx_free_slot(side)], filename, inumber);
+
+    _dx_insert(parent, parent_pos + 1, split, block);
+    journal_write(buf);
+    journal_write(path->leaf_buf);
+    journal_write(parent_buf);
+    block_put(buf);
+    return true;
+}
+
+
+/**
+ * Look up FILENAME in an indexed directory. If found, stores the inumber
+ * into *INUMBER and the byte offset of its dentry into *ENTRY_OFFSET (if
+ * not NULL), and returns DIR_FIND_FOUND. Returns DIR_FIND_MISS if not
+ * found, or DIR_FIND_ERROR if the index could not be read.
+ * Must be called with lock on DIR_INODE held.
+ */
+int8_t
+dir_index_find(mem_inode_t *dir_inode, char *filename,
+               uint32_t *inumber, uint32_t *entry_offset)
+{
+    /** '.' and '..' sit in front of the root. */
+    if (strncmp(filename, ".", MAX_FILENAME) == 0
+        || strncmp(filename, "..", MAX_FILENAME) == 0) {
+        block_request_t *buf = inode_block_get(dir_inode, 0);
+        if (buf == NULL)
+            return DIR_FIND_ERROR;
+        uint32_t slot = filename[1] == '\0' ? 0 : 1;
+        dentry_t *dentry = &((dentry_t *) buf->data)[slot];
+        bool valid = dentry->valid != 0;
+        *inumber = dentry->inumber;
+        block_put(buf);
+        if (valid && entry_offset != NULL)
+            *entry_offset = slot * DENTRY_SIZE;
+        return valid ? DIR_FIND_FOUND : DIR_FIND_MISS;
+    }
+
+    dx_path_t path;
+    if (!_dx_walk(dir_inode, _dx_hash(filename), &path))
+        return DIR_FIND_ERROR;
+
+    dentry_t *dentries = (dentry_t *) path.leaf_buf->data;
+    bool found = false;
+    for (size_t i = 0; i < DENTRIES_PB; ++i) {
+        if (dentries[i].valid != 0
+            && strncmp(dentries[i].filename, filename, MAX_FILENAME) == 0) {
+            *inumber = dentries[i].inumber;
+            if (entry_offset != NULL)
+                *entry_offset = path.leaf * BLOCK_SIZE + i * DENTRY_SIZE;
+            found = true;
+            break;
+        }
+    }
+
+    _dx_path_put(&path);
+    return found ? DIR_FIND_FOUND : DIR_FIND_MISS;
+}
+
+/**
+ * Add a dentry FILENAME -> INUMBER into an indexed directory, which must
+ * not contain the name yet. Returns false on failures.
+ * Must be called within a journal operation, with lock on DIR_INODE held.
+ */
+bool
+dir_index_add(mem_inode_t *dir_inode, char *filename, uint32_t inumber)
+{
+    uint32_t hash = _dx_hash(filename);
+    dx_path_t path;
+    if (!_dx_walk(dir_inode, hash, &path))
+        return false;
+
+    dentry_t *dentries = (dentry_t *) path.leaf_buf->data;
+    int32_t slot = _dx_free_slot(dentries);
+    bool success = true;
+    if (slot >= 0) {
+        _dx_fill(&dentries[slot], filename, inumber);
+        journal_write(path.leaf_buf);
+    } else {
+        success = _dx_make_room(dir_inode, &path)
+                  && _dx_split_add(dir_inode, &path, hash, filename, inumber);
+    }
+
+    _dx_path_put(&path);
+    return success;
+}
+
+/**
+ * Turn a linear directory whose only block is full into an indexed one,
+ * moving all its entries but '.' and '..' into a first leaf block, then
+ * add a dentry FILENAME -> INUMBER. Returns false on failures, leaving
+ * the directory linear if it could not be converted.
+ * Must be called within a journal operation, with lock on DIR_INODE held.
+ */
+bool
+dir_index_create(mem_inode_t *dir_inode, char *filename, uint32_t inumber)
+{
+    assert(dir_inode->d_inode.size == BLOCK_SIZE);
+    assert((dir_inode->d_inode.flags & INODE_FLAG_DIR_INDEX) == 0);
+
+    /** An appended empty block keeps it a valid linear directory. */
+    uint32_t leaf = _dx_grow(dir_inode);
+    if (leaf == 0)
+        return false;
+
+    block_request_t *root_buf = inode_block_get(dir_inode, 0);
+    if (root_buf == NULL)
+        return false;
+    block_request_t *leaf_buf = inode_block_get(dir_inode, leaf);
+    if (leaf_buf == NULL) {
+        block_put(root_buf);
+        return false;
+    }
+
+    memcpy(leaf_buf->data, root_buf->data + 2 * DENTRY_SIZE,
+           DX_ROOT_SLOTS * DENTRY_SIZE);
+    memset(root_buf->data + 2 * DENTRY_SIZE, 0, DX_ROOT_SLOTS * DENTRY_SIZE);
+    dx_slot_t *root = _dx_root(root_buf);
+    root[0].num = 1;
+    root[0].depth = 0;
+    _dx_entry(root, 0)->hash = 0;
+    _dx_entry(root, 0)->block = leaf;
+    journal_write(leaf_buf);
+    journal_write(root_buf);
+    block_put(leaf_buf);
+    block_put(root_buf);
+
+    dir_inode->d_inode.flags |= INODE_FLAG_DIR_INDEX;
+    if (!inode_flush(dir_inode)) {
+        warn("dir_index: failed to flush directory %u", dir_inode->inumber);
+        return false;
+    }
+
+    return dir_index_add(dir_inode, filename, inumber);
+}
@@ -0,0 +1,32 @@
+/**
+ * Hashed directory index of VSFS.
+ */
+
+
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "file.h"
+
+
+/**
+ * Results of looking up a name in a directory, telling a definite miss
+ * apart from failing to read the directory.
+ */
+#define DIR_FIND_ERROR (-1)
+#define DIR_FIND_MISS  0
+#define DIR_FIND_FOUND 1
+
+
+int8_t dir_index_find(mem_inode_t *dir_inode, char *filename,
+                      uint32_t *inumber, uint32_t *entry_offset);
+bool dir_index_add(mem_inode_t *dir_inode, char *filename, uint32_t inumber);
+bool dir_index_create(mem_inode_t *dir_inode, char *filename,
+                      uint32_t inumber);
+
+
+#endif
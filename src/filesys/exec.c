@@ -18,6 +18,7 @@
 
 #include "../memory/paging.h"
 #include "../memory/slabs.h"
+#include "../memory/mmap.h"
 
 #include "../process/process.h"
 #include "../process/scheduler.h"
@@ -40,10 +41,20 @@ exec_program(mem_inode_t *inode, char *filename, char **argv)
     process_t *proc = running_proc();
     pde_t *pgdir = NULL;
 
+    /**
+     * Segment reads are submitted in one batch to keep the disk busy,
+     * with readahead prefetching the upcoming part of the file.
+     */
+    block_batch_t batch;
+    block_batch_init(&batch);
+    readahead_t ra;
+    readahead_init(&ra);
+
     inode_lock(inode);
 
     /** Read in ELF header, sanity check magic number. */
     elf_file_header_t elf_header;
+    inode_readahead(inode, &ra, 0, sizeof(elf_file_header_t));
     if (inode_read(inode, (char *) &elf_header, 0,
                    sizeof(elf_file_header_t)) != sizeof(elf_file_header_t)) {
         warn("exec: failed to read ELF file header");
@@ -87,6 +98,7 @@ exec_program(mem_inode_t *inode, char *filename, char **argv)
     for (size_t idx = 0; idx < elf_header.phnum; ++idx) {
         /** Read in this program header. */
         size_t offset = elf_header.phoff + idx * sizeof(elf_program_header_t);
+        inode_readahead(inode, &ra, offset, sizeof(elf_program_header_t));
         if (inode_read(inode, (char *) &prog_header, offset,
                        sizeof(elf_program_header_t)) != sizeof(elf_program_header_t)) {
             goto fail;
@@ -125,8 +137,9 @@ exec_program(mem_inode_t *inode, char *filename, char **argv)
             uint32_t paddr_curr = paddr + ADDR_PAGE_OFFSET(vaddr_curr);
 
             if (effective_e > 0) {
-                if (inode_read(inode, (char *) paddr_curr, elf_curr,
-                               effective_e) != effective_e) {
+                inode_readahead(inode, &ra, elf_curr, effective_e);
+                if (inode_read_async(inode, (char *) paddr_curr, elf_curr,
+                                     effective_e, &batch) != effective_e) {
                     goto fail;
                 }
                 elf_curr += effective_e;
@@ -139,6 +152,11 @@ exec_program(mem_inode_t *inode, char *filename, char **argv)
             vaddr_elf_max = ADDR_PAGE_ROUND_UP(vaddr_curr);
     }
 
+    if (!block_batch_wait(&batch)) {
+        warn("exec: failed to read in program segments");
+        goto fail;
+    }
+
     inode_unlock(inode);
     inode_put(inode);
     inode = NULL;
@@ -192,6 +210,9 @@ exec_program(mem_inode_t *inode, char *filename, char **argv)
     /** Change process name. */
     strncpy(proc->name, filename, strlen(filename));
 
+    /** Drop file mappings of the old image, writing back shared ones. */
+    mmap_release();
+
     /** Switch to the new page directory, discarding old state. */
     pde_t *old_pgdir = proc->pgdir;
     uint32_t old_heap_high = proc->heap_high;
@@ -210,6 +231,7 @@ exec_program(mem_inode_t *inode, char *filename, char **argv)
     return true;
 
 fail:
+    block_batch_wait(&batch);   /** Pages must not be freed under I/O. */
     if (pgdir != NULL) {
         paging_unmap_range(pgdir, USER_BASE, HEAP_BASE);
         paging_unmap_range(pgdir, USER_MAX - PAGE_SIZE, USER_MAX);
@@ -0,0 +1,409 @@
+/**
+ * Extent tree mapping of VSFS inodes with INODE_FLAG_EXTENTS.
+ *
+ * A contiguously laid out file needs only a handful of extents, which
+ * all fit in the inline root, so looking up any of its blocks touches no
+ * block other than the data block itself. Larger or fragmented files get
+ * index nodes in their own blocks, found by binary search on each level.
+ *
+ * Files only grow at the end, so appending a block only ever touches the
+ * rightmost path of the tree: either the last extent gets longer, or a
+ * new extent is added to the rightmost leaf, starting a new chain of
+ * nodes under the lowest ancestor with room if that leaf is full, or
+ * pushing the root down into its own block if every node on the path is.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "extent.h"
+#include "file.h"
+#include "block.h"
+#include "vsfs.h"
+#include "journal.h"
+
+#include "../common/debug.h"
+#include "../common/string.h"
+
+
+/** Copy of the inline root node, as the on-disk inode is packed. */
+struct extent_root {
+    extent_header_t header;
+    extent_t entries[EXTENTS_INLINE];
+};
+typedef struct extent_root extent_root_t;
+
+/** A node on the path being worked on, BUF is NULL for the root. */
+struct extent_path {
+    extent_header_t *header;
+    extent_t *entries;
+    uint32_t capacity;
+    block_request_t *buf;
+};
+typedef struct extent_path extent_path_t;
+
+
+static void
+_extent_root_load(mem_inode_t *m_inode, extent_root_t *root)
+{
+    memcpy(root, &(m_inode->d_inode.ext_header), sizeof(extent_root_t));
+}
+
+static void
+_extent_root_store(mem_inode_t *m_inode, extent_root_t *root)
+{
+    memcpy(&(m_inode->d_inode.ext_header), root, sizeof(extent_root_t));
+}
+
+/** Index of the last of NUM entries with LSTART <= LBLOCK, or -1. */
+static int32_t
+_extent_search(extent_t *entries, uint32_t num, uint32_t lblock)
+{
+    int32_t lo = 0, hi = (int32_t) num - 1, found = -1;
+    while (lo <= hi) {
+        int32_t mid = (lo + hi) / 2;
+        if (entries[mid].lstart <= lblock) {
+            found = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+/** Whether a node read from disk looks sane at the expected DEPTH. */
+static bool
+_extent_node_valid(extent_node_t *node, uint32_t depth)
+{
+    return node->header.num <= EXTENTS_PB && node->header.depth == depth;
+}
+
+
+/**
+ * Look up the disk address of logical block LBLOCK of an extent-mapped
+ * inode, also storing the extent covering it into FOUND if not NULL.
+ * Returns address 0 on failures or if not mapped.
+ * Must be called with lock on M_INODE held.
+ */
+uint32_t
+extent_lookup(mem_inode_t *m_inode, uint32_t lblock, extent_t *found)
+{
+    extent_root_t root;
+    _extent_root_load(m_inode, &root);
+
+    extent_t *entries = root.entries;
+    uint32_t num = root.header.num;
+    uint32_t depth = root.header.depth;
+    block_request_t *buf = NULL;
+    uint32_t addr = 0;
+
+    while (true) {
+        int32_t i = _extent_search(entries, num, lblock);
+        if (i < 0)
+            break;
+
+        if (depth == 0) {
+            if (lblock - entries[i].lstart < entries[i].len) {
+                addr = (entries[i].pstart + lblock - entries[i].lstart) * BLOCK_SIZE;
+                if (found != NULL)
+                    *found = entries[i];
+            }
+            break;
+        }
+
+        /** Descend into the child node, dropping the parent. */
+        block_request_t *child = block_get(entries[i].pstart);
+        if (buf != NULL)
+            block_put(buf);
+        buf = child;
+        if (buf == NULL)
+            return 0;
+
+        extent_node_t *node = (extent_node_t *) buf->data;
+        if (!_extent_node_valid(node, --depth)) {
+            warn("extent_lookup: corrupted extent node in block %u",
+                 buf->block_no);
+            break;
+        }
+        entries = node->entries;
+        num = node->header.num;
+    }
+
+    if (buf != NULL)
+        block_put(buf);
+    return addr;
+}
+
+
+/** Release the node buffers on PATH below the root, down to LEVEL. */
+static void
+_extent_path_put(extent_path_t *path, uint32_t level)
+{
+    for (uint32_t l = 1; l <= level; ++l)
+        block_put(path[l].buf);
+}
+
+/** Log a modified node on the path; the root gets stored by the caller. */
+static void
+_extent_path_dirty(extent_path_t *node)
+{
+    if (node->buf != NULL)
+        journal_write(node->buf);
+}
+
+/**
+ * Add entry EXTENT at the end of the rightmost path of DEPTH levels,
+ * growing the tree as needed, with NODE_BUFS holding the new node blocks
+ * it takes (see `_extent_nodes_needed()`). Returns the new depth.
+ */
+static uint32_t
+_extent_insert(extent_path_t *path, uint32_t depth, extent_t extent,
+               block_request_t **node_bufs)
+{
+    /** Find the lowest node on the path with room. */
+    int32_t level = depth;
+    while (level >= 0 && path[level].header->num == path[level].capacity)
+        level--;
+
+    /**
+     * All full: move the root's entries into a new node block, which
+     * becomes the root's only child, one level deeper.
+     */
+    if (level < 0) {
+        block_request_t *buf = *node_bufs++;
+        extent_node_t *node = (extent_node_t *) buf->data;
+        node->header = *(path[0].header);
+        memcpy(node->entries, path[0].entries,
+               path[0].header->num * sizeof(extent_t));
+        journal_write(buf);
+
+        path[0].header->depth++;
+        path[0].header->num = 1;
+        path[0].entries[0].lstart = node->entries[0].lstart;
+        path[0].entries[0].pstart = buf->block_no;
+        path[0].entries[0].len = 0;
+
+        for (uint32_t l = depth + 1; l > 1; --l)
+            path[l] = path[l - 1];
+        path[1].header = &node->header;
+        path[1].entries = node->entries;
+        path[1].capacity = EXTENTS_PB;
+        path[1].buf = buf;
+        depth++;
+        level = 0;
+    }
+
+    /** Build a new chain of nodes below LEVEL, from the leaf up. */
+    extent_t entry = extent;
+    for (uint32_t l = depth; l > (uint32_t) level; --l) {
+        block_request_t *buf = *node_bufs++;
+        extent_node_t *node = (extent_node_t *) buf->data;
+        node->header.num = 1;
+        node->header.depth = depth - l;
+        node->entries[0] = entry;
+        journal_write(buf);
+
+        entry.pstart = buf->block_no;
+        entry.len = 0;
+        block_put(buf);
+    }
+
+    extent_path_t *parent = &path[level];
+    parent->entries[parent->header->num++] = entry;
+    _extent_path_dirty(parent);
+    return depth;
+}
+
+/**
+ * Number of new node blocks `_extent_insert()` takes on a rightmost path
+ * of DEPTH levels: one per full node at the bottom of the path, plus one
+ * to push the root down if all are full.
+ */
+static uint32_t
+_extent_nodes_needed(extent_path_t *path, uint32_t depth)
+{
+    uint32_t needed = 0;
+    while (needed <= depth
+           && path[depth - needed].header->num == path[depth - needed].capacity)
+        needed++;
+    if (needed > depth)
+        needed++;
+    return needed;
+}
+
+/**
+ * Map logical block LBLOCK, which must be right past the last mapped
+ * one, to a newly allocated block. It is placed right after the last
+ * mapped block if possible, extending the last extent, or at or after
+ * HINT_ADDR for the first block. Modified tree nodes are logged in the
+ * journal; the root is updated in the in-memory inode only, to be
+ * flushed by the caller. Returns the disk address of the new block, or
+ * 0 on failures.
+ * Must be called within a journal operation, with lock on M_INODE held.
+ */
+uint32_t
+extent_append(mem_inode_t *m_inode, uint32_t lblock, uint32_t hint_addr)
+{
+    extent_root_t root;
+    _extent_root_load(m_inode, &root);
+
+    uint32_t depth = root.header.depth;
+    if (depth > EXTENT_MAX_DEPTH) {
+        warn("extent_append: corrupted extent root of inode %u",
+             m_inode->inumber);
+        return 0;
+    }
+
+    /** Walk down the rightmost path, holding the nodes on it. */
+    extent_path_t path[EXTENT_MAX_DEPTH + 2];
+    path[0].header = &root.header;
+    path[0].entries = root.entries;
+    path[0].capacity = EXTENTS_INLINE;
+    path[0].buf = NULL;
+    for (uint32_t l = 1; l <= depth; ++l) {
+        extent_path_t *parent = &path[l - 1];
+        block_request_t *buf = NULL;
+        if (parent->header->num > 0)
+            buf = block_get(parent->entries[parent->header->num - 1].pstart);
+        extent_node_t *node = buf != NULL ? (extent_node_t *) buf->data : NULL;
+        if (node == NULL || !_extent_node_valid(node, depth - l)) {
+            warn("extent_append: failed to load extent node of inode %u",
+                 m_inode->inumber);
+            if (buf != NULL)
+                block_put(buf);
+            _extent_path_put(path, l - 1);
+            return 0;
+        }
+        path[l].header = &node->header;
+        path[l].entries = node->entries;
+        path[l].capacity = EXTENTS_PB;
+        path[l].buf = buf;
+    }
+
+    extent_path_t *leaf = &path[depth];
+    extent_t *last = leaf->header->num > 0
+                     ? &leaf->entries[leaf->header->num - 1] : NULL;
+    uint32_t end = last != NULL ? last->lstart + last->len : 0;
+    if (lblock != end) {
+        warn("extent_append: block %u is not at the end %u of inode %u",
+             lblock, end, m_inode->inumber);
+        _extent_path_put(path, depth);
+        return 0;
+    }
+    if (last != NULL)
+        hint_addr = (last->pstart + last->len) * BLOCK_SIZE;
+
+    uint32_t addr = block_alloc_run(1, hint_addr);
+    if (addr == 0) {
+        _extent_path_put(path, depth);
+        return 0;
+    }
+    uint32_t block_no = ADDR_BLOCK_NUMBER(addr);
+
+    if (last != NULL && last->pstart + last->len == block_no) {
+        last->len++;
+        _extent_path_dirty(leaf);
+
+    } else {
+        /**
+         * Get the node blocks a new extent needs up front, so that
+         * failing leaves the tree untouched. They go to the start of the
+         * inode's group, away from the run of data after the file.
+         */
+        uint32_t needed = _extent_nodes_needed(path, depth);
+        if (needed > depth + 1 && depth == EXTENT_MAX_DEPTH) {
+            warn("extent_append: extent tree of inode %u too deep",
+                 m_inode->inumber);
+            block_free(addr);
+            _extent_path_put(path, depth);
+            return 0;
+        }
+
+        uint32_t node_hint = GROUP_DATA_START(INODE_GROUP(m_inode->inumber))
+                             * BLOCK_SIZE;
+        uint32_t node_addrs[EXTENT_MAX_DEPTH + 2];
+        block_request_t *node_bufs[EXTENT_MAX_DEPTH + 2];
+        uint32_t got = 0;
+        for (; got < needed; ++got) {
+            node_addrs[got] = block_alloc_run(1, node_hint);
+            if (node_addrs[got] == 0)
+                break;
+            node_bufs[got] = block_get(ADDR_BLOCK_NUMBER(node_addrs[got]));
+            if (node_bufs[got] == NULL) {
+                block_free(node_addrs[got]);
+                break;
+            }
+        }
+        if (got < needed) {
+            for (uint32_t i = 0; i < got; ++i) {
+                block_put(node_bufs[i]);
+                block_free(node_addrs[i]);
+            }
+            block_free(addr);
+            _extent_path_put(path, depth);
+            return 0;
+        }
+
+        extent_t extent = {.lstart = lblock, .pstart = block_no, .len = 1};
+        depth = _extent_insert(path, depth, extent, node_bufs);
+    }
+
+    _extent_path_put(path, depth);
+    _extent_root_store(m_inode, &root);
+    return addr;
+}
+
+
+/**
+ * Free the NUM subtrees or extents in ENTRIES of a node at DEPTH, along
+ * with the node blocks under it.
+ */
+static void
+_extent_free_entries(extent_t *entries, uint32_t num, uint32_t depth)
+{
+    for (uint32_t i = 0; i < num; ++i) {
+        if (depth == 0) {
+            block_free_run(entries[i].pstart * BLOCK_SIZE, entries[i].len);
+            continue;
+        }
+
+        block_request_t *buf = block_get(entries[i].pstart);
+        if (buf != NULL) {
+            extent_node_t *node = (extent_node_t *) buf->data;
+            if (_extent_node_valid(node, depth - 1)) {
+                _extent_free_entries(node->entries, node->header.num,
+                                     depth - 1);
+            } else {
+                warn("extent_free: corrupted extent node in block %u",
+                     buf->block_no);
+            }
+            block_put(buf);
+        }
+        block_free(entries[i].pstart * BLOCK_SIZE);
+    }
+}
+
+/**
+ * Free all blocks of an extent-mapped inode, including tree nodes, and
+ * reset its root to empty. Freeing itself does no disk I/O, as freed
+ * blocks are only marked stale, so the caller may flush the emptied
+ * inode either before or after.
+ * Must be called within a journal operation, with lock on M_INODE held.
+ */
+void
+extent_free_all(mem_inode_t *m_inode)
+{
+    extent_root_t root, empty;
+    _extent_root_load(m_inode, &root);
+    memset(&empty, 0, sizeof(extent_root_t));
+    _extent_root_store(m_inode, &empty);
+
+    if (root.header.depth > EXTENT_MAX_DEPTH
+        || root.header.num > EXTENTS_INLINE) {
+        warn("extent_free: corrupted extent root of inode %u",
+             m_inode->inumber);
+        return;
+    }
+    _extent_free_entries(root.entries, root.header.num, root.header.depth);
+}
@@ -0,0 +1,22 @@
+/**
+ * Extent tree mapping of VSFS inodes.
+ */
+
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+
+#include <stdint.h>
+
+#include "file.h"
+
+
+uint32_t extent_lookup(mem_inode_t *m_inode, uint32_t lblock,
+                       extent_t *found);
+uint32_t extent_append(mem_inode_t *m_inode, uint32_t lblock,
+                       uint32_t hint_addr);
+void extent_free_all(mem_inode_t *m_inode);
+
+
+#endif
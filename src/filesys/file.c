@@ -10,17 +10,32 @@
 #include "file.h"
 #include "block.h"
 #include "vsfs.h"
+#include "journal.h"
+#include "extent.h"
 #include "sysfile.h"
+#include "pcache.h"
 
 #include "../common/debug.h"
 #include "../common/string.h"
 #include "../common/spinlock.h"
 #include "../common/parklock.h"
 
+#include "../memory/kheap.h"
 
-/** Open inode cache - list of in-memory inode structures. */
-mem_inode_t icache[MAX_MEM_INODES];
-spinlock_t icache_lock;
+
+/**
+ * Inode cache - in-memory inode structures, allocated at boot. Unused
+ * ones (reference count 0) sit on an LRU list, still cached if they hold
+ * an inode, so that reopening a hot file does not read its inode again.
+ */
+static mem_inode_t *icache;
+static uint32_t icache_size;
+
+static mem_inode_t *icache_hash[ICACHE_HASH_SIZE];
+static mem_inode_t *icache_lru_head;
+static mem_inode_t *icache_lru_tail;
+
+static spinlock_t icache_lock;
 
 /** Open file table - list of open file structures. */
 file_t ftable[MAX_OPEN_FILES];
@@ -35,7 +50,7 @@ _print_icache_state(void)
     spinlock_acquire(&icache_lock);
 
     info("Inode cache state:");
-    for (mem_inode_t *inode = icache; inode < &icache[MAX_MEM_INODES]; ++inode) {
+    for (mem_inode_t *inode = icache; inode < &icache[icache_size]; ++inode) {
         if (inode->ref_cnt == 0)
             continue;
         printf("  inode { inum: %u, ref_cnt: %d, size: %u, dir: %b }\n",
@@ -81,54 +96,186 @@ inode_unlock(mem_inode_t *m_inode)
 }
 
 
+/** LRU list & hash chain manipulations, must hold `icache_lock`. */
+static void
+_icache_lru_remove(mem_inode_t *m_inode)
+{
+    if (m_inode->lru_prev != NULL)
+        m_inode->lru_prev->lru_next = m_inode->lru_next;
+    else
+        icache_lru_head = m_inode->lru_next;
+    if (m_inode->lru_next != NULL)
+        m_inode->lru_next->lru_prev = m_inode->lru_prev;
+    else
+        icache_lru_tail = m_inode->lru_prev;
+    m_inode->lru_prev = NULL;
+    m_inode->lru_next = NULL;
+}
+
+static void
+_icache_lru_push_head(mem_inode_t *m_inode)
+{
+    m_inode->lru_prev = NULL;
+    m_inode->lru_next = icache_lru_head;
+    if (icache_lru_head != NULL)
+        icache_lru_head->lru_prev = m_inode;
+    else
+        icache_lru_tail = m_inode;
+    icache_lru_head = m_inode;
+}
+
+static void
+_icache_hash_remove(mem_inode_t *m_inode)
+{
+    mem_inode_t **link = &icache_hash[ICACHE_HASH(m_inode->inumber)];
+    while (*link != NULL) {
+        if (*link == m_inode) {
+            *link = m_inode->hash_next;
+            break;
+        }
+        link = &((*link)->hash_next);
+    }
+    m_inode->hash_next = NULL;
+    m_inode->cached = false;
+}
+
+static void
+_icache_hash_insert(mem_inode_t *m_inode)
+{
+    mem_inode_t **link = &icache_hash[ICACHE_HASH(m_inode->inumber)];
+    m_inode->hash_next = *link;
+    *link = m_inode;
+    m_inode->cached = true;
+}
+
+static mem_inode_t *
+_icache_hash_lookup(uint32_t inumber)
+{
+    mem_inode_t *m_inode = icache_hash[ICACHE_HASH(inumber)];
+    while (m_inode != NULL && m_inode->inumber != inumber)
+        m_inode = m_inode->hash_next;
+    return m_inode;
+}
+
+
+/**
+ * Fill empty icache slots with the other inodes in inode block BUF, just
+ * read for INUMBER, so that opening neighbouring files (e.g., all files
+ * in a directory being listed) needs no more reads. Only in-use inodes
+ * not cached yet are loaded, and only into slots caching nothing, so
+ * that no cached inode gets displaced by them.
+ * Must be called with BUF locked.
+ */
+static void
+_inode_fill_neighbours(uint32_t inumber, block_request_t *buf)
+{
+    uint32_t first = inumber - inumber % INODES_PB;
+
+    spinlock_acquire(&icache_lock);
+
+    for (uint32_t i = first; i < first + INODES_PB; ++i) {
+        if (i == inumber || !bitmap_check(&inode_bitmap, i)
+            || _icache_hash_lookup(i) != NULL) {
+            continue;
+        }
+
+        mem_inode_t *m_inode = icache_lru_tail;
+        if (m_inode == NULL || m_inode->cached)
+            break;
+        _icache_lru_remove(m_inode);
+
+        m_inode->inumber = i;
+        memcpy(&(m_inode->d_inode),
+               buf->data + ADDR_BLOCK_OFFSET(DISK_ADDR_INODE(i)),
+               sizeof(inode_t));
+        memset(m_inode->map_cache, 0, sizeof(m_inode->map_cache));
+        m_inode->map_next = 0;
+        _icache_hash_insert(m_inode);
+        _icache_lru_push_head(m_inode);
+    }
+
+    spinlock_release(&icache_lock);
+}
+
+/**
+ * Read inode INUMBER from its inode block into M_INODE, loading its
+ * neighbours into the icache along the way.
+ */
+static bool
+_inode_read(mem_inode_t *m_inode, uint32_t inumber)
+{
+    uint32_t disk_addr = DISK_ADDR_INODE(inumber);
+    block_request_t *buf = block_get(ADDR_BLOCK_NUMBER(disk_addr));
+    if (buf == NULL)
+        return false;
+
+    memcpy(&(m_inode->d_inode), buf->data + ADDR_BLOCK_OFFSET(disk_addr),
+           sizeof(inode_t));
+    _inode_fill_neighbours(inumber, buf);
+
+    block_put(buf);
+    return true;
+}
+
 /**
- * Get inode for given inode number. If that inode has been in memory,
- * increment its ref count and return. Otherwise, read from the disk into
- * an empty inode cache slot.
+ * Get inode for given inode number. If that inode is cached in memory,
+ * increment its ref count (taking it off the unused list) and return.
+ * Otherwise, read from the disk into the least recently unused slot.
  */
 static mem_inode_t *
 _inode_get(uint32_t inumber, bool boot)
 {
-    assert(inumber < (superblock.inode_blocks * (BLOCK_SIZE / INODE_SIZE)));
-
-    mem_inode_t *m_inode = NULL;
+    assert(inumber < inode_bitmap.slots);
 
     spinlock_acquire(&icache_lock);
 
     /** Search icache to see if it has been in memory. */
-    mem_inode_t *empty_slot = NULL;
-    for (m_inode = icache; m_inode < &icache[MAX_MEM_INODES]; ++m_inode) {
-        if (m_inode->ref_cnt > 0 && m_inode->inumber == inumber) {
-            m_inode->ref_cnt++;
-            spinlock_release(&icache_lock);
-            return m_inode;
-        }
-        if (empty_slot == NULL && m_inode->ref_cnt == 0)
-            empty_slot = m_inode;   /** Remember empty slot seen. */
+    mem_inode_t *m_inode = _icache_hash_lookup(inumber);
+    if (m_inode != NULL) {
+        if (m_inode->ref_cnt == 0)
+            _icache_lru_remove(m_inode);
+        m_inode->ref_cnt++;
+        spinlock_release(&icache_lock);
+        return m_inode;
     }
 
-    if (empty_slot == NULL) {
+    /**
+     * Take the least recently unused slot that is not waiting for
+     * writeback, dropping what it caches.
+     */
+    m_inode = icache_lru_tail;
+    while (m_inode != NULL && m_inode->dirty)
+        m_inode = m_inode->lru_prev;
+    if (m_inode == NULL) {
         warn("inode_get: no empty mem_inode slot");
         spinlock_release(&icache_lock);
         return NULL;
     }
+    _icache_lru_remove(m_inode);
+    if (m_inode->cached)
+        _icache_hash_remove(m_inode);
 
-    m_inode = empty_slot;
     m_inode->inumber = inumber;
     m_inode->ref_cnt = 1;
-    spinlock_release(&icache_lock);
+    memset(m_inode->map_cache, 0, sizeof(m_inode->map_cache));
+    m_inode->map_next = 0;
+    _icache_hash_insert(m_inode);
 
-    /** Lock the inode and read from disk. */
+    /** Lock the inode before others can find it, then read from disk. */
     inode_lock(m_inode);
+    spinlock_release(&icache_lock);
+
     bool success = boot ? block_read_at_boot((char *) &(m_inode->d_inode),
                                              DISK_ADDR_INODE(inumber),
                                              sizeof(inode_t))
-                        : block_read((char *) &(m_inode->d_inode),
-                                     DISK_ADDR_INODE(inumber),
-                                     sizeof(inode_t));
+                        : _inode_read(m_inode, inumber);
     if (!success) {
         warn("inode_get: failed to read inode %u from disk", inumber);
+        spinlock_acquire(&icache_lock);
+        _icache_hash_remove(m_inode);
+        spinlock_release(&icache_lock);
         inode_unlock(m_inode);
+        inode_put(m_inode);
         return NULL;
     }
     inode_unlock(m_inode);
@@ -161,7 +308,8 @@ inode_ref(mem_inode_t *m_inode)
 
 /**
  * Put down a reference to an inode. If the reference count goes to
- * zero, this icache slot becomes empty.
+ * zero, this icache slot becomes unused, but keeps caching the inode
+ * until the slot is taken for another one.
  */
 void
 inode_put(mem_inode_t *m_inode)
@@ -170,25 +318,188 @@ inode_put(mem_inode_t *m_inode)
     assert(!parklock_holding(&(m_inode->lock)));
     assert(m_inode->ref_cnt > 0);
     m_inode->ref_cnt--;
+    if (m_inode->ref_cnt == 0)
+        _icache_lru_push_head(m_inode);
     spinlock_release(&icache_lock);
 }
 
+/**
+ * Initialize the inode cache with NUM_INODES in-memory inodes allocated
+ * from the kernel heap, all unused and caching nothing.
+ */
+void
+inode_cache_init(uint32_t num_inodes)
+{
+    icache = (mem_inode_t *) kalloc(num_inodes * sizeof(mem_inode_t));
+    if (icache == NULL)
+        error("inode_cache_init: failed to allocate %u inodes", num_inodes);
+    icache_size = num_inodes;
+
+    for (size_t i = 0; i < ICACHE_HASH_SIZE; ++i)
+        icache_hash[i] = NULL;
+    icache_lru_head = NULL;
+    icache_lru_tail = NULL;
+
+    for (size_t i = 0; i < num_inodes; ++i) {
+        mem_inode_t *m_inode = &icache[i];
+        m_inode->ref_cnt = 0;
+        m_inode->cached = false;
+        m_inode->dirty = false;
+        m_inode->hash_next = NULL;
+        parklock_init(&(m_inode->lock), "inode's parklock");
+        _icache_lru_push_head(m_inode);
+    }
 
-/** Flush an in-memory modified inode to disk. */
-static bool
-_flush_inode(mem_inode_t *m_inode)
+    spinlock_init(&icache_lock, "icache_lock");
+}
+
+
+/**
+ * Write an in-memory modified inode back, logging it in the journal.
+ * Must be called within a journal operation, with lock on M_INODE held.
+ */
+bool
+inode_flush(mem_inode_t *m_inode)
+{
+    if (!block_write_journaled((char *) &(m_inode->d_inode),
+                               DISK_ADDR_INODE(m_inode->inumber),
+                               sizeof(inode_t))) {
+        return false;
+    }
+    m_inode->dirty = false;
+    return true;
+}
+
+/**
+ * Mark an in-memory modified inode dirty, deferring its write back to
+ * when the running transaction commits. Repeated updates of the inode,
+ * e.g., the size on every append, then cost nothing more.
+ * Must be called within a journal operation, with lock on M_INODE held.
+ */
+void
+inode_mark_dirty(mem_inode_t *m_inode)
+{
+    if (!m_inode->dirty) {
+        m_inode->dirty = true;
+        journal_defer();
+    }
+}
+
+/**
+ * Write back all dirty inodes into the running transaction. Those that
+ * share an inode block are copied into its buffer together, which gets
+ * logged once. Called by the journal when committing, so no operation
+ * is modifying inodes. Returns the number of inodes left dirty due to
+ * failures.
+ */
+uint32_t
+inode_writeback(void)
+{
+    uint32_t num_failed = 0;
+
+    for (mem_inode_t *m_inode = icache; m_inode < &icache[icache_size];
+         ++m_inode) {
+        if (!m_inode->dirty)
+            continue;
+
+        uint32_t block_no = ADDR_BLOCK_NUMBER(DISK_ADDR_INODE(m_inode->inumber));
+        block_request_t *buf = block_get(block_no);
+        if (buf == NULL) {
+            warn("inode_writeback: failed to get inode block %u", block_no);
+            num_failed++;
+            continue;
+        }
+
+        for (mem_inode_t *other = m_inode; other < &icache[icache_size];
+             ++other) {
+            uint32_t addr = DISK_ADDR_INODE(other->inumber);
+            if (other->dirty && ADDR_BLOCK_NUMBER(addr) == block_no) {
+                memcpy(buf->data + ADDR_BLOCK_OFFSET(addr),
+                       &(other->d_inode), sizeof(inode_t));
+                other->dirty = false;
+            }
+        }
+
+        journal_write(buf);
+        block_put(buf);
+    }
+
+    return num_failed;
+}
+
+/** Look up logical block IDX in the translation cache of M_INODE. */
+static uint32_t
+_map_cache_lookup(mem_inode_t *m_inode, uint32_t idx)
 {
-    return block_write((char *) &(m_inode->d_inode),
-                       DISK_ADDR_INODE(m_inode->inumber),
-                       sizeof(inode_t));
+    for (size_t i = 0; i < INODE_MAP_CACHE; ++i) {
+        extent_t *run = &(m_inode->map_cache[i]);
+        if (idx - run->lstart < run->len)
+            return (run->pstart + idx - run->lstart) * BLOCK_SIZE;
+    }
+    return 0;
 }
 
-/** Allocate an inode structure on disk (and gets into memory). */
+static void
+_map_cache_insert(mem_inode_t *m_inode, extent_t *run)
+{
+    if (run->len == 0)
+        return;
+    m_inode->map_cache[m_inode->map_next] = *run;
+    m_inode->map_next = (m_inode->map_next + 1) % INODE_MAP_CACHE;
+}
+
+static void
+_map_cache_clear(mem_inode_t *m_inode)
+{
+    memset(m_inode->map_cache, 0, sizeof(m_inode->map_cache));
+    m_inode->map_next = 0;
+}
+
+
+/**
+ * Pick the block group for a new inode of TYPE under directory PARENT.
+ * Files go with their parent directory, so that a directory's files stay
+ * close to it. Directories are spread out to the group with the most
+ * free data blocks among those with free inodes, leaving room for what
+ * will be created under them.
+ */
+static uint32_t
+_inode_pick_group(uint32_t type, uint32_t parent)
+{
+    uint32_t best_group = INODE_GROUP(parent);
+    if (type != INODE_TYPE_DIR)
+        return best_group;
+
+    uint32_t best_free = 0;
+    for (uint32_t g = 0; g < superblock.num_groups; ++g) {
+        if (bitmap_range_free(&inode_bitmap, g * superblock.group_inodes,
+                              superblock.group_inodes) == 0) {
+            continue;
+        }
+        uint32_t num_free = bitmap_range_free(&data_bitmap,
+                                              g * superblock.group_blocks,
+                                              superblock.group_blocks);
+        if (num_free > best_free) {
+            best_group = g;
+            best_free = num_free;
+        }
+    }
+
+    return best_group;
+}
+
+/**
+ * Allocate an inode structure on disk (and gets into memory), in the
+ * block group picked for it under directory PARENT, or any group if that
+ * one is full. New inodes map their blocks through extents.
+ */
 mem_inode_t *
-inode_alloc(uint32_t type)
+inode_alloc(uint32_t type, uint32_t parent)
 {
     /** Get a free slot according to bitmap. */
-    uint32_t inumber = bitmap_alloc(&inode_bitmap);
+    uint32_t group = _inode_pick_group(type, parent);
+    uint32_t inumber = bitmap_alloc_range(&inode_bitmap, 1, 1,
+                                          group * superblock.group_inodes);
     if (inumber == inode_bitmap.slots) {
         warn("inode_alloc: no free inode slot left");
         return NULL;
@@ -197,105 +508,184 @@ inode_alloc(uint32_t type)
     inode_t d_inode;
     memset(&d_inode, 0, sizeof(inode_t));
     d_inode.type = type;
+    d_inode.flags = INODE_FLAG_EXTENTS;
     
-    /** Persist to disk: bitmap first, then the inode. */
-    if (!inode_bitmap_update(inumber)) {
-        warn("inode_alloc: failed to persist inode bitmap");
-        bitmap_clear(&inode_bitmap, inumber);
-        return NULL;
-    }
+    /** Persist to disk, as part of the running journal transaction. */
+    inode_bitmap_update(inumber);
 
-    if (!block_write((char *) &d_inode,
+    if (!block_write_journaled((char *) &d_inode,
                      DISK_ADDR_INODE(inumber),
                      sizeof(inode_t))) {
         warn("inode_alloc: failed to persist inode %u", inumber);
         bitmap_clear(&inode_bitmap, inumber);
-        inode_bitmap_update(inumber);   /** Ignores error. */
+        inode_bitmap_update(inumber);
+        return NULL;
+    }
+
+    /**
+     * The inode cache may still hold the freed inode of the same inumber,
+     * so refresh the in-memory copy with the new one.
+     */
+    mem_inode_t *m_inode = inode_get(inumber);
+    if (m_inode == NULL)
         return NULL;
+
+    inode_lock(m_inode);
+    memcpy(&(m_inode->d_inode), &d_inode, sizeof(inode_t));
+    _map_cache_clear(m_inode);
+    inode_unlock(m_inode);
+
+    return m_inode;
+}
+
+/**
+ * Free the NUM blocks at disk addresses ADDRS (0 entries are skipped),
+ * which are indirect blocks of given DEPTH (0 meaning data blocks), along
+ * with all blocks they point to, then clear the entries. Indirect blocks
+ * are fetched a chunk at a time in one batch. Freeing itself does no
+ * disk I/O, as freed blocks are only marked stale.
+ */
+#define FREE_CHUNK_BLOCKS 16
+
+static void
+_free_blocks(uint32_t *addrs, size_t num, uint8_t depth)
+{
+    if (depth > 0) {
+        for (size_t base = 0; base < num; base += FREE_CHUNK_BLOCKS) {
+            size_t end = base + FREE_CHUNK_BLOCKS;
+            if (end > num)
+                end = num;
+
+            uint32_t block_nos[FREE_CHUNK_BLOCKS];
+            block_request_t *bufs[FREE_CHUNK_BLOCKS];
+            size_t cnt = 0;
+            for (size_t idx = base; idx < end; ++idx) {
+                if (addrs[idx] != 0)
+                    block_nos[cnt++] = ADDR_BLOCK_NUMBER(addrs[idx]);
+            }
+            if (cnt == 0 || !block_get_many(block_nos, cnt, bufs))
+                continue;
+
+            for (size_t i = 0; i < cnt; ++i) {
+                _free_blocks((uint32_t *) bufs[i]->data, UINT32_PB, depth - 1);
+                block_put(bufs[i]);
+            }
+        }
     }
 
-    return inode_get(inumber);
+    block_free_many(addrs, num);
+    memset(addrs, 0, num * sizeof(uint32_t));
 }
 
 /**
  * Free an on-disk inode structure (removing a file). Avoids calling
  * `_walk_inode_index()` repeatedly.
- * Must be called with lock on M_INODE held.
+ * Must be called within a journal operation, with lock on M_INODE held.
  */
 void
 inode_free(mem_inode_t *m_inode)
 {
+    /** Cached pages must not show up when the inumber gets reused. */
+    if (m_inode->d_inode.type == INODE_TYPE_FILE)
+        pcache_invalidate(m_inode->inumber);
+
     m_inode->d_inode.size = 0;
     m_inode->d_inode.type = 0;
+    _map_cache_clear(m_inode);
 
-    /** Direct. */
-    for (size_t idx0 = 0; idx0 < NUM_DIRECT; ++idx0) {
-        if (m_inode->d_inode.data0[idx0] != 0) {
-            block_free(m_inode->d_inode.data0[idx0]);
-            m_inode->d_inode.data0[idx0] = 0;
-        }
-    }
-    
-    /** Singly-indirect. */
-    for (size_t idx0 = 0; idx0 < NUM_INDIRECT1; ++idx0) {
-        uint32_t ib1_addr = m_inode->d_inode.data1[idx0];
-        if (ib1_addr != 0) {
-            uint32_t ib1[UINT32_PB];
-            if (block_read((char *) ib1, ib1_addr, BLOCK_SIZE)) {
-                for (size_t idx1 = 0; idx1 < UINT32_PB; ++idx1) {
-                    if (ib1[idx1] != 0)
-                        block_free(ib1[idx1]);
-                }
-            }
-            block_free(ib1_addr);
-            m_inode->d_inode.data1[idx0] = 0;
-        }
-    }
+    if (m_inode->d_inode.flags & INODE_FLAG_EXTENTS) {
+        extent_free_all(m_inode);
+        m_inode->d_inode.flags = 0;
+        inode_flush(m_inode);
 
-    /** Doubly-indirect. */
-    for (size_t idx0 = 0; idx0 < NUM_INDIRECT2; ++idx0) {
-        uint32_t ib1_addr = m_inode->d_inode.data2[idx0];
-        if (ib1_addr != 0) {
-            uint32_t ib1[UINT32_PB];
-            if (block_read((char *) ib1, ib1_addr, BLOCK_SIZE)) {
-                for (size_t idx1 = 0; idx1 < UINT32_PB; ++idx1) {
-                    uint32_t ib2_addr = ib1[idx1];
-                    if (ib2_addr != 0) {
-                        uint32_t ib2[UINT32_PB];
-                        if (block_read((char *) ib2, ib2_addr, BLOCK_SIZE)) {
-                            for (size_t idx2 = 0; idx2 < UINT32_PB; ++idx2) {
-                                if (ib2[idx2] != 0)
-                                    block_free(ib2[idx2]);
-                            }
-                        }
-                        block_free(ib1[idx1]);
-                    }
-                }
-            }
-            block_free(ib1_addr);
-            m_inode->d_inode.data2[idx0] = 0;
-        }
+        bitmap_clear(&inode_bitmap, m_inode->inumber);
+        inode_bitmap_update(m_inode->inumber);
+        return;
     }
 
-    _flush_inode(m_inode);
+    /** Work on copies of the index arrays, as `d_inode` is packed. */
+    uint32_t data0[NUM_DIRECT], data1[NUM_INDIRECT1], data2[NUM_INDIRECT2];
+    memcpy(data0, m_inode->d_inode.data0, sizeof(data0));
+    memcpy(data1, m_inode->d_inode.data1, sizeof(data1));
+    memcpy(data2, m_inode->d_inode.data2, sizeof(data2));
+
+    memset(m_inode->d_inode.data0, 0, sizeof(data0));
+    memset(m_inode->d_inode.data1, 0, sizeof(data1));
+    memset(m_inode->d_inode.data2, 0, sizeof(data2));
+
+    inode_flush(m_inode);
+
+    _free_blocks(data0, NUM_DIRECT, 0);
+    _free_blocks(data1, NUM_INDIRECT1, 1);
+    _free_blocks(data2, NUM_INDIRECT2, 2);
 
     bitmap_clear(&inode_bitmap, m_inode->inumber);
-    inode_bitmap_update(m_inode->inumber);      /** Ignores error. */
+    inode_bitmap_update(m_inode->inumber);
 }
 
 
+/**
+ * Look up entry IDX in the indirect block at IB_ADDR through the buffer
+ * cache. If ALLOC, allocates the pointed-to block if was not allocated
+ * (at or after HINT_ADDR if possible), logging the updated indirect block
+ * in the journal. If RUN is not NULL, stores into it the run of entries
+ * around IDX pointing to consecutive blocks, with LSTART relative to the
+ * indirect block (LEN 0 if none). Returns address 0 on failures or if
+ * not allocated.
+ */
+static uint32_t
+_walk_indirect_block(uint32_t ib_addr, size_t idx, bool alloc,
+                     uint32_t hint_addr, extent_t *run)
+{
+    block_request_t *ib_buf = block_get(ADDR_BLOCK_NUMBER(ib_addr));
+    if (ib_buf == NULL)
+        return 0;
+    uint32_t *ib = (uint32_t *) ib_buf->data;
+
+    uint32_t addr = ib[idx];
+    if (addr != 0 && run != NULL) {
+        size_t first = idx, last = idx;
+        while (first > 0 && ib[first - 1] != 0
+               && ib[first - 1] + BLOCK_SIZE == ib[first]) {
+            first--;
+        }
+        while (last + 1 < UINT32_PB && ib[last + 1] == ib[last] + BLOCK_SIZE)
+            last++;
+        run->lstart = first;
+        run->pstart = ADDR_BLOCK_NUMBER(ib[first]);
+        run->len = last - first + 1;
+    }
+    if (addr == 0 && alloc) {
+        addr = block_alloc_run(1, hint_addr);
+        if (addr != 0) {
+            ib[idx] = addr;
+            journal_write(ib_buf);
+        }
+    }
+
+    block_put(ib_buf);
+    return addr;
+}
+
 /**
  * Walk the indexing array to get block number for the n-th block.
- * Allocates the block if was not allocated. Returns address 0
- * (which is invalid for a data block) on failures.
+ * If ALLOC, allocates the block (and indirect blocks on the way) if was
+ * not allocated, at or after HINT_ADDR if possible. If RUN is not NULL,
+ * stores into it the run of consecutive blocks around the n-th one found
+ * in its indirect block, if any (LEN 0 otherwise). Returns address 0
+ * (which is invalid for a data block) on failures or if not allocated.
  */
 static uint32_t
-_walk_inode_index(mem_inode_t *m_inode, uint32_t idx)
+_walk_inode_index_hinted(mem_inode_t *m_inode, uint32_t idx, bool alloc,
+                         uint32_t hint_addr, extent_t *run)
 {
+    if (run != NULL)
+        run->len = 0;
+
     /** Direct. */
     if (idx < NUM_DIRECT) {
-        if (m_inode->d_inode.data0[idx] == 0)
-            m_inode->d_inode.data0[idx] = block_alloc();
+        if (m_inode->d_inode.data0[idx] == 0 && alloc)
+            m_inode->d_inode.data0[idx] = block_alloc_run(1, hint_addr);
         return m_inode->d_inode.data0[idx];
     }
     
@@ -308,25 +698,20 @@ _walk_inode_index(mem_inode_t *m_inode, uint32_t idx)
         /** Load indirect1 block. */
         uint32_t ib1_addr = m_inode->d_inode.data1[idx0];
         if (ib1_addr == 0) {
-            ib1_addr = block_alloc();
+            if (!alloc)
+                return 0;
+            ib1_addr = block_alloc_run(1, hint_addr);
             if (ib1_addr == 0)
                 return 0;
             m_inode->d_inode.data1[idx0] = ib1_addr;
         }
-        uint32_t ib1[UINT32_PB];
-        if (!block_read((char *) ib1, ib1_addr, BLOCK_SIZE))
-            return 0;
 
         /** Index in the indirect1 block. */
-        if (ib1[idx1] == 0) {
-            ib1[idx1] = block_alloc();
-            if (ib1[idx1] == 0)
-                return 0;
-            if (!block_write((char *) ib1, ib1_addr, BLOCK_SIZE))
-                return 0;
-        }
-
-        return ib1[idx1];
+        uint32_t addr = _walk_indirect_block(ib1_addr, idx1, alloc,
+                                             hint_addr, run);
+        if (run != NULL)
+            run->lstart += NUM_DIRECT + idx0 * UINT32_PB;
+        return addr;
     }
 
     /** Doubly indirect. */
@@ -339,52 +724,124 @@ _walk_inode_index(mem_inode_t *m_inode, uint32_t idx)
         /** Load indirect1 block. */
         uint32_t ib1_addr = m_inode->d_inode.data2[idx0];
         if (ib1_addr == 0) {
-            ib1_addr = block_alloc();
+            if (!alloc)
+                return 0;
+            ib1_addr = block_alloc_run(1, hint_addr);
             if (ib1_addr == 0)
                 return 0;
             m_inode->d_inode.data2[idx0] = ib1_addr;
         }
-        uint32_t ib1[UINT32_PB];
-        if (!block_read((char *) ib1, ib1_addr, BLOCK_SIZE))
-            return 0;
 
         /** Load indirect2 block. */
-        uint32_t ib2_addr = ib1[idx1];
-        if (ib2_addr == 0) {
-            ib2_addr = block_alloc();
-            if (ib2_addr == 0)
-                return 0;
-            ib1[idx1] = ib2_addr;
-            if (!block_write((char *) ib1, ib1_addr, BLOCK_SIZE))
-                return 0;
-        }
-        uint32_t ib2[UINT32_PB];
-        if (!block_read((char *) ib2, ib2_addr, BLOCK_SIZE))
+        uint32_t ib2_addr = _walk_indirect_block(ib1_addr, idx1, alloc,
+                                                 hint_addr, NULL);
+        if (ib2_addr == 0)
             return 0;
 
         /** Index in the indirect2 block. */
-        if (ib2[idx2] == 0) {
-            ib2[idx2] = block_alloc();
-            if (ib2[idx2] == 0)
-                return 0;
-            if (!block_write((char *) ib2, ib2_addr, BLOCK_SIZE))
-                return 0;
+        uint32_t addr = _walk_indirect_block(ib2_addr, idx2, alloc,
+                                             hint_addr, run);
+        if (run != NULL) {
+            run->lstart += NUM_DIRECT + NUM_INDIRECT1 * UINT32_PB
+                           + idx0 * UINT32_PB*UINT32_PB + idx1 * UINT32_PB;
         }
-
-        return ib2[idx2];
+        return addr;
     }
 
     warn("walk_inode_index: index %u is out of range", idx);
     return 0;
 }
 
+/**
+ * Walk the indexing array to get block number for the n-th block. If
+ * ALLOC, allocates the block if was not allocated, right after where the
+ * previous logical block sits if possible (or in the inode's own block
+ * group for the first one), so that files are laid out contiguously
+ * close to their inode and sequential transfers merge into multi-block
+ * requests. Inodes with INODE_FLAG_EXTENTS go through their extent tree.
+ * Lookups go through the inode's translation cache first, and fill it
+ * with the run found on a miss. Returns address 0 on failures or if not
+ * allocated.
+ */
+static uint32_t
+_walk_inode_index(mem_inode_t *m_inode, uint32_t idx, bool alloc)
+{
+    uint32_t addr = _map_cache_lookup(m_inode, idx);
+    if (addr != 0)
+        return addr;
+
+    bool extents = m_inode->d_inode.flags & INODE_FLAG_EXTENTS;
+    extent_t run;
+    run.len = 0;
+    addr = extents ? extent_lookup(m_inode, idx, &run)
+                   : _walk_inode_index_hinted(m_inode, idx, false, 0, &run);
+    if (addr != 0) {
+        _map_cache_insert(m_inode, &run);
+        return addr;
+    }
+    if (!alloc)
+        return 0;
+
+    /** The mapping is about to change. */
+    _map_cache_clear(m_inode);
+
+    uint32_t hint_addr = GROUP_DATA_START(INODE_GROUP(m_inode->inumber))
+                         * BLOCK_SIZE;
+    if (extents)
+        return extent_append(m_inode, idx, hint_addr);
+
+    if (idx > 0) {
+        uint32_t prev_addr = _walk_inode_index_hinted(m_inode, idx - 1,
+                                                      false, 0, NULL);
+        if (prev_addr != 0)
+            hint_addr = prev_addr + BLOCK_SIZE;
+    }
+
+    return _walk_inode_index_hinted(m_inode, idx, true, hint_addr, NULL);
+}
+
+/**
+ * Extend a transfer starting at logical offset START_OFFSET, which maps
+ * to disk address BLOCK_ADDR and covers EFFECTIVE bytes of its block,
+ * over the following logical blocks as long as they sit right after it
+ * on disk. Returns the number of bytes of the contiguous run, at most
+ * BYTES_LEFT, so that the block layer can move it in one disk request.
+ * Following blocks not yet allocated are allocated only if ALLOC, which
+ * must be within a journal operation.
+ */
+static uint32_t
+_inode_block_run(mem_inode_t *m_inode, uint32_t start_offset,
+                 uint32_t block_addr, uint32_t effective, uint32_t bytes_left,
+                 bool alloc)
+{
+    uint32_t index = start_offset / BLOCK_SIZE;
+    uint32_t num_blocks = 1;
+
+    while (effective < bytes_left && num_blocks < BLOCK_MAX_RUN) {
+        uint32_t next_addr = _walk_inode_index(m_inode, index + num_blocks,
+                                               alloc);
+        if (next_addr != block_addr + num_blocks * BLOCK_SIZE)
+            break;
+
+        uint32_t chunk = bytes_left - effective;
+        if (chunk > BLOCK_SIZE)
+            chunk = BLOCK_SIZE;
+        effective += chunk;
+        num_blocks++;
+    }
+
+    return effective;
+}
+
 /**
  * Read data at logical offset from inode. Returns the number of bytes
- * actually read.
+ * actually read. If BATCH is not NULL, reads going directly into DST are
+ * submitted to it without waiting.
  * Must with lock on M_INODE held.
  */
-size_t
-inode_read(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len)
+static size_t
+_inode_read_helper(mem_inode_t *m_inode, char *dst, uint32_t offset,
+                   size_t len, block_batch_t *batch)
 {
     if (offset > m_inode->d_inode.size)
         return 0;
@@ -403,13 +860,16 @@ inode_read(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len)
         if (bytes_left < effective)
             effective = bytes_left;
 
-        uint32_t block_addr = _walk_inode_index(m_inode, start_offset / BLOCK_SIZE);
+        uint32_t block_addr = _walk_inode_index(m_inode, start_offset / BLOCK_SIZE, false);
         if (block_addr == 0) {
             warn("inode_read: failed to walk inode index on offset %u", start_offset);
             return bytes_read;
         }
+        effective = _inode_block_run(m_inode, start_offset, block_addr,
+                                     effective, bytes_left, false);
 
-        if (!block_read(dst + bytes_read, block_addr + req_offset, effective)) {
+        if (!block_read_async(dst + bytes_read, block_addr + req_offset,
+                              effective, batch)) {
             warn("inode_read: failed to read disk address %p", block_addr);
             return bytes_read;
         }
@@ -420,11 +880,360 @@ inode_read(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len)
     return bytes_read;
 }
 
+/**
+ * Read data at logical offset from a regular file through the page
+ * cache, copying out of cached pages. Missing pages are filled from disk
+ * up to PCACHE_FILL_PAGES at a time in one batch. A piece for which no
+ * page can be spared is read directly. Returns the number of bytes
+ * actually read.
+ * Must with lock on M_INODE held.
+ */
+static size_t
+_inode_read_cached(mem_inode_t *m_inode, char *dst, uint32_t offset,
+                   size_t len)
+{
+    uint32_t size = m_inode->d_inode.size;
+    if (offset > size)
+        return 0;
+    if (offset + len > size)
+        len = size - offset;
+
+    uint32_t bytes_read = 0;
+    while (len > bytes_read) {
+        uint32_t first = (offset + bytes_read) / PAGE_SIZE;
+        uint32_t last = (offset + len - 1) / PAGE_SIZE;
+        if (last - first >= PCACHE_FILL_PAGES)
+            last = first + PCACHE_FILL_PAGES - 1;
+
+        pcache_page_t *pages[PCACHE_FILL_PAGES];
+        uint32_t num = 0;
+        bool ok = true;
+        block_batch_t batch;
+        block_batch_init(&batch);
+
+        while (first + num <= last) {
+            pcache_page_t *page = pcache_get(m_inode->inumber, first + num,
+                                             true);
+            if (page == NULL)
+                break;
+            pages[num++] = page;
+
+            if (!page->valid) {
+                uint32_t page_offset = page->index * PAGE_SIZE;
+                uint32_t fill_len = size - page_offset;
+                if (fill_len > PAGE_SIZE)
+                    fill_len = PAGE_SIZE;
+
+                memset(PCACHE_PAGE_DATA(page), 0, PAGE_SIZE);
+                if (_inode_read_helper(m_inode, PCACHE_PAGE_DATA(page),
+                                       page_offset, fill_len, &batch)
+                    != fill_len) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        if (!block_batch_wait(&batch))
+            ok = false;
+
+        /** No page to spare, read up to the page end directly. */
+        if (num == 0) {
+            uint32_t effective = PAGE_SIZE - (offset + bytes_read) % PAGE_SIZE;
+            if (effective > len - bytes_read)
+                effective = len - bytes_read;
+            uint32_t piece = _inode_read_helper(m_inode, dst + bytes_read,
+                                                offset + bytes_read,
+                                                effective, NULL);
+            bytes_read += piece;
+            if (piece < effective)
+                return bytes_read;
+            continue;
+        }
+
+        for (size_t i = 0; i < num; ++i) {
+            pcache_page_t *page = pages[i];
+            if (!ok) {
+                if (page->valid)
+                    pcache_put(page);
+                else
+                    pcache_drop(page);
+                continue;
+            }
+            page->valid = true;
+
+            uint32_t in_page = offset + bytes_read - page->index * PAGE_SIZE;
+            uint32_t effective = PAGE_SIZE - in_page;
+            if (effective > len - bytes_read)
+                effective = len - bytes_read;
+            memcpy(dst + bytes_read, PCACHE_PAGE_DATA(page) + in_page,
+                   effective);
+            bytes_read += effective;
+
+            pcache_put(page);
+        }
+        if (!ok) {
+            warn("inode_read: failed to fill pages of inode %u from %u",
+                 m_inode->inumber, first);
+            return bytes_read;
+        }
+    }
+
+    return bytes_read;
+}
+
+/**
+ * Update the cached pages of a regular file for LEN bytes just written
+ * at OFFSET from SRC. A page not cached is set up only if the write
+ * covers all of its bytes within the file size, so that it needs no
+ * read to fill in the rest.
+ * Must with lock on M_INODE held.
+ */
+static void
+_inode_write_cached(mem_inode_t *m_inode, char *src, uint32_t offset,
+                    size_t len)
+{
+    uint32_t size = m_inode->d_inode.size;
+    uint32_t end = offset + len;
+
+    for (uint32_t idx = offset / PAGE_SIZE;
+         len > 0 && idx <= (end - 1) / PAGE_SIZE; ++idx) {
+        uint32_t page_offset = idx * PAGE_SIZE;
+        uint32_t page_end = page_offset + PAGE_SIZE;
+        if (page_end > size)
+            page_end = size;
+
+        uint32_t lo = offset > page_offset ? offset : page_offset;
+        uint32_t hi = end < page_end ? end : page_end;
+        bool whole = lo == page_offset && hi == page_end;
+
+        pcache_page_t *page = pcache_get(m_inode->inumber, idx, whole);
+        if (page == NULL)
+            continue;
+        if (!page->valid) {
+            memset(PCACHE_PAGE_DATA(page), 0, PAGE_SIZE);
+            page->valid = true;
+        }
+
+        /** Writing back a page mapped by `mmap()` from the page itself. */
+        char *dst = PCACHE_PAGE_DATA(page) + (lo - page_offset);
+        if (dst != src + (lo - offset))
+            memcpy(dst, src + (lo - offset), hi - lo);
+        pcache_put(page);
+    }
+}
+
+/**
+ * Get the cached page INDEX of a regular file, filling it from disk if
+ * not cached, e.g. to map it into an address space. The page must start
+ * within the file size. Returns the referenced page, to be put back by
+ * `pcache_put()`, or NULL on failures.
+ * Must with lock on M_INODE held.
+ */
+pcache_page_t *
+inode_page_get(mem_inode_t *m_inode, uint32_t index)
+{
+    assert(m_inode->d_inode.type == INODE_TYPE_FILE);
+    uint32_t page_offset = index * PAGE_SIZE;
+    if (page_offset >= m_inode->d_inode.size)
+        return NULL;
+
+    pcache_page_t *page = pcache_get(m_inode->inumber, index, true);
+    if (page == NULL || page->valid)
+        return page;
+
+    uint32_t fill_len = m_inode->d_inode.size - page_offset;
+    if (fill_len > PAGE_SIZE)
+        fill_len = PAGE_SIZE;
+
+    memset(PCACHE_PAGE_DATA(page), 0, PAGE_SIZE);
+    if (_inode_read_helper(m_inode, PCACHE_PAGE_DATA(page), page_offset,
+                           fill_len, NULL) != fill_len) {
+        warn("inode_page_get: failed to fill page %u of inode %u",
+             index, m_inode->inumber);
+        pcache_drop(page);
+        return NULL;
+    }
+    page->valid = true;
+    return page;
+}
+
+/**
+ * Read data at logical offset from inode, waiting for it. Regular file
+ * data goes through the page cache.
+ */
+size_t
+inode_read(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len)
+{
+    if (m_inode->d_inode.type == INODE_TYPE_FILE)
+        return _inode_read_cached(m_inode, dst, offset, len);
+    return _inode_read_helper(m_inode, dst, offset, len, NULL);
+}
+
+/**
+ * Read data at logical offset from inode, submitting disk reads that go
+ * directly into DST to BATCH. The returned count is what has been issued;
+ * DST is only filled after the batch has been waited for. Regular file
+ * data is copied out of the page cache right away instead.
+ */
+size_t
+inode_read_async(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len,
+                 block_batch_t *batch)
+{
+    if (m_inode->d_inode.type == INODE_TYPE_FILE)
+        return _inode_read_cached(m_inode, dst, offset, len);
+    return _inode_read_helper(m_inode, dst, offset, len, batch);
+}
+
+/**
+ * Get the locked buffer of logical block IDX of an inode, which must lie
+ * within its size, to work on it in place. Modifications must be logged
+ * in the journal by the caller. Returns NULL on failures.
+ * Must be called with lock on M_INODE held.
+ */
+block_request_t *
+inode_block_get(mem_inode_t *m_inode, uint32_t idx)
+{
+    if (idx >= (m_inode->d_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+        warn("inode_block_get: block %u beyond end of inode %u",
+             idx, m_inode->inumber);
+        return NULL;
+    }
+
+    uint32_t block_addr = _walk_inode_index(m_inode, idx, false);
+    if (block_addr == 0)
+        return NULL;
+    return block_get(ADDR_BLOCK_NUMBER(block_addr));
+}
+
+
+/**
+ * Prefetch the inode blocks of entries in directory block IDX that are
+ * not in the icache yet, so that opening or stat'ing them one by one,
+ * e.g. by `ls`, finds their inodes in the buffer cache.
+ * Must be called with lock on M_INODE held, and not with the buffer of
+ * that directory block.
+ */
+void
+inode_dir_prefetch(mem_inode_t *m_inode, uint32_t idx)
+{
+    uint32_t block_nos[DENTRIES_PB];
+    size_t num = 0;
+
+    block_request_t *buf = inode_block_get(m_inode, idx);
+    if (buf == NULL)
+        return;
+
+    dentry_t *dentries = (dentry_t *) buf->data;
+    for (size_t i = 0; i < DENTRIES_PB; ++i) {
+        uint32_t inumber = dentries[i].inumber;
+        if (dentries[i].valid != 1 || inumber >= inode_bitmap.slots)
+            continue;
+
+        spinlock_acquire(&icache_lock);
+        bool cached = _icache_hash_lookup(inumber) != NULL;
+        spinlock_release(&icache_lock);
+        if (cached)
+            continue;
+
+        uint32_t block_no = ADDR_BLOCK_NUMBER(DISK_ADDR_INODE(inumber));
+        if (num == 0 || block_nos[num - 1] != block_no)
+            block_nos[num++] = block_no;
+    }
+
+    block_put(buf);
+
+    for (size_t i = 0; i < num; ++i)
+        block_prefetch(block_nos[i]);
+}
+
+/** Reset readahead state, as for a newly opened file. */
+void
+readahead_init(readahead_t *ra)
+{
+    ra->next_offset = 0;
+    ra->window = 0;
+    ra->ahead = 0;
+}
+
+/**
+ * Update readahead state RA for a coming read of LEN bytes at OFFSET, and
+ * prefetch upcoming blocks into the buffer cache if access is sequential.
+ * Only blocks already allocated within the file size are prefetched, and
+ * not those of file data in the page cache. A directory read sequentially
+ * also gets the inodes of its entries prefetched, block by block as the
+ * reads enter them.
+ * Must with lock on M_INODE held.
+ */
+void
+inode_readahead(mem_inode_t *m_inode, readahead_t *ra, uint32_t offset,
+                size_t len)
+{
+    uint32_t size = m_inode->d_inode.size;
+    if (offset >= size || len == 0)
+        return;
+    if (offset + len > size)
+        len = size - offset;
+
+    uint32_t last_block = (offset + len - 1) / BLOCK_SIZE;
+    uint32_t file_blocks = ADDR_BLOCK_ROUND_UP(size) / BLOCK_SIZE;
+
+    if (offset != ra->next_offset) {
+        /** Random access, shrink window and forget what's ahead. */
+        ra->window /= 2;
+        if (ra->window < READAHEAD_MIN_BLOCKS)
+            ra->window = 0;
+        ra->ahead = 0;
+        ra->next_offset = offset + len;
+        return;
+    }
+    ra->next_offset = offset + len;
+
+    /** Listing a directory, prefetch inodes of entries about to be read. */
+    if (m_inode->d_inode.type == INODE_TYPE_DIR) {
+        for (uint32_t idx = ADDR_BLOCK_ROUND_UP(offset) / BLOCK_SIZE;
+             idx <= last_block; ++idx) {
+            inode_dir_prefetch(m_inode, idx);
+        }
+    }
+
+    /** Not yet close enough to the end of prefetched range. */
+    if (ra->window > 0 && last_block + ra->window / 2 < ra->ahead)
+        return;
+
+    /** Sequential hit, grow window and prefetch. */
+    if (ra->window == 0)
+        ra->window = READAHEAD_MIN_BLOCKS;
+    else if (ra->window < READAHEAD_MAX_BLOCKS)
+        ra->window *= 2;
+
+    uint32_t start = last_block + 1;
+    if (ra->ahead > start)
+        start = ra->ahead;
+    uint32_t end = last_block + 1 + ra->window;
+    if (end > file_blocks)
+        end = file_blocks;
+
+    bool file = m_inode->d_inode.type == INODE_TYPE_FILE;
+    for (uint32_t idx = start; idx < end; ++idx) {
+        if (file && pcache_cached(m_inode->inumber,
+                                  idx * BLOCK_SIZE / PAGE_SIZE)) {
+            continue;
+        }
+        uint32_t block_addr = _walk_inode_index(m_inode, idx, false);
+        if (block_addr != 0)
+            block_prefetch(ADDR_BLOCK_NUMBER(block_addr));
+    }
+    if (end > ra->ahead)
+        ra->ahead = end;
+}
+
+
 /**
  * Write data at logical offset of inode. Returns the number of bytes
  * actually written. Will extend the inode if the write exceeds current
- * file size.
- * Must with lock on M_INODE held.
+ * file size. Directory content is metadata, so is logged in the journal.
+ * Regular file data goes to the buffer cache and to the pages cached.
+ * Must be called within a journal operation, with lock on M_INODE held.
  */
 size_t
 inode_write(mem_inode_t *m_inode, char *src, uint32_t offset, size_t len)
@@ -444,26 +1253,40 @@ inode_write(mem_inode_t *m_inode, char *src, uint32_t offset, size_t len)
         if (bytes_left < effective)
             effective = bytes_left;
 
-        uint32_t block_addr = _walk_inode_index(m_inode, start_offset / BLOCK_SIZE);
+        uint32_t block_addr = _walk_inode_index(m_inode, start_offset / BLOCK_SIZE, true);
         if (block_addr == 0) {
             warn("inode_write: failed to walk inode index on offset %u", start_offset);
-            return bytes_written;
+            break;
         }
-
-        if (!block_write(src + bytes_written, block_addr + req_offset, effective)) {
+        effective = _inode_block_run(m_inode, start_offset, block_addr,
+                                     effective, bytes_left, true);
+
+        bool ok = m_inode->d_inode.type == INODE_TYPE_DIR
+                  ? block_write_journaled(src + bytes_written,
+                                          block_addr + req_offset, effective)
+                  : block_write(src + bytes_written,
+                                block_addr + req_offset, effective);
+        if (!ok) {
             warn("inode_write: failed to write block address %p", block_addr);
-            return bytes_written;
+            break;
         }
 
         bytes_written += effective;
     }
 
-    /** Update inode size if extended. */
-    if (offset + len > m_inode->d_inode.size) {
+    /**
+     * Update inode size if extended, written back at commit. After a
+     * failure, only what got written within the old size stays.
+     */
+    if (bytes_written == len && offset + len > m_inode->d_inode.size) {
         m_inode->d_inode.size = offset + len;
-        _flush_inode(m_inode);
+        inode_mark_dirty(m_inode);
     }
 
+    /** Keep cached pages of file data up to date, even after a failure. */
+    if (m_inode->d_inode.type == INODE_TYPE_FILE)
+        _inode_write_cached(m_inode, src, offset, bytes_written);
+
     return bytes_written;
 }
 
@@ -524,15 +1347,22 @@ file_put(file_t *file)
 }
 
 
-/** Get metadata information of a file. */
+/** Get metadata information of an inode. */
 void
-file_stat(file_t *file, file_stat_t *stat)
+inode_stat(mem_inode_t *m_inode, file_stat_t *stat)
 {
-    inode_lock(file->inode);
+    inode_lock(m_inode);
 
-    stat->inumber = file->inode->inumber;
-    stat->type = file->inode->d_inode.type;
-    stat->size = file->inode->d_inode.size;
+    stat->inumber = m_inode->inumber;
+    stat->type = m_inode->d_inode.type;
+    stat->size = m_inode->d_inode.size;
+
+    inode_unlock(m_inode);
+}
 
-    inode_unlock(file->inode);
+/** Get metadata information of a file. */
+void
+file_stat(file_t *file, file_stat_t *stat)
+{
+    inode_stat(file->inode, stat);
 }
@@ -12,23 +12,68 @@
 #include <stddef.h>
 
 #include "vsfs.h"
+#include "block.h"
 #include "sysfile.h"
+#include "pcache.h"
 
 #include "../common/spinlock.h"
 #include "../common/parklock.h"
 
 
-/** In-memory copy of open inode, be sure struct size <= 128 bytes. */
+/**
+ * Each in-memory inode caches a few recently used translations of its
+ * logical blocks, as runs mapped onto consecutive disk blocks, so that
+ * lookups into large files need not walk indirect blocks or extent nodes
+ * again. Entries are replaced round-robin, and all are dropped whenever
+ * the block mapping changes. Protected by the inode lock.
+ */
+#define INODE_MAP_CACHE 4
+
+/** In-memory copy of an inode. */
 struct mem_inode {
     uint8_t ref_cnt;    /** Reference count (from file handles). */
     uint32_t inumber;   /** Inode number identifier of `d_inode`. */
+    bool cached;        /** Holds inode INUMBER, in the hash table. */
+    bool dirty;         /** Modified, to be written back at commit. */
     parklock_t lock;    /** Parking lock held when waiting for disk I/O. */
     inode_t d_inode;    /** Read in on-disk inode structure. */
+    extent_t map_cache[INODE_MAP_CACHE];    /** Cached translations. */
+    uint8_t map_next;                       /** Next entry to replace. */
+    struct mem_inode *hash_next;    /** Next in hash chain. */
+    struct mem_inode *lru_prev;     /** Towards most recently unused. */
+    struct mem_inode *lru_next;     /** Towards least recently unused. */
 };
 typedef struct mem_inode mem_inode_t;
 
-/** Maximum number of in-memory cached inodes. */
-#define MAX_MEM_INODES 100
+/**
+ * Number of in-memory inodes, allocated from the kernel heap at boot.
+ * An inode stays cached after its last reference is put, on an LRU list
+ * of unused ones, until its slot is taken for another inode (dirty ones
+ * are never taken). Lookups go through a small hash table keyed by
+ * inumber.
+ */
+#define ICACHE_SIZE 256
+
+#define ICACHE_HASH_SIZE 64
+#define ICACHE_HASH(inumber) ((inumber) % ICACHE_HASH_SIZE)
+
+
+/**
+ * Sequential readahead state. A read starting where the last one ended is
+ * sequential: once it gets within half a window of the prefetched range,
+ * the next WINDOW blocks are prefetched into the buffer cache, and the
+ * window doubles. A non-sequential read halves the window, turning
+ * readahead off below the minimum. Block indices are logical.
+ */
+struct readahead {
+    uint32_t next_offset;   /** Where a sequential read would start. */
+    uint32_t window;        /** Current window size in blocks. */
+    uint32_t ahead;         /** Blocks before this have been prefetched. */
+};
+typedef struct readahead readahead_t;
+
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
 
 
 /** Open file handle structure. */
@@ -38,6 +83,7 @@ struct file {
     bool writable;          /** Open as writable? */
     mem_inode_t *inode;     /** Inode structure of the file. */
     uint32_t offset;        /** Current file offset in bytes. */
+    readahead_t ra;         /** Readahead state. */
 };
 typedef struct file file_t;
 
@@ -49,13 +95,12 @@ typedef struct file file_t;
 
 
 /** Extern the tables to `vsfs.c`. */
-extern mem_inode_t icache[];
-extern spinlock_t icache_lock;
-
 extern file_t ftable[];
 extern spinlock_t ftable_lock;
 
 
+void inode_cache_init(uint32_t num_inodes);
+
 void inode_lock(mem_inode_t *m_inode);
 void inode_unlock(mem_inode_t *m_inode);
 
@@ -63,17 +108,30 @@ mem_inode_t *inode_get(uint32_t inumber);
 mem_inode_t *inode_get_at_boot(uint32_t inumber);
 void inode_ref(mem_inode_t *m_inode);
 void inode_put(mem_inode_t *m_inode);
+bool inode_flush(mem_inode_t *m_inode);
+void inode_mark_dirty(mem_inode_t *m_inode);
+uint32_t inode_writeback(void);
 
-mem_inode_t *inode_alloc(uint32_t type);
+mem_inode_t *inode_alloc(uint32_t type, uint32_t parent);
 void inode_free(mem_inode_t *m_inode);
 
 size_t inode_read(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len);
+size_t inode_read_async(mem_inode_t *m_inode, char *dst, uint32_t offset, size_t len,
+                        block_batch_t *batch);
 size_t inode_write(mem_inode_t *m_inode, char *src, uint32_t offset, size_t len);
+block_request_t *inode_block_get(mem_inode_t *m_inode, uint32_t idx);
+pcache_page_t *inode_page_get(mem_inode_t *m_inode, uint32_t index);
+
+void inode_readahead(mem_inode_t *m_inode, readahead_t *ra, uint32_t offset,
+                     size_t len);
+void readahead_init(readahead_t *ra);
+void inode_dir_prefetch(mem_inode_t *m_inode, uint32_t idx);
 
 file_t *file_get();
 void file_ref(file_t *file);
 void file_put(file_t *file);
 
+void inode_stat(mem_inode_t *m_inode, file_stat_t *stat);
 void file_stat(file_t *file, file_stat_t *stat);
 
 
@@ -0,0 +1,400 @@
+/**
+ * Write-ahead metadata journal of VSFS, with group commit.
+ *
+ * Follows the logging layer of xv6: every file system operation that
+ * modifies metadata (bitmaps, inodes, directory and indirect blocks) is
+ * wrapped in `journal_begin()` & `journal_end()`, and logs the buffers it
+ * modifies through `journal_write()` instead of marking them dirty. File
+ * data blocks do not go through the journal.
+ *
+ * Unlike xv6, ending an operation does not commit. Operations keep
+ * joining the running transaction, which is committed by the flusher
+ * thread, by `sync()`/`fsync()`, or when its log space runs short. So a
+ * commit usually covers many operations, and turns their scattered
+ * metadata writes into one sequential log append:
+ *   1. write back or zero out newly allocated data blocks;
+ *   2. write all logged blocks into the journal region in one run;
+ *   3. write the header, which is the commit point;
+ *   4. install the logged blocks to their home locations;
+ *   5. clear the header.
+ * Recovery at mount replays a committed header's blocks.
+ *
+ * Inodes updated over and over, e.g., the size of a file being appended
+ * to, are only marked dirty by operations, and are written back into the
+ * transaction right before it commits, a whole inode block at a time.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "journal.h"
+#include "block.h"
+#include "vsfs.h"
+#include "file.h"
+
+#include "../common/debug.h"
+#include "../common/string.h"
+#include "../common/spinlock.h"
+
+#include "../process/process.h"
+#include "../process/scheduler.h"
+
+
+/**
+ * State of the running transaction. OUTSTANDING is the number of
+ * operations in progress, COMMIT_WANTED the number of processes waiting
+ * to commit explicitly (which holds off new operations). NUM_DEFERRED
+ * is the log space reserved for dirty inodes written back at commit.
+ */
+static struct {
+    uint32_t outstanding;
+    uint32_t commit_wanted;
+    bool committing;
+    uint32_t num_logged;
+    uint32_t num_deferred;
+    block_request_t *logged[JOURNAL_TXN_MAX_BLOCKS];
+} journal;
+
+static spinlock_t journal_lock;
+
+/** In-memory header & list of block sources, used only when committing. */
+static journal_header_t header __attribute__((aligned(4)));
+static uint8_t *log_srcs[JOURNAL_LOG_MAX];
+
+
+/**
+ * Block until woken up by a change of journal state.
+ * Must be called with `journal_lock` held.
+ */
+static void
+_journal_wait(void)
+{
+    spinlock_acquire(&ptable_lock);
+    spinlock_release(&journal_lock);
+
+    process_block(ON_JOURNAL);
+
+    spinlock_release(&ptable_lock);
+    spinlock_acquire(&journal_lock);
+}
+
+/** Wake up all processes waiting on the journal. */
+static void
+_journal_wake(void)
+{
+    spinlock_acquire(&ptable_lock);
+    for (process_t *proc = ptable; proc < &ptable[MAX_PROCS]; ++proc) {
+        if (proc->state == BLOCKED && proc->block_on == ON_JOURNAL)
+            process_unblock(proc);
+    }
+    spinlock_release(&ptable_lock);
+}
+
+
+/**
+ * Install NUM blocks sitting in memory at LOG_SRCS to the home locations
+ * recorded in the header, merging adjacent ones, submitting to BATCH.
+ */
+static void
+_journal_install_direct(uint32_t first, uint32_t num, block_batch_t *batch)
+{
+    uint32_t i = first;
+    while (i < first + num) {
+        uint32_t run = 1;
+        while (i + run < first + num
+               && header.block_nos[i + run] == header.block_nos[i] + run) {
+            run++;
+        }
+        block_write_direct(&log_srcs[i], header.block_nos[i], run, batch);
+        i += run;
+    }
+}
+
+/**
+ * Install the NUM_LOGGED logged buffers, which must be locked, and the
+ * NUM_BITMAP bitmap blocks following them in the header to their home
+ * locations. Once the header has landed, the journal region must not be
+ * reused until it is cleared, so failed installs are retried a few times
+ * before giving up with a panic, as recovery at mount would do.
+ */
+#define JOURNAL_INSTALL_TRIES 3
+
+static void
+_journal_install(uint32_t num_logged, uint32_t num_bitmap)
+{
+    for (uint32_t tries = 0; tries < JOURNAL_INSTALL_TRIES; ++tries) {
+        block_batch_t batch;
+        block_batch_init(&batch);
+        _journal_install_direct(num_logged, num_bitmap, &batch);
+        if (block_sync_many(journal.logged, num_logged, &batch))
+            return;
+        warn("journal_commit: failed to install logged blocks, retrying");
+    }
+
+    error("journal_commit: failed to install logged blocks");
+}
+
+/**
+ * Commit the running transaction. No operation may be in progress, so
+ * logged buffers and bitmaps do not change underneath. Returns false on
+ * failures before the commit point, in which case the transaction is
+ * kept to be committed again later. Failures after it are fatal.
+ */
+static bool
+_journal_do_commit(void)
+{
+    uint32_t num_logged = journal.num_logged;
+    uint32_t num_bitmap = bitmaps_dirty_blocks(&header.block_nos[num_logged],
+                                               &log_srcs[num_logged],
+                                               JOURNAL_LOG_MAX - num_logged);
+    uint32_t num = num_logged + num_bitmap;
+    if (num == 0)
+        return true;
+
+    for (uint32_t i = 0; i < num_logged; ++i) {
+        header.block_nos[i] = journal.logged[i]->block_no;
+        log_srcs[i] = journal.logged[i]->data;
+    }
+
+    /** Blocks the transaction newly points to must hold their content. */
+    if (!block_flush_stale()) {
+        warn("journal_commit: failed to write back new blocks");
+        return false;
+    }
+
+    /** Write all logged blocks into the journal region in one run. */
+    block_batch_t batch;
+    block_batch_init(&batch);
+    block_write_direct(log_srcs, superblock.log_start + 1, num, &batch);
+    if (!block_batch_wait(&batch)) {
+        warn("journal_commit: failed to write log blocks");
+        return false;
+    }
+
+    /** Write the header, the transaction is committed once it lands. */
+    uint8_t *header_src = (uint8_t *) &header;
+    header.num_blocks = num;
+    block_batch_init(&batch);
+    block_write_direct(&header_src, superblock.log_start, 1, &batch);
+    if (!block_batch_wait(&batch)) {
+        warn("journal_commit: failed to write log header");
+        return false;
+    }
+
+    /**
+     * Install the logged blocks to their home locations. Bitmap blocks
+     * are written from memory, cached ones through their buffers.
+     */
+    for (uint32_t i = 0; i < num_logged; ++i) {
+        parklock_acquire(&(journal.logged[i]->lock));
+        journal.logged[i]->logged = false;
+    }
+    _journal_install(num_logged, num_bitmap);
+    for (uint32_t i = 0; i < num_logged; ++i) {
+        parklock_release(&(journal.logged[i]->lock));
+        block_unpin(journal.logged[i]);
+    }
+    journal.num_logged = 0;
+    bitmaps_clean();
+
+    /**
+     * Clear the header. The next commit would overwrite the log blocks
+     * it points to, so it must land first.
+     */
+    header.num_blocks = 0;
+    for (uint32_t tries = 0; tries < JOURNAL_INSTALL_TRIES; ++tries) {
+        block_batch_init(&batch);
+        block_write_direct(&header_src, superblock.log_start, 1, &batch);
+        if (block_batch_wait(&batch))
+            return true;
+        warn("journal_commit: failed to clear log header, retrying");
+    }
+
+    error("journal_commit: failed to clear log header");
+    return false;
+}
+
+/**
+ * Commit with `journal_lock` held, when no operation is in progress and
+ * no one else is committing. Releases the lock during the commit.
+ */
+static bool
+_journal_commit_locked(void)
+{
+    assert(journal.outstanding == 0 && !journal.committing);
+    journal.committing = true;
+    spinlock_release(&journal_lock);
+
+    /** Dirty inodes join the transaction into their reserved space. */
+    journal.num_deferred = inode_writeback();
+
+    bool success = _journal_do_commit();
+
+    spinlock_acquire(&journal_lock);
+    journal.committing = false;
+    _journal_wake();
+    return success;
+}
+
+
+/**
+ * Begin a file system operation. Waits if a commit is in progress or
+ * wanted, or if the running transaction might not have enough log space
+ * left for this operation, committing it if no one else can. Returns
+ * false if that commit failed, in which case the operation must not go
+ * on (and must not call `journal_end()`), rather than retrying forever.
+ * Must be called before locking any inode.
+ */
+bool
+journal_begin(void)
+{
+    spinlock_acquire(&journal_lock);
+
+    while (true) {
+        if (journal.committing || journal.commit_wanted > 0) {
+            _journal_wait();
+        } else if (journal.num_logged + journal.num_deferred
+                   + (journal.outstanding + 1) * JOURNAL_OP_MAX_BLOCKS
+                   > JOURNAL_TXN_MAX_BLOCKS) {
+            if (journal.outstanding > 0) {
+                _journal_wait();
+            } else if (!_journal_commit_locked()) {
+                warn("journal_begin: no log space, failed to commit");
+                spinlock_release(&journal_lock);
+                return false;
+            }
+        } else {
+            journal.outstanding++;
+            break;
+        }
+    }
+
+    spinlock_release(&journal_lock);
+    return true;
+}
+
+/**
+ * End a file system operation. Its updates stay in the running
+ * transaction until it is committed.
+ */
+void
+journal_end(void)
+{
+    spinlock_acquire(&journal_lock);
+
+    assert(journal.outstanding > 0);
+    journal.outstanding--;
+    if (journal.outstanding == 0)
+        _journal_wake();
+
+    spinlock_release(&journal_lock);
+}
+
+/**
+ * Log a modified buffer in the running transaction, instead of marking
+ * it dirty. The buffer gets pinned in the cache until commit.
+ * Must be called within an operation, or when writing back dirty inodes
+ * at commit, with the buffer locked.
+ */
+void
+journal_write(block_request_t *buf)
+{
+    assert(parklock_holding(&(buf->lock)));
+    buf->valid = true;
+
+    spinlock_acquire(&journal_lock);
+    assert(journal.outstanding > 0 || journal.committing);
+
+    if (!buf->logged) {
+        assert(journal.num_logged < JOURNAL_TXN_MAX_BLOCKS);
+        buf->logged = true;
+        journal.logged[journal.num_logged++] = buf;
+        block_pin(buf);
+    }
+
+    spinlock_release(&journal_lock);
+}
+
+/**
+ * Reserve log space in the running transaction for a block to be logged
+ * at commit, as a dirty inode is going to be written back then. Comes
+ * out of the calling operation's own reservation.
+ * Must be called within an operation.
+ */
+void
+journal_defer(void)
+{
+    spinlock_acquire(&journal_lock);
+    assert(journal.outstanding > 0);
+    journal.num_deferred++;
+    spinlock_release(&journal_lock);
+}
+
+/**
+ * Commit the running transaction, waiting for operations in progress to
+ * end. Returns false on failures.
+ */
+bool
+journal_commit(void)
+{
+    spinlock_acquire(&journal_lock);
+
+    journal.commit_wanted++;
+    while (journal.committing || journal.outstanding > 0)
+        _journal_wait();
+    bool success = _journal_commit_locked();
+    journal.commit_wanted--;
+
+    spinlock_release(&journal_lock);
+    return success;
+}
+
+
+/**
+ * Initialize the journal at mount, replaying a committed transaction
+ * left in the journal region if any. Must be called before the bitmaps
+ * are read in, as they might get updated.
+ */
+void
+journal_init(void)
+{
+    if (!block_read_at_boot((char *) &header, superblock.log_start * BLOCK_SIZE,
+                            BLOCK_SIZE)) {
+        error("journal_init: failed to read journal header");
+    }
+
+    if (header.num_blocks > 0) {
+        if (header.num_blocks > JOURNAL_LOG_MAX
+            || header.num_blocks >= superblock.log_blocks) {
+            error("journal_init: corrupted journal header");
+        }
+
+        uint8_t block[BLOCK_SIZE];
+        for (uint32_t i = 0; i < header.num_blocks; ++i) {
+            if (!block_read_at_boot((char *) block,
+                                    (superblock.log_start + 1 + i) * BLOCK_SIZE,
+                                    BLOCK_SIZE)
+                || !block_write_at_boot((char *) block,
+                                        header.block_nos[i] * BLOCK_SIZE,
+                                        BLOCK_SIZE)) {
+                error("journal_init: failed to replay journal block %u", i);
+            }
+        }
+
+        header.num_blocks = 0;
+        if (!block_write_at_boot((char *) &header,
+                                 superblock.log_start * BLOCK_SIZE,
+                                 BLOCK_SIZE)) {
+            error("journal_init: failed to clear journal header");
+        }
+    }
+
+    journal.outstanding = 0;
+    journal.commit_wanted = 0;
+    journal.committing = false;
+    journal.num_logged = 0;
+    journal.num_deferred = 0;
+
+    spinlock_init(&journal_lock, "journal_lock");
+}
@@ -0,0 +1,57 @@
+/**
+ * Write-ahead metadata journal of VSFS, with group commit.
+ */
+
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "block.h"
+
+
+/**
+ * The journal region starts with a header block, followed by the copies
+ * of at most JOURNAL_LOG_MAX logged blocks. The header records the home
+ * block numbers of the logged blocks; a non-zero count means a committed
+ * transaction that might not have been fully installed.
+ */
+#define JOURNAL_LOG_MAX ((BLOCK_SIZE / sizeof(uint32_t)) - 1)
+
+struct journal_header {
+    uint32_t num_blocks;
+    uint32_t block_nos[JOURNAL_LOG_MAX];
+};
+typedef struct journal_header journal_header_t;
+
+
+/**
+ * Max number of cached metadata blocks a transaction may log, kept well
+ * below the buffer cache size as they stay pinned until commit. Every
+ * operation reserves JOURNAL_OP_MAX_BLOCKS of them when it begins, and
+ * the allocation bitmaps (kept in memory) are logged at commit on top.
+ */
+#define JOURNAL_TXN_MAX_BLOCKS 64
+#define JOURNAL_OP_MAX_BLOCKS  10
+
+/**
+ * File writes are split into operations of at most this many bytes, so
+ * that the indirect blocks each one touches fit in its reservation.
+ */
+#define JOURNAL_WRITE_CHUNK (256 * BLOCK_SIZE)
+
+
+void journal_init();
+
+bool journal_begin();
+void journal_end();
+void journal_write(block_request_t *buf);
+void journal_defer();
+
+bool journal_commit();
+
+
+#endif
@@ -0,0 +1,407 @@
+/**
+ * Page cache of regular file data.
+ *
+ * Reading a file otherwise walks its index and goes to the buffer cache
+ * or the disk every time, and the buffer cache is far too small to hold
+ * the binaries and files used over and over again. File data is cached
+ * here in whole pages keyed by (inumber, page index), in frames taken
+ * from the physical memory that is not in use. Directories are metadata
+ * and stay in the buffer cache.
+ *
+ * Frames of cached pages may also be mapped straight into user address
+ * spaces by `mmap()`, each mapping holding a reference on its page.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pcache.h"
+
+#include "../common/debug.h"
+#include "../common/spinlock.h"
+
+#include "../memory/kheap.h"
+#include "../memory/paging.h"
+
+
+/**
+ * Page descriptors, allocated at boot. Unreferenced ones sit on an LRU
+ * list, with the ones holding no frame or no page at the tail to be taken
+ * first. The `pcache_lock` protects the hash chains, the LRU list, and
+ * all fields of the descriptors except page data.
+ */
+static pcache_page_t *pcache;
+static uint32_t pcache_size;
+
+static pcache_page_t *pcache_hash[PCACHE_HASH_SIZE];
+static pcache_page_t *pcache_lru_head;
+static pcache_page_t *pcache_lru_tail;
+
+/** Index of the descriptor owning each frame, -1 if not owned. */
+static int16_t *pcache_owner;
+
+static spinlock_t pcache_lock;
+
+
+/** LRU list & hash chain manipulations, must hold `pcache_lock`. */
+static void
+_pcache_lru_remove(pcache_page_t *page)
+{
+    if (page->lru_prev != NULL)
+        page->lru_prev->lru_next = page->lru_next;
+    else
+        pcache_lru_head = page->lru_next;
+    if (page->lru_next != NULL)
+        page->lru_next->lru_prev = page->lru_prev;
+    else
+        pcache_lru_tail = page->lru_prev;
+    page->lru_prev = NULL;
+    page->lru_next = NULL;
+}
+
+static void
+_pcache_lru_push_head(pcache_page_t *page)
+{
+    page->lru_prev = NULL;
+    page->lru_next = pcache_lru_head;
+    if (pcache_lru_head != NULL)
+        pcache_lru_head->lru_prev = page;
+    else
+        pcache_lru_tail = page;
+    pcache_lru_head = page;
+}
+
+static void
+_pcache_lru_push_tail(pcache_page_t *page)
+{
+    page->lru_next = NULL;
+    page->lru_prev = pcache_lru_tail;
+    if (pcache_lru_tail != NULL)
+        pcache_lru_tail->lru_next = page;
+    else
+        pcache_lru_head = page;
+    pcache_lru_tail = page;
+}
+
+static void
+_pcache_hash_remove(pcache_page_t *page)
+{
+    pcache_page_t **link = &pcache_hash[PCACHE_HASH(page->inumber, page->index)];
+    while (*link != NULL) {
+        if (*link == page) {
+            *link = page->hash_next;
+            break;
+        }
+        link = &((*link)->hash_next);
+    }
+    page->hash_next = NULL;
+    page->cached = false;
+    page->valid = false;
+}
+
+static void
+_pcache_hash_insert(pcache_page_t *page)
+{
+    pcache_page_t **link = &pcache_hash[PCACHE_HASH(page->inumber, page->index)];
+    page->hash_next = *link;
+    *link = page;
+    page->cached = true;
+}
+
+static pcache_page_t *
+_pcache_hash_lookup(uint32_t inumber, uint32_t index)
+{
+    pcache_page_t *page = pcache_hash[PCACHE_HASH(inumber, index)];
+    while (page != NULL
+           && (page->inumber != inumber || page->index != index)) {
+        page = page->hash_next;
+    }
+    return page;
+}
+
+/** Hand frame PADDR (0 for none) to PAGE, must hold `pcache_lock`. */
+static void
+_pcache_set_frame(pcache_page_t *page, uint32_t paddr)
+{
+    if (page->paddr != 0)
+        pcache_owner[ADDR_PAGE_NUMBER(page->paddr)] = -1;
+    page->paddr = paddr;
+    if (paddr != 0)
+        pcache_owner[ADDR_PAGE_NUMBER(paddr)] = page - pcache;
+}
+
+/**
+ * Drop what an unreferenced page caches and free its frame, moving it
+ * to the LRU tail.
+ */
+static void
+_pcache_evict(pcache_page_t *page)
+{
+    if (page->cached)
+        _pcache_hash_remove(page);
+    if (page->paddr != 0) {
+        paging_free_frames(page->paddr, 1);
+        _pcache_set_frame(page, 0);
+    }
+    _pcache_lru_remove(page);
+    _pcache_lru_push_tail(page);
+}
+
+/**
+ * Take the least recently used unreferenced descriptor, dropping what it
+ * caches, and make sure it holds a frame. A new frame is allocated only
+ * if free frames are plenty, otherwise the frame of the least recently
+ * used page holding one is reused. Returns NULL if neither is possible.
+ */
+static pcache_page_t *
+_pcache_take(void)
+{
+    pcache_page_t *page = pcache_lru_tail;
+    if (page == NULL)
+        return NULL;
+    _pcache_lru_remove(page);
+    if (page->cached)
+        _pcache_hash_remove(page);
+
+    if (page->paddr == 0 && paging_num_free_frames() > PCACHE_FREE_LOW)
+        _pcache_set_frame(page, paging_alloc_frames(1, 1));
+
+    if (page->paddr == 0) {
+        pcache_page_t *victim = pcache_lru_tail;
+        while (victim != NULL && victim->paddr == 0)
+            victim = victim->lru_prev;
+        if (victim != NULL) {
+            if (victim->cached)
+                _pcache_hash_remove(victim);
+            uint32_t paddr = victim->paddr;
+            _pcache_set_frame(victim, 0);
+            _pcache_set_frame(page, paddr);
+            _pcache_lru_remove(victim);
+            _pcache_lru_push_tail(victim);
+        }
+    }
+
+    if (page->paddr == 0) {
+        _pcache_lru_push_tail(page);
+        return NULL;
+    }
+    return page;
+}
+
+
+/**
+ * Get page INDEX of inode INUMBER, incrementing its reference count. If
+ * it is not cached and ALLOC, a page is set up for it but left invalid,
+ * to be filled in by the caller. Returns NULL if not cached and cannot
+ * (or need not) be set up.
+ * Must be called with lock on the inode held.
+ */
+pcache_page_t *
+pcache_get(uint32_t inumber, uint32_t index, bool alloc)
+{
+    spinlock_acquire(&pcache_lock);
+
+    pcache_page_t *page = _pcache_hash_lookup(inumber, index);
+    if (page != NULL) {
+        if (page->ref_cnt == 0)
+            _pcache_lru_remove(page);
+        page->ref_cnt++;
+        spinlock_release(&pcache_lock);
+        return page;
+    }
+
+    if (!alloc) {
+        spinlock_release(&pcache_lock);
+        return NULL;
+    }
+
+    page = _pcache_take();
+    if (page != NULL) {
+        page->inumber = inumber;
+        page->index = index;
+        page->valid = false;
+        page->ref_cnt = 1;
+        _pcache_hash_insert(page);
+    }
+
+    spinlock_release(&pcache_lock);
+    return page;
+}
+
+/**
+ * Put down a reference to a page, making it most recently used, or
+ * least if it has been dropped out of the cache meanwhile.
+ * Must hold `pcache_lock`.
+ */
+static void
+_pcache_put_locked(pcache_page_t *page)
+{
+    assert(page->ref_cnt > 0);
+    page->ref_cnt--;
+    if (page->ref_cnt == 0) {
+        if (page->cached)
+            _pcache_lru_push_head(page);
+        else
+            _pcache_lru_push_tail(page);
+    }
+}
+
+void
+pcache_put(pcache_page_t *page)
+{
+    spinlock_acquire(&pcache_lock);
+    _pcache_put_locked(page);
+    spinlock_release(&pcache_lock);
+}
+
+/**
+ * Put down a reference to a page whose content is not good, e.g. failed
+ * to be filled in, dropping it out of the cache. Its frame is reused
+ * first.
+ */
+void
+pcache_drop(pcache_page_t *page)
+{
+    spinlock_acquire(&pcache_lock);
+    assert(page->ref_cnt > 0);
+    if (page->cached)
+        _pcache_hash_remove(page);
+    _pcache_put_locked(page);
+    spinlock_release(&pcache_lock);
+}
+
+/**
+ * If frame PADDR holds a page of the page cache, take another reference
+ * to that page, e.g. for mapping it into one more address space, and
+ * return true.
+ */
+bool
+pcache_frame_ref(uint32_t paddr)
+{
+    spinlock_acquire(&pcache_lock);
+    int16_t idx = pcache_owner[ADDR_PAGE_NUMBER(paddr)];
+    if (idx >= 0) {
+        assert(pcache[idx].ref_cnt > 0);
+        pcache[idx].ref_cnt++;
+    }
+    spinlock_release(&pcache_lock);
+    return idx >= 0;
+}
+
+/**
+ * If frame PADDR holds a page of the page cache, put down a reference to
+ * that page, e.g. as it is unmapped from an address space, and return
+ * true. Otherwise, the frame is not the page cache's to free.
+ */
+bool
+pcache_frame_put(uint32_t paddr)
+{
+    spinlock_acquire(&pcache_lock);
+    int16_t idx = pcache_owner[ADDR_PAGE_NUMBER(paddr)];
+    if (idx >= 0)
+        _pcache_put_locked(&pcache[idx]);
+    spinlock_release(&pcache_lock);
+    return idx >= 0;
+}
+
+/** Returns true if page INDEX of inode INUMBER is cached. */
+bool
+pcache_cached(uint32_t inumber, uint32_t index)
+{
+    spinlock_acquire(&pcache_lock);
+    pcache_page_t *page = _pcache_hash_lookup(inumber, index);
+    bool cached = page != NULL && page->valid;
+    spinlock_release(&pcache_lock);
+    return cached;
+}
+
+/**
+ * Drop all cached pages of inode INUMBER, as it is being freed and the
+ * inumber may be reused, freeing their frames. Pages still mapped by
+ * someone only get dropped out of the hash table, and keep their frames
+ * until the last reference is put.
+ * Must be called with lock on the inode held.
+ */
+void
+pcache_invalidate(uint32_t inumber)
+{
+    spinlock_acquire(&pcache_lock);
+
+    for (pcache_page_t *page = pcache; page < &pcache[pcache_size]; ++page) {
+        if (!page->cached || page->inumber != inumber)
+            continue;
+        if (page->ref_cnt == 0)
+            _pcache_evict(page);
+        else
+            _pcache_hash_remove(page);
+    }
+
+    spinlock_release(&pcache_lock);
+}
+
+/**
+ * Free the frames of up to NUM least recently used unreferenced pages,
+ * when memory runs short. Never blocks, as unreferenced pages are always
+ * clean.
+ * Returns the number of frames freed.
+ */
+uint32_t
+pcache_reclaim(uint32_t num)
+{
+    uint32_t freed = 0;
+
+    spinlock_acquire(&pcache_lock);
+
+    pcache_page_t *page = pcache_lru_tail;
+    while (page != NULL && freed < num) {
+        pcache_page_t *prev = page->lru_prev;
+        if (page->paddr != 0) {
+            _pcache_evict(page);
+            freed++;
+        }
+        page = prev;
+    }
+
+    spinlock_release(&pcache_lock);
+    return freed;
+}
+
+
+/**
+ * Initialize the page cache with NUM_PAGES page descriptors allocated
+ * from the kernel heap, all caching nothing. Frames are taken as pages
+ * get filled.
+ */
+void
+pcache_init(uint32_t num_pages)
+{
+    pcache = (pcache_page_t *) kalloc(num_pages * sizeof(pcache_page_t));
+    if (pcache == NULL)
+        error("pcache_init: failed to allocate %u page descriptors", num_pages);
+    pcache_size = num_pages;
+    assert(num_pages <= 0x7FFF);
+
+    pcache_owner = (int16_t *) kalloc(NUM_FRAMES * sizeof(int16_t));
+    if (pcache_owner == NULL)
+        error("pcache_init: failed to allocate frame owner map");
+    for (size_t i = 0; i < NUM_FRAMES; ++i)
+        pcache_owner[i] = -1;
+
+    for (size_t i = 0; i < PCACHE_HASH_SIZE; ++i)
+        pcache_hash[i] = NULL;
+    pcache_lru_head = NULL;
+    pcache_lru_tail = NULL;
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        pcache_page_t *page = &pcache[i];
+        page->cached = false;
+        page->valid = false;
+        page->ref_cnt = 0;
+        page->paddr = 0;
+        page->hash_next = NULL;
+        _pcache_lru_push_tail(page);
+    }
+
+    spinlock_init(&pcache_lock, "pcache_lock");
+}
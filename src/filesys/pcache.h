@@ -0,0 +1,81 @@
+/**
+ * Page cache of regular file data.
+ */
+
+
+#ifndef PCACHE_H
+#define PCACHE_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../memory/paging.h"
+
+
+/**
+ * A cached page of file data: page INDEX (in PAGE_SIZE units) of inode
+ * INUMBER, held in the physical frame at PADDR. The bytes past the end
+ * of file are zeros, except for what a shared `mmap()` writes there
+ * until its writeback zeros them. File writes go through to the buffer
+ * cache and update the cached pages alongside. A page may only get ahead
+ * of the file while mapped writable by shared `mmap()`s, which write it
+ * back before putting their references, so unreferenced pages are
+ * always clean and evicting one never needs disk I/O.
+ *
+ * The content of a page is protected by the lock on its inode, which is
+ * held when filling, reading or updating it. A referenced page is never
+ * evicted, e.g. while being filled from disk or while mapped.
+ */
+struct pcache_page {
+    bool cached;        /** Holds page INDEX of INUMBER, in the hash table. */
+    bool valid;         /** Data has been filled in. */
+    uint16_t ref_cnt;   /** Reference count (from I/O & mappings). */
+    uint32_t inumber;   /** Inode number of the file. */
+    uint32_t index;     /** Page index in the file. */
+    uint32_t paddr;     /** Frame holding the data, 0 if none. */
+    struct pcache_page *hash_next;  /** Next in hash chain. */
+    struct pcache_page *lru_prev;   /** Towards most recently used. */
+    struct pcache_page *lru_next;   /** Towards least recently used. */
+};
+typedef struct pcache_page pcache_page_t;
+
+/** Kernel-accessible address of the data of a page. */
+#define PCACHE_PAGE_DATA(page) ((char *) (page)->paddr)
+
+
+/**
+ * Number of page descriptors, allocated from the kernel heap at boot,
+ * bounding the cache at 16MiB. Frames are taken from the free frames
+ * only while more than PCACHE_FREE_LOW of them remain free; below that,
+ * the least recently used page gives up its frame instead. When user
+ * memory allocation runs out of frames, unreferenced pages are reclaimed
+ * in PCACHE_RECLAIM_PAGES batches.
+ */
+#define PCACHE_MAX_PAGES 4096
+
+#define PCACHE_FREE_LOW      (NUM_FRAMES / 8)
+#define PCACHE_RECLAIM_PAGES 32
+
+#define PCACHE_HASH_SIZE 256
+#define PCACHE_HASH(inumber, index) (((inumber) * 31 + (index)) % PCACHE_HASH_SIZE)
+
+/** Max number of missing pages filled from disk in one batch. */
+#define PCACHE_FILL_PAGES 16
+
+
+void pcache_init(uint32_t num_pages);
+
+pcache_page_t *pcache_get(uint32_t inumber, uint32_t index, bool alloc);
+void pcache_put(pcache_page_t *page);
+void pcache_drop(pcache_page_t *page);
+bool pcache_cached(uint32_t inumber, uint32_t index);
+
+bool pcache_frame_ref(uint32_t paddr);
+bool pcache_frame_put(uint32_t paddr);
+
+void pcache_invalidate(uint32_t inumber);
+uint32_t pcache_reclaim(uint32_t num);
+
+
+#endif
@@ -105,7 +105,7 @@ syscall_read(void)
         return SYS_FAIL_RC;
     if (!sysarg_get_uint(2, &len))
         return SYS_FAIL_RC;
-    if (!sysarg_get_mem(1, &dst, len))
+    if (!sysarg_get_mem(1, &dst, len, true))
         return SYS_FAIL_RC;
 
     return filesys_read(fd, dst, len);
@@ -125,12 +125,126 @@ syscall_write(void)
         return SYS_FAIL_RC;
     if (!sysarg_get_uint(2, &len))
         return SYS_FAIL_RC;
-    if (!sysarg_get_mem(1, &src, len))
+    if (!sysarg_get_mem(1, &src, len, false))
         return SYS_FAIL_RC;
 
     return filesys_write(fd, src, len);
 }
 
+/** int32_t pread(int32_t fd, char *dst, uint32_t len, uint32_t offset); */
+int32_t
+syscall_pread(void)
+{
+    int32_t fd;
+    char *dst;
+    uint32_t len, offset;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROC)
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(2, &len))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_mem(1, &dst, len, true))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(3, &offset))
+        return SYS_FAIL_RC;
+
+    return filesys_pread(fd, dst, len, offset);
+}
+
+/** int32_t pwrite(int32_t fd, char *src, uint32_t len, uint32_t offset); */
+int32_t
+syscall_pwrite(void)
+{
+    int32_t fd;
+    char *src;
+    uint32_t len, offset;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROC)
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(2, &len))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_mem(1, &src, len, false))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(3, &offset))
+        return SYS_FAIL_RC;
+
+    return filesys_pwrite(fd, src, len, offset);
+}
+
+/**
+ * Get the iovec array argument (1st) and its length (2nd) of `readv()`
+ * and `writev()`, copying it into KIOV after validating every buffer,
+ * which the kernel is going to write into if WRITE.
+ */
+static bool
+_sysarg_get_iovecs(iovec_t *kiov, uint32_t *iovcnt, bool write)
+{
+    iovec_t *uiov;
+
+    if (!sysarg_get_uint(2, iovcnt))
+        return false;
+    if (*iovcnt == 0 || *iovcnt > MAX_IOVECS)
+        return false;
+    if (!sysarg_get_mem(1, (char **) &uiov, *iovcnt * sizeof(iovec_t), false))
+        return false;
+
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < *iovcnt; ++i) {
+        kiov[i] = uiov[i];
+        if (!sysarg_addr_mem((uint32_t) kiov[i].base, &kiov[i].base,
+                             kiov[i].len, write)) {
+            return false;
+        }
+        if (total + kiov[i].len < total) {
+            warn("iovecs: total length overflows");
+            return false;
+        }
+        total += kiov[i].len;
+    }
+
+    return true;
+}
+
+/** int32_t readv(int32_t fd, iovec_t *iov, uint32_t iovcnt); */
+int32_t
+syscall_readv(void)
+{
+    int32_t fd;
+    iovec_t iov[MAX_IOVECS];
+    uint32_t iovcnt;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROC)
+        return SYS_FAIL_RC;
+    if (!_sysarg_get_iovecs(iov, &iovcnt, true))
+        return SYS_FAIL_RC;
+
+    return filesys_readv(fd, iov, iovcnt);
+}
+
+/** int32_t writev(int32_t fd, iovec_t *iov, uint32_t iovcnt); */
+int32_t
+syscall_writev(void)
+{
+    int32_t fd;
+    iovec_t iov[MAX_IOVECS];
+    uint32_t iovcnt;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROC)
+        return SYS_FAIL_RC;
+    if (!_sysarg_get_iovecs(iov, &iovcnt, false))
+        return SYS_FAIL_RC;
+
+    return filesys_writev(fd, iov, iovcnt);
+}
+
 /** int32_t chdir(char *path); */
 int32_t
 syscall_chdir(void)
@@ -156,7 +270,7 @@ syscall_getcwd(void)
         return SYS_FAIL_RC;
     if (limit < 2)
         return SYS_FAIL_RC;
-    if (!sysarg_get_mem(0, &buf, limit))
+    if (!sysarg_get_mem(0, &buf, limit, true))
         return SYS_FAIL_RC;
 
     if (!filesys_getcwd(buf, limit))
@@ -203,7 +317,7 @@ syscall_fstat(void)
 
     if (!sysarg_get_int(0, &fd))
         return SYS_FAIL_RC;
-    if (!sysarg_get_mem(1, (char **) &stat, sizeof(file_stat_t)))
+    if (!sysarg_get_mem(1, (char **) &stat, sizeof(file_stat_t), true))
         return SYS_FAIL_RC;
 
     if (!filesys_fstat(fd, stat))
@@ -211,6 +325,50 @@ syscall_fstat(void)
     return 0;
 }
 
+/** int32_t stat(char *path, file_stat_t *stat); */
+int32_t
+syscall_stat(void)
+{
+    char *path;
+    file_stat_t *stat;
+
+    if (sysarg_get_str(0, &path) <= 0)
+        return SYS_FAIL_RC;
+    if (!sysarg_get_mem(1, (char **) &stat, sizeof(file_stat_t), true))
+        return SYS_FAIL_RC;
+
+    if (!filesys_stat(path, stat))
+        return SYS_FAIL_RC;
+    return 0;
+}
+
+/**
+ * int32_t getdents(int32_t fd, dir_entry_t *buf, uint32_t count,
+ *                  uint32_t flags);
+ */
+int32_t
+syscall_getdents(void)
+{
+    int32_t fd;
+    dir_entry_t *buf;
+    uint32_t count, flags;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROC)
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(2, &count))
+        return SYS_FAIL_RC;
+    if (count == 0 || count > MAX_GETDENTS_COUNT)
+        return SYS_FAIL_RC;
+    if (!sysarg_get_mem(1, (char **) &buf, count * sizeof(dir_entry_t), true))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(3, &flags))
+        return SYS_FAIL_RC;
+
+    return filesys_getdents(fd, buf, count, flags);
+}
+
 /** int32_t seek(int32_t fd, uint32_t offset); */
 int32_t
 syscall_seek(void)
@@ -227,3 +385,26 @@ syscall_seek(void)
         return SYS_FAIL_RC;
     return 0;
 }
+
+/** int32_t sync(void); */
+int32_t
+syscall_sync(void)
+{
+    if (!filesys_sync())
+        return SYS_FAIL_RC;
+    return 0;
+}
+
+/** int32_t fsync(int32_t fd); */
+int32_t
+syscall_fsync(void)
+{
+    int32_t fd;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+
+    if (!filesys_fsync(fd))
+        return SYS_FAIL_RC;
+    return 0;
+}
@@ -27,6 +27,30 @@ struct file_stat {
 };
 typedef struct file_stat file_stat_t;
 
+/**
+ * For the `getdents()` syscall. Only STAT.inumber is filled in unless
+ * GETDENTS_STAT is given. FILENAME is of MAX_FILENAME bytes.
+ */
+struct dir_entry {
+    file_stat_t stat;
+    char filename[100];
+};
+typedef struct dir_entry dir_entry_t;
+
+/** Flags for `getdents()`, and max number of entries per call. */
+#define GETDENTS_STAT 0x1
+
+#define MAX_GETDENTS_COUNT 256
+
+/** For the `readv()` & `writev()` syscalls. */
+struct iovec {
+    char *base;
+    uint32_t len;
+};
+typedef struct iovec iovec_t;
+
+#define MAX_IOVECS 16
+
 
 int32_t syscall_open();
 int32_t syscall_close();
@@ -39,6 +63,14 @@ int32_t syscall_getcwd();
 int32_t syscall_exec();
 int32_t syscall_fstat();
 int32_t syscall_seek();
+int32_t syscall_sync();
+int32_t syscall_fsync();
+int32_t syscall_getdents();
+int32_t syscall_stat();
+int32_t syscall_pread();
+int32_t syscall_pwrite();
+int32_t syscall_readv();
+int32_t syscall_writev();
 
 
 #endif
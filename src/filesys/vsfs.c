@@ -14,6 +14,10 @@
 #include "file.h"
 #include "sysfile.h"
 #include "exec.h"
+#include "journal.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "pcache.h"
 
 #include "../common/debug.h"
 #include "../common/string.h"
@@ -33,6 +37,16 @@ superblock_t superblock;
 bitmap_t inode_bitmap;
 bitmap_t data_bitmap;
 
+/**
+ * The in-memory bitmaps are the up-to-date copies, never cached in the
+ * block buffer cache. Each is the concatenation of the per-group slices
+ * on disk. Updates only mark the containing bitmap blocks dirty
+ * (protected by the bitmap's lock), and dirty blocks are logged straight
+ * from memory when the journal commits.
+ */
+static bool *inode_bitmap_dirty;
+static bool *data_bitmap_dirty;
+
 
 /**
  * Allocates a free file descriptor of the caller process. Returns -1
@@ -66,69 +80,155 @@ _find_process_file(int8_t fd)
 
 
 /**
- * Look for a filename in a directory. Returns a got inode on success, or
- * NULL if not found. If found, sets *ENTRY_OFFSET to byte offset of the
- * entry.
+ * Scan the dentries of DIR_INODE linearly from the START-th one on, a
+ * whole block at a time through the buffer cache, for the first one
+ * MATCH holds for (with ARG), copying it into *FOUND. Returns its index,
+ * the number of dentries if none matches, or -1 on failures.
  * Must be called with lock on DIR_INODE held.
  */
-static mem_inode_t *
-_dir_find(mem_inode_t *dir_inode, char *filename, uint32_t *entry_offset)
+static int32_t
+_dir_scan(mem_inode_t *dir_inode, uint32_t start,
+          bool (*match)(dentry_t *, void *), void *arg, dentry_t *found)
 {
-    assert(dir_inode->d_inode.type == INODE_TYPE_DIR);
-
-    /** Search for the filename in this directory. */
-    dentry_t dentry;
-    for (size_t offset = 0;
-         offset < dir_inode->d_inode.size;
-         offset += sizeof(dentry_t)) {
-        if (inode_read(dir_inode, (char *) &dentry, offset,
-                       sizeof(dentry_t)) != sizeof(dentry_t)) {
-            warn("dir_find: failed to read at offset %u", offset);
-            return NULL;
+    uint32_t num = dir_inode->d_inode.size / sizeof(dentry_t);
+
+    for (uint32_t idx = start; idx < num; ) {
+        uint32_t block = idx / DENTRIES_PB;
+        block_request_t *buf = inode_block_get(dir_inode, block);
+        if (buf == NULL) {
+            warn("dir_scan: failed to read directory block %u", block);
+            return -1;
         }
-        if (dentry.valid == 0)
-            continue;
-
-        /** If matches, get the inode. */
-        if (strncmp(dentry.filename, filename, MAX_FILENAME) == 0) {
-            if (entry_offset != NULL)
-                *entry_offset = offset;
-            return inode_get(dentry.inumber);
+
+        dentry_t *dentries = (dentry_t *) buf->data;
+        uint32_t end = (block + 1) * DENTRIES_PB;
+        if (end > num)
+            end = num;
+        for (; idx < end; ++idx) {
+            if (match(&dentries[idx % DENTRIES_PB], arg)) {
+                *found = dentries[idx % DENTRIES_PB];
+                block_put(buf);
+                return idx;
+            }
         }
+        block_put(buf);
     }
 
-    return NULL;
+    return num;
 }
 
-/** 
- * Add a new directory entry.
+static bool
+_dentry_named(dentry_t *dentry, void *filename)
+{
+    return dentry->valid != 0
+           && strncmp(dentry->filename, (char *) filename, MAX_FILENAME) == 0;
+}
+
+static bool
+_dentry_unused(dentry_t *dentry, void *arg __attribute__((unused)))
+{
+    return dentry->valid == 0;
+}
+
+static bool
+_dentry_used(dentry_t *dentry, void *arg __attribute__((unused)))
+{
+    return dentry->valid != 0;
+}
+
+static bool
+_dentry_of_inumber(dentry_t *dentry, void *inumber)
+{
+    return dentry->valid != 0 && dentry->inumber == *((uint32_t *) inumber);
+}
+
+
+/**
+ * Look for a filename in a directory on disk. Returns DIR_FIND_FOUND if
+ * found, setting *INUMBER, and *ENTRY_OFFSET to byte offset of the entry
+ * if not NULL. Returns DIR_FIND_MISS if not found, or DIR_FIND_ERROR if
+ * the directory could not be read. Indexed directories are looked up
+ * through their hashed index.
+ */
+static int8_t
+_dir_find_dentry(mem_inode_t *dir_inode, char *filename, uint32_t *inumber,
+                 uint32_t *entry_offset)
+{
+    if (dir_inode->d_inode.flags & INODE_FLAG_DIR_INDEX)
+        return dir_index_find(dir_inode, filename, inumber, entry_offset);
+
+    /** Search for the filename in this directory. */
+    dentry_t dentry;
+    int32_t idx = _dir_scan(dir_inode, 0, _dentry_named, filename, &dentry);
+    if (idx < 0)
+        return DIR_FIND_ERROR;
+    if ((uint32_t) idx * sizeof(dentry_t) >= dir_inode->d_inode.size)
+        return DIR_FIND_MISS;
+
+    *inumber = dentry.inumber;
+    if (entry_offset != NULL)
+        *entry_offset = idx * sizeof(dentry_t);
+    return DIR_FIND_FOUND;
+}
+
+/**
+ * Look for a filename in a directory. Returns a got inode on success, or
+ * NULL if not found or on failures, telling which in *FAILED if not NULL.
+ * If found, sets *ENTRY_OFFSET to byte offset of the entry. Lookups not
+ * asking for the offset are answered from the dentry cache if possible,
+ * and their results are cached, misses only if definite.
  * Must be called with lock on DIR_INODE held.
  */
-static bool
-_dir_add(mem_inode_t *dir_inode, char *filename, uint32_t inumber)
+static mem_inode_t *
+_dir_find(mem_inode_t *dir_inode, char *filename, uint32_t *entry_offset,
+          bool *failed)
 {
-    /** The name must not be present. */
-    mem_inode_t *file_inode = _dir_find(dir_inode, filename, NULL);
-    if (file_inode != NULL) {
-        warn("dir_add: file '%s' already exists", filename);
-        inode_put(file_inode);
-        return false;
+    assert(dir_inode->d_inode.type == INODE_TYPE_DIR);
+
+    if (failed != NULL)
+        *failed = false;
+
+    uint32_t inumber;
+    if (entry_offset == NULL
+        && dcache_lookup(dir_inode->inumber, filename, &inumber)) {
+        if (inumber == DCACHE_NEGATIVE)
+            return NULL;
+        return inode_get(inumber);
     }
 
+    int8_t result = _dir_find_dentry(dir_inode, filename, &inumber,
+                                     entry_offset);
+    if (result == DIR_FIND_ERROR) {
+        warn("dir_find: failed to look up '%s' in directory %u",
+             filename, dir_inode->inumber);
+        if (failed != NULL)
+            *failed = true;
+        return NULL;
+    }
+    dcache_insert(dir_inode->inumber, filename,
+                  result == DIR_FIND_FOUND ? inumber : DCACHE_NEGATIVE);
+    if (result == DIR_FIND_MISS)
+        return NULL;
+
+    /** If matches, get the inode. */
+    return inode_get(inumber);
+}
+
+/** Add a new entry into a linear directory. */
+static bool
+_dir_add_linear(mem_inode_t *dir_inode, char *filename, uint32_t inumber)
+{
     /** Look for an emtpy directory entry. */
     dentry_t dentry;
-    uint32_t offset;
-    for (offset = 0;
-         offset < dir_inode->d_inode.size;
-         offset += sizeof(dentry_t)) {
-        if (inode_read(dir_inode, (char *) &dentry, offset,
-                       sizeof(dentry_t)) != sizeof(dentry_t)) {
-            warn("dir_add: failed to read at offset %u", offset);
-            return false;
-        }
-        if (dentry.valid == 0)
-            break;
+    int32_t idx = _dir_scan(dir_inode, 0, _dentry_unused, NULL, &dentry);
+    if (idx < 0) {
+        warn("dir_add: failed to scan directory %u", dir_inode->inumber);
+        return false;
     }
+    uint32_t offset = idx * sizeof(dentry_t);
+
+    if (offset == BLOCK_SIZE && dir_inode->d_inode.size == BLOCK_SIZE)
+        return dir_index_create(dir_inode, filename, inumber);
 
     /** Add into this empty slot. */
     memset(&dentry, 0, sizeof(dentry_t));
@@ -144,33 +244,47 @@ _dir_add(mem_inode_t *dir_inode, char *filename, uint32_t inumber)
     return true;
 }
 
+/** 
+ * Add a new directory entry, also into the dentry cache. The name must
+ * not be present already. A linear directory outgrowing its first block
+ * becomes indexed.
+ * Must be called within a journal operation, with lock on DIR_INODE held.
+ */
+static bool
+_dir_add(mem_inode_t *dir_inode, char *filename, uint32_t inumber)
+{
+    bool success = (dir_inode->d_inode.flags & INODE_FLAG_DIR_INDEX)
+                   ? dir_index_add(dir_inode, filename, inumber)
+                   : _dir_add_linear(dir_inode, filename, inumber);
+    if (success)
+        dcache_insert(dir_inode->inumber, filename, inumber);
+    return success;
+}
+
 /**
  * Returns true if the directory is empty. Since directory size grows
  * in Hux and never gets recycled until removed, need to loop over all
- * allocated dentry slots to check if all are now unused.
+ * allocated dentry slots to check if all are now unused. Index nodes
+ * look like unused slots.
  * Must be called with lock on DIR_INODE held.
  */
 static bool
 _dir_empty(mem_inode_t *dir_inode)
 {
+    /** Skip '.' and '..' */
     dentry_t dentry;
-    for (size_t offset = 2 * sizeof(dentry_t);      /** Skip '.' and '..' */
-         offset < dir_inode->d_inode.size;
-         offset += sizeof(dentry_t)) {
-        if (inode_read(dir_inode, (char *) &dentry, offset,
-                       sizeof(dentry_t)) != sizeof(dentry_t)) {
-            warn("dir_empty: failed to read at offset %u", offset);
-            return false;
-        }
-        if (dentry.valid != 0)
-            return false;
+    int32_t idx = _dir_scan(dir_inode, 2, _dentry_used, NULL, &dentry);
+    if (idx < 0) {
+        warn("dir_empty: failed to scan directory %u", dir_inode->inumber);
+        return false;
     }
 
-    return true;
+    return (uint32_t) idx * sizeof(dentry_t) >= dir_inode->d_inode.size;
 }
 
 /**
- * Get filename for child inode of INUMBER.
+ * Get filename for child inode of INUMBER, following the parent link in
+ * the dentry cache if possible.
  * Must be called with lock on DIR_INODE held.
  */
 static size_t
@@ -178,30 +292,26 @@ _dir_filename(mem_inode_t *dir_inode, uint32_t inumber,
               char *buf, size_t limit)
 {
     dentry_t dentry;
-    for (size_t offset = 2 * sizeof(dentry_t);      /** Skip '.' and '..' */
-         offset < dir_inode->d_inode.size;
-         offset += sizeof(dentry_t)) {
-        if (inode_read(dir_inode, (char *) &dentry, offset,
-                       sizeof(dentry_t)) != sizeof(dentry_t)) {
-            warn("dir_filename: failed to read at offset %u", offset);
+    if (!dcache_lookup_name(dir_inode->inumber, inumber, dentry.filename)) {
+        /** Skip '.' and '..' */
+        int32_t idx = _dir_scan(dir_inode, 2, _dentry_of_inumber, &inumber,
+                                &dentry);
+        if (idx < 0)
+            return limit;
+        if ((uint32_t) idx * sizeof(dentry_t) >= dir_inode->d_inode.size) {
+            warn("dir_filename: child inumber %u not found", inumber);
             return limit;
         }
-        if (dentry.valid == 0)
-            continue;
-
-        if (dentry.inumber == inumber) {
-            size_t len = limit - 1;
-            if (len < strlen(dentry.filename))
-                return limit;
-            else if (len > strlen(dentry.filename))
-                len = strlen(dentry.filename);
-            strncpy(buf, dentry.filename, len);
-            return len;
-        }
+        dcache_insert(dir_inode->inumber, dentry.filename, inumber);
     }
 
-    warn("dir_filename: child inumber %u not found", inumber);
-    return limit;
+    size_t len = limit - 1;
+    if (len < strlen(dentry.filename))
+        return limit;
+    else if (len > strlen(dentry.filename))
+        len = strlen(dentry.filename);
+    strncpy(buf, dentry.filename, len);
+    return len;
 }
 
 
@@ -277,7 +387,7 @@ _path_to_inode(char *path, bool stop_at_parent, char *filename)
             return inode;     /** Stopping one-level early. */
         }
 
-        mem_inode_t *next = _dir_find(inode, filename, NULL);
+        mem_inode_t *next = _dir_find(inode, filename, NULL, NULL);
         if (next == NULL) {
             inode_unlock(inode);
             inode_put(inode);
@@ -354,6 +464,7 @@ filesys_open(char *path, uint32_t mode)
     file->readable = (mode & OPEN_RD) != 0;
     file->writable = (mode & OPEN_WR) != 0;
     file->offset = 0;
+    readahead_init(&(file->ra));
 
     return fd;
 }
@@ -374,12 +485,9 @@ filesys_close(int8_t fd)
 }
 
 
-/**
- * Create a file or directory at the given path name. Returns true on
- * success and false on failures.
- */
-bool
-filesys_create(char *path, uint32_t mode)
+/** Helper of `filesys_create()`, within a journal operation. */
+static bool
+_filesys_create_helper(char *path, uint32_t mode)
 {
     char filename[MAX_FILENAME];
     mem_inode_t *parent_inode = _path_lookup_parent(path, filename);
@@ -390,7 +498,8 @@ filesys_create(char *path, uint32_t mode)
 
     inode_lock(parent_inode);
 
-    mem_inode_t *file_inode = _dir_find(parent_inode, filename, NULL);
+    bool failed;
+    mem_inode_t *file_inode = _dir_find(parent_inode, filename, NULL, &failed);
     if (file_inode != NULL) {
         warn("create: file '%s' already exists", path);
         inode_unlock(parent_inode);
@@ -398,9 +507,15 @@ filesys_create(char *path, uint32_t mode)
         inode_put(file_inode);
         return false;
     }
+    if (failed) {
+        warn("create: cannot tell if '%s' already exists", path);
+        inode_unlock(parent_inode);
+        inode_put(parent_inode);
+        return false;
+    }
 
     uint32_t type = (mode & CREATE_FILE) ? INODE_TYPE_FILE : INODE_TYPE_DIR;
-    file_inode = inode_alloc(type);
+    file_inode = inode_alloc(type, parent_inode->inumber);
     if (file_inode == NULL) {
         warn("create: failed to allocate inode on disk, out of space?");
         return false;
@@ -413,6 +528,7 @@ filesys_create(char *path, uint32_t mode)
         if (!_dir_add(file_inode, ".", file_inode->inumber)
             || !_dir_add(file_inode, "..", parent_inode->inumber)) {
             warn("create: failed to create '.' or '..' entries");
+            dcache_invalidate_dir(file_inode->inumber);
             inode_free(file_inode);
             return false;
         }
@@ -421,6 +537,7 @@ filesys_create(char *path, uint32_t mode)
     /** Put file into parent directory. */
     if (!_dir_add(parent_inode, filename, file_inode->inumber)) {
         warn("create: failed to put '%s' into its parent directory", path);
+        dcache_invalidate_dir(file_inode->inumber);
         inode_free(file_inode);
         return false;
     }
@@ -435,11 +552,23 @@ filesys_create(char *path, uint32_t mode)
 }
 
 /**
- * Remove a file or directory from the file system. If is removing a
- * directory, the directory must be empty.
+ * Create a file or directory at the given path name. Returns true on
+ * success and false on failures.
  */
 bool
-filesys_remove(char *path)
+filesys_create(char *path, uint32_t mode)
+{
+    if (!journal_begin())
+        return false;
+    bool success = _filesys_create_helper(path, mode);
+    journal_end();
+
+    return success;
+}
+
+/** Helper of `filesys_remove()`, within a journal operation. */
+static bool
+_filesys_remove_helper(char *path)
 {
     char filename[MAX_FILENAME];
     mem_inode_t *parent_inode = _path_lookup_parent(path, filename);
@@ -460,7 +589,7 @@ filesys_remove(char *path)
     }
 
     uint32_t offset;
-    mem_inode_t *file_inode = _dir_find(parent_inode, filename, &offset);
+    mem_inode_t *file_inode = _dir_find(parent_inode, filename, &offset, NULL);
     if (file_inode == NULL) {
         warn("remove: cannot find file '%s'", path);
         inode_unlock(parent_inode);     // Maybe use goto.
@@ -494,6 +623,9 @@ filesys_remove(char *path)
         return false;
     }
 
+    dcache_invalidate(parent_inode->inumber, filename);
+    dcache_invalidate_dir(file_inode->inumber);
+
     inode_unlock(parent_inode);
     inode_put(parent_inode);
 
@@ -506,53 +638,192 @@ filesys_remove(char *path)
     return true;
 }
 
+/**
+ * Remove a file or directory from the file system. If is removing a
+ * directory, the directory must be empty.
+ */
+bool
+filesys_remove(char *path)
+{
+    if (!journal_begin())
+        return false;
+    bool success = _filesys_remove_helper(path);
+    journal_end();
+
+    return success;
+}
+
 
-/** Read from current offset of file into user buffer. */
-int32_t
-filesys_read(int8_t fd, char *dst, size_t len)
+/**
+ * Find open file FD of the caller process, checking that it is readable,
+ * or writable if WRITE. OP names the syscall in warnings.
+ */
+static file_t *
+_find_file_for_io(int8_t fd, bool write, char *op)
 {
     file_t *file = _find_process_file(fd);
     if (file == NULL) {
-        warn("read: cannot find file for fd %d", fd);
-        return -1;
+        warn("%s: cannot find file for fd %d", op, fd);
+        return NULL;
     }
 
-    if (!file->readable) {
-        warn("read: file for fd %d is not readable", fd);
-        return -1;
+    if (write ? !file->writable : !file->readable) {
+        warn("%s: file for fd %d is not %s", op, fd,
+             write ? "writable" : "readable");
+        return NULL;
     }
 
+    return file;
+}
+
+/**
+ * Read into the IOVCNT buffers of IOV in turn, from *OFFSET of FILE on,
+ * all under a single lock on its inode. Advances *OFFSET by the number
+ * of bytes read, which is returned. Stops early at end of file.
+ */
+static int32_t
+_file_readv_at(file_t *file, iovec_t *iov, size_t iovcnt, uint32_t *offset)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < iovcnt; ++i)
+        len += iov[i].len;
+
     inode_lock(file->inode);
-    size_t bytes_read = inode_read(file->inode, dst, file->offset, len);
-    if (bytes_read > 0)         /** Update file offset. */
-        file->offset += bytes_read;
-    inode_unlock(file->inode);
+    inode_readahead(file->inode, &(file->ra), *offset, len);
+
+    size_t bytes_read = 0;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        size_t piece_read = inode_read(file->inode, iov[i].base,
+                                       *offset + bytes_read, iov[i].len);
+        bytes_read += piece_read;
+        if (piece_read < iov[i].len)
+            break;
+    }
+    *offset += bytes_read;      /** Update file offset. */
 
+    inode_unlock(file->inode);
     return bytes_read;
 }
 
+/**
+ * Write the IOVCNT buffers of IOV in turn to *OFFSET of FILE on. Split
+ * into journal operations of bounded size, each of which must begin
+ * before locking the inode; small writes of several buffers, e.g., a
+ * record header and its payload, go in a single one. Advances *OFFSET by
+ * the number of bytes written, which is returned.
+ */
+static int32_t
+_file_writev_at(file_t *file, iovec_t *iov, size_t iovcnt, uint32_t *offset)
+{
+    size_t bytes_written = 0;
+    size_t i = 0, done = 0;     /** Bytes of IOV[I] already written. */
+    bool short_write = false;
+
+    while (i < iovcnt && !short_write) {
+        if (!journal_begin())
+            break;
+        inode_lock(file->inode);
+
+        size_t chunk_left = JOURNAL_WRITE_CHUNK;
+        while (i < iovcnt && chunk_left > 0) {
+            size_t piece = iov[i].len - done;
+            if (piece > chunk_left)
+                piece = chunk_left;
+
+            size_t piece_written = inode_write(file->inode,
+                                               iov[i].base + done,
+                                               *offset, piece);
+            *offset += piece_written;       /** Update file offset. */
+            bytes_written += piece_written;
+            chunk_left -= piece_written;
+            done += piece_written;
+            if (piece_written < piece) {
+                short_write = true;
+                break;
+            }
+
+            if (done == iov[i].len) {
+                i++;
+                done = 0;
+            }
+        }
+
+        inode_unlock(file->inode);
+        journal_end();
+    }
+
+    return bytes_written;
+}
+
+
+/** Read from current offset of file into user buffer. */
+int32_t
+filesys_read(int8_t fd, char *dst, size_t len)
+{
+    file_t *file = _find_file_for_io(fd, false, "read");
+    if (file == NULL)
+        return -1;
+
+    iovec_t iov = {.base = dst, .len = len};
+    return _file_readv_at(file, &iov, 1, &(file->offset));
+}
+
 /** Write from user buffer into current offset of file. */
 int32_t
 filesys_write(int8_t fd, char *src, size_t len)
 {
-    file_t *file = _find_process_file(fd);
-    if (file == NULL) {
-        warn("read: cannot find file for fd %d", fd);
+    file_t *file = _find_file_for_io(fd, true, "write");
+    if (file == NULL)
         return -1;
-    }
 
-    if (!file->writable) {
-        warn("write: file for fd %d is not writable", fd);
+    iovec_t iov = {.base = src, .len = len};
+    return _file_writev_at(file, &iov, 1, &(file->offset));
+}
+
+/** Read from given offset of file, leaving the file offset untouched. */
+int32_t
+filesys_pread(int8_t fd, char *dst, size_t len, uint32_t offset)
+{
+    file_t *file = _find_file_for_io(fd, false, "pread");
+    if (file == NULL)
         return -1;
-    }
 
-    inode_lock(file->inode);
-    size_t bytes_written = inode_write(file->inode, src, file->offset, len);
-    if (bytes_written > 0)      /** Update file offset. */
-        file->offset += bytes_written;
-    inode_unlock(file->inode);
+    iovec_t iov = {.base = dst, .len = len};
+    return _file_readv_at(file, &iov, 1, &offset);
+}
 
-    return bytes_written;
+/** Write to given offset of file, leaving the file offset untouched. */
+int32_t
+filesys_pwrite(int8_t fd, char *src, size_t len, uint32_t offset)
+{
+    file_t *file = _find_file_for_io(fd, true, "pwrite");
+    if (file == NULL)
+        return -1;
+
+    iovec_t iov = {.base = src, .len = len};
+    return _file_writev_at(file, &iov, 1, &offset);
+}
+
+/** Read from current offset of file into multiple user buffers. */
+int32_t
+filesys_readv(int8_t fd, iovec_t *iov, size_t iovcnt)
+{
+    file_t *file = _find_file_for_io(fd, false, "readv");
+    if (file == NULL)
+        return -1;
+
+    return _file_readv_at(file, iov, iovcnt, &(file->offset));
+}
+
+/** Write from multiple user buffers into current offset of file. */
+int32_t
+filesys_writev(int8_t fd, iovec_t *iov, size_t iovcnt)
+{
+    file_t *file = _find_file_for_io(fd, true, "writev");
+    if (file == NULL)
+        return -1;
+
+    return _file_writev_at(file, iov, iovcnt, &(file->offset));
 }
 
 
@@ -595,7 +866,7 @@ _recurse_abs_path(mem_inode_t *inode, char *buf, size_t limit)
     inode_lock(inode);
 
     /** Check the parent directory. */
-    mem_inode_t *parent_inode = _dir_find(inode, "..", NULL);
+    mem_inode_t *parent_inode = _dir_find(inode, "..", NULL, NULL);
     if (parent_inode == NULL) {
         warn("abs_path: failed to get parent inode of %u", inode->inumber);
         inode_unlock(inode);
@@ -678,6 +949,112 @@ filesys_fstat(int8_t fd, file_stat_t *stat)
     return true;
 }
 
+/** Get metadata information about a path, without opening it. */
+bool
+filesys_stat(char *path, file_stat_t *stat)
+{
+    mem_inode_t *inode = _path_lookup(path);
+    if (inode == NULL)
+        return false;
+
+    inode_stat(inode, stat);
+    inode_put(inode);
+    return true;
+}
+
+
+/**
+ * Read out up to COUNT valid entries of an open directory into BUF, from
+ * its current offset on, a whole directory block at a time. The offset
+ * advances past the entries read. If FLAGS has GETDENTS_STAT, also fills
+ * in the stat of every entry, so that listing a directory needs no path
+ * walk nor open per file. Returns the number of entries filled, 0 at the
+ * end of directory, or -1 on failure.
+ */
+int32_t
+filesys_getdents(int8_t fd, dir_entry_t *buf, size_t count, uint32_t flags)
+{
+    file_t *file = _find_process_file(fd);
+    if (file == NULL) {
+        warn("getdents: cannot find file for fd %d", fd);
+        return -1;
+    }
+
+    if (!file->readable) {
+        warn("getdents: file for fd %d is not readable", fd);
+        return -1;
+    }
+
+    mem_inode_t *dir_inode = file->inode;
+    inode_lock(dir_inode);
+
+    if (dir_inode->d_inode.type != INODE_TYPE_DIR) {
+        warn("getdents: file for fd %d is not a directory", fd);
+        inode_unlock(dir_inode);
+        return -1;
+    }
+
+    uint32_t num = dir_inode->d_inode.size / sizeof(dentry_t);
+    uint32_t idx = (file->offset + sizeof(dentry_t) - 1) / sizeof(dentry_t);
+    size_t filled = 0;
+
+    while (idx < num && filled < count) {
+        uint32_t block = idx / DENTRIES_PB;
+
+        /** Entries are about to be stat'ed, start reading their inodes. */
+        if ((flags & GETDENTS_STAT) != 0)
+            inode_dir_prefetch(dir_inode, block);
+
+        block_request_t *dbuf = inode_block_get(dir_inode, block);
+        if (dbuf == NULL) {
+            warn("getdents: failed to read directory block %u", block);
+            break;
+        }
+
+        dentry_t *dentries = (dentry_t *) dbuf->data;
+        uint32_t end = (block + 1) * DENTRIES_PB;
+        if (end > num)
+            end = num;
+        for (; idx < end && filled < count; ++idx) {
+            dentry_t *dentry = &dentries[idx % DENTRIES_PB];
+            if (dentry->valid == 0)
+                continue;
+
+            dir_entry_t *entry = &buf[filled++];
+            memset(&(entry->stat), 0, sizeof(file_stat_t));
+            entry->stat.inumber = dentry->inumber;
+            strncpy(entry->filename, dentry->filename, MAX_FILENAME);
+            entry->filename[MAX_FILENAME - 1] = '\0';
+        }
+        block_put(dbuf);
+    }
+
+    if (filled == 0 && idx < num) {     /** Failed before getting any. */
+        inode_unlock(dir_inode);
+        return -1;
+    }
+    file->offset = idx * sizeof(dentry_t);
+    inode_unlock(dir_inode);
+
+    /**
+     * Stat entries after unlocking the directory, as locking its parent
+     * ('..') while holding it could deadlock with a path walk.
+     */
+    if ((flags & GETDENTS_STAT) != 0) {
+        for (size_t i = 0; i < filled; ++i) {
+            mem_inode_t *inode = inode_get(buf[i].stat.inumber);
+            if (inode == NULL) {
+                warn("getdents: failed to get inode %u", buf[i].stat.inumber);
+                continue;
+            }
+            inode_stat(inode, &(buf[i].stat));
+            inode_put(inode);
+        }
+    }
+
+    return filled;
+}
+
 
 /** Seek to absolute file offset. */
 bool
@@ -703,19 +1080,157 @@ filesys_seek(int8_t fd, size_t offset)
 }
 
 
-/** Flush the in-memory modified bitmap block to disk. */
+/**
+ * Commit the running journal transaction and write back all dirty data
+ * blocks to disk.
+ */
 bool
-inode_bitmap_update(uint32_t slot_no)
+filesys_sync(void)
 {
-    return block_write((char *) &(inode_bitmap.bits[slot_no]),
-                       superblock.inode_bitmap_start * BLOCK_SIZE + slot_no, 1);
+    bool success = journal_commit();
+    if (!block_flush_all())
+        success = false;
+    return success;
 }
 
+/**
+ * Write back dirty blocks of an open file to disk. Cached blocks do not
+ * record which file they belong to, and its metadata is committed along
+ * with the whole running transaction anyway, so this does the same as
+ * `sync()`.
+ */
 bool
+filesys_fsync(int8_t fd)
+{
+    file_t *file = _find_process_file(fd);
+    if (file == NULL) {
+        warn("fsync: cannot find file for fd %d", fd);
+        return false;
+    }
+
+    return filesys_sync();
+}
+
+
+/** Mark the bitmap block holding a modified slot dirty. */
+static void
+_bitmap_mark_dirty(bitmap_t *bitmap, bool *dirty, uint32_t slot_no)
+{
+    spinlock_acquire(&(bitmap->lock));
+    dirty[BITMAP_OUTER_IDX(slot_no) / BLOCK_SIZE] = true;
+    spinlock_release(&(bitmap->lock));
+}
+
+void
+inode_bitmap_update(uint32_t slot_no)
+{
+    _bitmap_mark_dirty(&inode_bitmap, inode_bitmap_dirty, slot_no);
+}
+
+void
 data_bitmap_update(uint32_t slot_no)
 {
-    return block_write((char *) &(data_bitmap.bits[slot_no]),
-                       superblock.data_bitmap_start * BLOCK_SIZE + slot_no, 1);
+    _bitmap_mark_dirty(&data_bitmap, data_bitmap_dirty, slot_no);
+}
+
+/**
+ * Disk block holding the I-th block of an in-memory bitmap, whose slice
+ * in each group is PER_GROUP blocks long and starts OFFSET blocks into
+ * the group.
+ */
+static uint32_t
+_bitmap_disk_block(uint32_t i, uint32_t per_group, uint32_t offset)
+{
+    return GROUP_START(i / per_group) + offset + i % per_group;
+}
+
+/** Helper for listing the dirty blocks of one bitmap. */
+static uint32_t
+_bitmap_dirty_blocks(bitmap_t *bitmap, bool *dirty, uint32_t per_group,
+                     uint32_t offset, uint32_t *block_nos, uint8_t **srcs,
+                     uint32_t max)
+{
+    uint32_t num_blocks = bitmap->slots / BITMAP_BITS_PB;
+    uint32_t num = 0;
+
+    spinlock_acquire(&(bitmap->lock));
+    for (uint32_t i = 0; i < num_blocks && num < max; ++i) {
+        if (dirty[i]) {
+            block_nos[num] = _bitmap_disk_block(i, per_group, offset);
+            srcs[num] = bitmap->bits + i * BLOCK_SIZE;
+            num++;
+        }
+    }
+    spinlock_release(&(bitmap->lock));
+
+    return num;
+}
+
+/**
+ * List the dirty bitmap blocks, at most MAX of them, filling their block
+ * numbers into BLOCK_NOS and their in-memory contents into SRCS. Returns
+ * the number of blocks listed. Used by the journal when committing.
+ */
+uint32_t
+bitmaps_dirty_blocks(uint32_t *block_nos, uint8_t **srcs, uint32_t max)
+{
+    uint32_t num = _bitmap_dirty_blocks(&inode_bitmap, inode_bitmap_dirty,
+                                        GROUP_IBITMAP_BLOCKS, 0,
+                                        block_nos, srcs, max);
+    num += _bitmap_dirty_blocks(&data_bitmap, data_bitmap_dirty,
+                                GROUP_DBITMAP_BLOCKS, GROUP_IBITMAP_BLOCKS,
+                                block_nos + num, srcs + num, max - num);
+    return num;
+}
+
+/** Clear all dirty marks, after the journal has installed the blocks. */
+void
+bitmaps_clean(void)
+{
+    spinlock_acquire(&(inode_bitmap.lock));
+    memset(inode_bitmap_dirty, 0,
+           (inode_bitmap.slots / BITMAP_BITS_PB) * sizeof(bool));
+    spinlock_release(&(inode_bitmap.lock));
+
+    spinlock_acquire(&(data_bitmap.lock));
+    memset(data_bitmap_dirty, 0,
+           (data_bitmap.slots / BITMAP_BITS_PB) * sizeof(bool));
+    spinlock_release(&(data_bitmap.lock));
+}
+
+
+/**
+ * Set up the in-memory copy of a bitmap of SLOTS slots, whose slice in
+ * each group is PER_GROUP blocks long and starts OFFSET blocks into the
+ * group, and read it in from disk. The copy is dword-aligned, so that
+ * blocks can be written back directly from it.
+ */
+static bool
+_bitmap_load(bitmap_t *bitmap, bool **dirty, uint32_t per_group,
+             uint32_t offset, uint32_t slots)
+{
+    uint32_t num_blocks = slots / BITMAP_BITS_PB;
+
+    uint8_t *bits = (uint8_t *) kalloc(num_blocks * BLOCK_SIZE + 3);
+    uint16_t *region_free = (uint16_t *)
+        kalloc(BITMAP_NUM_REGIONS(slots) * sizeof(uint16_t));
+    *dirty = (bool *) kalloc(num_blocks * sizeof(bool));
+    if (bits == NULL || region_free == NULL || *dirty == NULL)
+        return false;
+    bits = (uint8_t *) (((uint32_t) bits + 3) & ~0x3);
+    memset(bits, 0, num_blocks * BLOCK_SIZE);
+    memset(*dirty, 0, num_blocks * sizeof(bool));
+
+    bitmap_init(bitmap, bits, region_free, slots);
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+        uint32_t block_no = _bitmap_disk_block(i, per_group, offset);
+        if (!block_read_at_boot((char *) (bits + i * BLOCK_SIZE),
+                                block_no * BLOCK_SIZE, BLOCK_SIZE)) {
+            return false;
+        }
+    }
+    bitmap_rebuild(bitmap);
+    return true;
 }
 
 
@@ -731,41 +1246,55 @@ filesys_init(void)
         error("filesys_init: failed to read superblock from disk");
 
     /**
-     * Currently the VSFS layout is hard-defined, so just do asserts here
-     * to ensure that the mkfs script followed the expected layout. In real
-     * systems, mkfs should have the flexibility to generate FS image as
-     * long as the layout is valid, and we read out the actual layout here.
+     * The geometry is generated by mkfs, so sanity check it here. The
+     * per-group bitmap slices must span whole blocks, and all bitmap
+     * blocks must fit in one journal transaction alongside the logged
+     * metadata blocks.
      */
-    assert(superblock.fs_blocks == 262144);
-    assert(superblock.inode_bitmap_start == 1);
-    assert(superblock.inode_bitmap_blocks == 6);
-    assert(superblock.data_bitmap_start == 7);
-    assert(superblock.data_bitmap_blocks == 32);
-    assert(superblock.inode_start == 39);
-    assert(superblock.inode_blocks == 6105);
-    assert(superblock.data_start == 6144);
-    assert(superblock.data_blocks == 256000);
+    assert(superblock.log_start == 1);
+    assert(superblock.log_blocks > JOURNAL_LOG_MAX);
+    assert(superblock.data_start == superblock.log_start + superblock.log_blocks);
+    assert(superblock.num_groups > 0);
+    assert(superblock.group_blocks % BITMAP_BITS_PB == 0);
+    assert(superblock.group_inodes % BITMAP_BITS_PB == 0);
+    assert(superblock.data_blocks
+           == superblock.num_groups * superblock.group_blocks);
+    assert(superblock.fs_blocks > GROUP_DATA_START(superblock.num_groups - 1));
+    assert(superblock.fs_blocks <= superblock.data_start + superblock.data_blocks);
+    assert(superblock.num_groups * (GROUP_IBITMAP_BLOCKS + GROUP_DBITMAP_BLOCKS)
+           + JOURNAL_TXN_MAX_BLOCKS <= JOURNAL_LOG_MAX);
+
+    /** Directory index slots must overlay dentries exactly. */
+    assert(sizeof(dx_slot_t) == sizeof(dentry_t));
+
+    /** Replay the journal before reading anything it might update. */
+    journal_init();
 
     /** Read in the two bitmaps into memory. */
-    uint32_t num_inodes = superblock.inode_blocks * (BLOCK_SIZE / INODE_SIZE);
-    uint8_t *inode_bits = (uint8_t *) kalloc(num_inodes / 8);
-    bitmap_init(&inode_bitmap, inode_bits, num_inodes);
-    if (!block_read_at_boot((char *) inode_bitmap.bits,
-                            superblock.inode_bitmap_start * BLOCK_SIZE,
-                            num_inodes / 8)) {
+    uint32_t num_inodes = superblock.num_groups * superblock.group_inodes;
+    if (!_bitmap_load(&inode_bitmap, &inode_bitmap_dirty,
+                      GROUP_IBITMAP_BLOCKS, 0, num_inodes)) {
         error("filesys_init: failed to read inode bitmap from disk");
     }
 
     uint32_t num_dblocks = superblock.data_blocks;
-    uint8_t *data_bits = (uint8_t *) kalloc(num_dblocks / 8);
-    bitmap_init(&data_bitmap, data_bits, num_dblocks);
-    if (!block_read_at_boot((char *) data_bitmap.bits,
-                            superblock.data_bitmap_start * BLOCK_SIZE,
-                            num_dblocks / 8)) {
+    if (!_bitmap_load(&data_bitmap, &data_bitmap_dirty,
+                      GROUP_DBITMAP_BLOCKS, GROUP_IBITMAP_BLOCKS,
+                      num_dblocks)) {
         error("filesys_init: failed to read data bitmap from disk");
     }
 
-    /** Fill open file table and inode table with empty slots. */
+    /** Never hand out blocks past the end of disk in the last group. */
+    for (uint32_t d = superblock.fs_blocks - superblock.data_start;
+         d < num_dblocks; ++d) {
+        bitmap_set(&data_bitmap, d);
+    }
+
+
+    /** Set up the block buffer cache. */
+    block_cache_init(BLOCK_CACHE_BUFS);
+
+    /** Fill open file table with empty slots. */
     for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
         ftable[i].ref_cnt = 0;      /** Indicates UNUSED. */
         ftable[i].readable = false;
@@ -775,10 +1304,12 @@ filesys_init(void)
     }
     spinlock_init(&ftable_lock, "ftable_lock");
 
-    for (size_t i = 0; i < MAX_MEM_INODES; ++i) {
-        icache[i].ref_cnt = 0;      /** Indicates UNUSED. */
-        icache[i].inumber = 0;
-        parklock_init(&(icache[i].lock), "inode's parklock");
-    }
-    spinlock_init(&icache_lock, "icache_lock");
+    /** Set up the inode cache. */
+    inode_cache_init(ICACHE_SIZE);
+
+    /** Set up the page cache of file data. */
+    pcache_init(PCACHE_MAX_PAGES);
+
+    /** Start with an empty dentry cache. */
+    dcache_init();
 }
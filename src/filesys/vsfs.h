@@ -13,6 +13,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "block.h"
 #include "sysfile.h"
 
 #include "../common/bitmap.h"
@@ -26,29 +27,41 @@
  * VSFS of Hux has the following on-disk layout:
  * 
  *   - Block 0 is the superblock holding meta information of the FS;
- *   - Block 1~6 are the inode slots bitmap;
- *   - Block 7~38 are the data blocks bitmap;
- *   - Blocks 39~6143 (upto 6 MiB offset) are inode blocks;
- *   - All the rest blocks up to 256 MiB are data blocks.
- * 
+ *   - Blocks 1~LOG_BLOCKS are the metadata journal;
+ *   - All the rest blocks are split into block groups of GROUP_BLOCKS
+ *     blocks each (the last one may be cut short by the end of disk).
+ *
+ * Each block group holds, in order:
+ *   - its slice of the inode slots bitmap, for GROUP_INODES inodes;
+ *   - its slice of the data blocks bitmap, one bit for every block of
+ *     the group, where its own metadata blocks (and blocks past the end
+ *     of disk) are always marked in use;
+ *   - its inode blocks;
+ *   - its data blocks.
+ * Keeping inodes, data and the bitmaps that govern them together in a
+ * group keeps the seeks within a file short.
+ *
+ * Inode i lives in group i / GROUP_INODES. Data bitmap slot d is block
+ * DATA_START + d, so the data bitmap maps linearly onto the groups.
+ * Both per-group bitmap slices span whole blocks, so the in-memory
+ * bitmaps are just the slices concatenated.
+ *
  *   * Block size is 1 KiB = 2 disk sectors
  *   * Inode structure is 128 bytes, so an inode block has 8 slots
- *   * File system size is 256 MiB = 262144 blocks
  *   * Inode 0 is the root path directory "/"
  *
- * The mkfs script builds an initial VSFS disk image which should follow
- * the above description.
+ * The geometry is read from the superblock. The mkfs script builds an
+ * initial VSFS disk image which should follow the above description.
  */
 struct superblock {
-    uint32_t fs_blocks;             /** Should be 262144. */
-    uint32_t inode_bitmap_start;    /** Should be 1. */
-    uint32_t inode_bitmap_blocks;   /** Should be 6. */
-    uint32_t data_bitmap_start;     /** Should be 7. */
-    uint32_t data_bitmap_blocks;    /** Should be 32. */
-    uint32_t inode_start;           /** Should be 39. */
-    uint32_t inode_blocks;          /** Should be 6105. */
-    uint32_t data_start;            /** Should be 6144. */
-    uint32_t data_blocks;           /** Should be 256000. */
+    uint32_t fs_blocks;             /** Total number of blocks on disk. */
+    uint32_t log_start;             /** Should be 1. */
+    uint32_t log_blocks;            /** Journal blocks, including header. */
+    uint32_t data_start;            /** First block of group 0. */
+    uint32_t data_blocks;           /** NUM_GROUPS * GROUP_BLOCKS. */
+    uint32_t num_groups;            /** Number of block groups. */
+    uint32_t group_blocks;          /** Multiple of BITMAP_BITS_PB. */
+    uint32_t group_inodes;          /** Multiple of BITMAP_BITS_PB. */
 } __attribute__((packed));
 typedef struct superblock superblock_t;
 
@@ -73,6 +86,44 @@ extern bitmap_t data_bitmap;
                          + NUM_INDIRECT1 * UINT32_PB         \
                          + NUM_DIRECT)
 
+/**
+ * Alternatively, an inode with INODE_FLAG_EXTENTS set maps its blocks
+ * through an extent tree instead, whose root node sits inline in place
+ * of the block pointers. An extent maps LEN logical blocks from LSTART
+ * onto consecutive disk blocks from block number PSTART. In an index
+ * node, an entry instead points at the child node in block PSTART that
+ * covers logical blocks from LSTART on, and LEN is unused.
+ *
+ * A node is a header followed by entries sorted by LSTART: the inline
+ * root has room for EXTENTS_INLINE entries, and a node in its own block
+ * for EXTENTS_PB entries. Leaves are at depth 0. Files only grow at the
+ * end, so the tree only grows along its rightmost path.
+ */
+struct extent {
+    uint32_t lstart;    /** First logical block covered. */
+    uint32_t pstart;    /** First disk block, or child node block. */
+    uint32_t len;       /** Number of blocks. */
+};
+typedef struct extent extent_t;
+
+struct extent_header {
+    uint16_t num;       /** Number of entries in use. */
+    uint16_t depth;     /** 0 for a leaf, otherwise an index node. */
+};
+typedef struct extent_header extent_header_t;
+
+#define EXTENTS_INLINE 8
+#define EXTENTS_PB ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t))
+#define EXTENT_MAX_DEPTH 3
+
+/** An extent tree node in its own block. */
+struct extent_node {
+    extent_header_t header;
+    extent_t entries[EXTENTS_PB];
+};
+typedef struct extent_node extent_node_t;
+
+
 /** On-disk inode structure of exactly 128 bytes in size. */
 #define INODE_SIZE 128
 
@@ -80,19 +131,54 @@ extern bitmap_t data_bitmap;
 #define INODE_TYPE_FILE  1
 #define INODE_TYPE_DIR   2
 
+#define INODE_FLAG_EXTENTS   0x1
+#define INODE_FLAG_DIR_INDEX 0x2
+
 struct inode {
     uint32_t type;                  /** 0 = empty, 1 = file, 2 = directory. */
     uint32_t size;                  /** File size in bytes. */
-    uint32_t data0[NUM_DIRECT];     /** Direct blocks. */
-    uint32_t data1[NUM_INDIRECT1];  /** 1-level indirect blocks. */
-    uint32_t data2[NUM_INDIRECT2];  /** 2-level indirect blocks. */
+    union {
+        struct {
+            uint32_t data0[NUM_DIRECT];     /** Direct blocks. */
+            uint32_t data1[NUM_INDIRECT1];  /** 1-level indirect blocks. */
+            uint32_t data2[NUM_INDIRECT2];  /** 2-level indirect blocks. */
+        };
+        struct {
+            extent_header_t ext_header;         /** Extent tree root. */
+            extent_t extents[EXTENTS_INLINE];
+        };
+    };
+    uint32_t flags;                 /** INODE_FLAG_* bits. */
     /** Rest bytes are unused. */
 } __attribute__((packed));
 typedef struct inode inode_t;
 
 
+#define INODES_PB (BLOCK_SIZE / INODE_SIZE)
+
+
+/** Helper macros for locating the parts of a block group. */
+#define BITMAP_BITS_PB (BLOCK_SIZE * 8)
+
+#define GROUP_IBITMAP_BLOCKS (superblock.group_inodes / BITMAP_BITS_PB)
+#define GROUP_DBITMAP_BLOCKS (superblock.group_blocks / BITMAP_BITS_PB)
+#define GROUP_INODE_BLOCKS   (superblock.group_inodes / INODES_PB)
+#define GROUP_META_BLOCKS    (GROUP_IBITMAP_BLOCKS + GROUP_DBITMAP_BLOCKS \
+                              + GROUP_INODE_BLOCKS)
+
+#define GROUP_START(g)         (superblock.data_start + (g) * superblock.group_blocks)
+#define GROUP_IBITMAP_START(g) (GROUP_START(g))
+#define GROUP_DBITMAP_START(g) (GROUP_IBITMAP_START(g) + GROUP_IBITMAP_BLOCKS)
+#define GROUP_INODE_START(g)   (GROUP_DBITMAP_START(g) + GROUP_DBITMAP_BLOCKS)
+#define GROUP_DATA_START(g)    (GROUP_INODE_START(g) + GROUP_INODE_BLOCKS)
+
+#define INODE_GROUP(i)      ((i) / superblock.group_inodes)
+#define DATA_SLOT_GROUP(d)  ((d) / superblock.group_blocks)
+
+
 /** Helper macros for calculating on-disk address. */
-#define DISK_ADDR_INODE(i) (superblock.inode_start * BLOCK_SIZE + (i) * INODE_SIZE)
+#define DISK_ADDR_INODE(i) (GROUP_INODE_START(INODE_GROUP(i)) * BLOCK_SIZE \
+                            + ((i) % superblock.group_inodes) * INODE_SIZE)
 #define DISK_ADDR_DATA_BLOCK(d) ((superblock.data_start + (d)) * BLOCK_SIZE)
 
 
@@ -111,6 +197,45 @@ struct dentry {
 } __attribute__((packed));
 typedef struct dentry dentry_t;
 
+#define DENTRIES_PB (BLOCK_SIZE / DENTRY_SIZE)
+
+
+/**
+ * A directory that outgrows its first block gets a hashed index on top
+ * of its dentries, in the spirit of ext3's htree, marked by the inode
+ * flag INODE_FLAG_DIR_INDEX. The dentries then live in leaf blocks, each
+ * holding the names whose hashes fall in a range. An index node maps the
+ * lowest hash of each range to its block, sorted by hash. The root node
+ * fills block 0 after the '.' and '..' entries. At depth 1, the root
+ * points to index blocks, which in turn point to the leaves.
+ *
+ * Index nodes are made of dentry-sized slots whose VALID field is always
+ * 0, so that a linear scan sees only unused entries in them and still
+ * finds every name in the leaves. The entry count of a node is kept in
+ * its first slot, and the depth in the root's.
+ */
+struct dx_entry {
+    uint32_t hash;      /** Lowest name hash covered. */
+    uint32_t block;     /** Logical block number in the directory. */
+};
+typedef struct dx_entry dx_entry_t;
+
+#define DX_ENTRIES_PER_SLOT ((DENTRY_SIZE - 8) / sizeof(dx_entry_t))
+
+struct dx_slot {
+    uint32_t valid;     /** Always 0. */
+    uint16_t num;       /** Entries in use, in a node's first slot. */
+    uint8_t depth;      /** Index levels below the root, in its first slot. */
+    uint8_t unused;
+    dx_entry_t entries[DX_ENTRIES_PER_SLOT];
+};
+typedef struct dx_slot dx_slot_t;
+
+#define DX_ROOT_SLOTS   (DENTRIES_PB - 2)
+#define DX_ROOT_ENTRIES (DX_ROOT_SLOTS * DX_ENTRIES_PER_SLOT)
+#define DX_NODE_ENTRIES (DENTRIES_PB * DX_ENTRIES_PER_SLOT)
+#define DX_MAX_DEPTH    1
+
 
 void filesys_init();
 
@@ -122,6 +247,10 @@ bool filesys_remove(char *path);
 
 int32_t filesys_read(int8_t fd, char *dst, size_t len);
 int32_t filesys_write(int8_t fd, char *dst, size_t len);
+int32_t filesys_pread(int8_t fd, char *dst, size_t len, uint32_t offset);
+int32_t filesys_pwrite(int8_t fd, char *src, size_t len, uint32_t offset);
+int32_t filesys_readv(int8_t fd, iovec_t *iov, size_t iovcnt);
+int32_t filesys_writev(int8_t fd, iovec_t *iov, size_t iovcnt);
 
 bool filesys_chdir(char *path);
 bool filesys_getcwd(char *buf, size_t limit);
@@ -129,11 +258,21 @@ bool filesys_getcwd(char *buf, size_t limit);
 bool filesys_exec(char *path, char **argv);
 
 bool filesys_fstat(int8_t fd, file_stat_t *stat);
+bool filesys_stat(char *path, file_stat_t *stat);
+
+int32_t filesys_getdents(int8_t fd, dir_entry_t *buf, size_t count,
+                         uint32_t flags);
 
 bool filesys_seek(int8_t fd, size_t offset);
 
-bool inode_bitmap_update(uint32_t slot_no);
-bool data_bitmap_update(uint32_t slot_no);
+bool filesys_sync();
+bool filesys_fsync(int8_t fd);
+
+void inode_bitmap_update(uint32_t slot_no);
+void data_bitmap_update(uint32_t slot_no);
+uint32_t bitmaps_dirty_blocks(uint32_t *block_nos, uint8_t **srcs,
+                              uint32_t max);
+void bitmaps_clean();
 
 
 #endif
@@ -17,6 +17,7 @@
 #include "../interrupt/isr.h"
 
 #include "../memory/sysmem.h"
+#include "../memory/mmap.h"
 
 #include "../process/layout.h"
 #include "../process/process.h"
@@ -49,7 +50,18 @@ static syscall_t syscall_handlers[] = {
     [SYSCALL_EXEC]      syscall_exec,
     [SYSCALL_FSTAT]     syscall_fstat,
     [SYSCALL_SEEK]      syscall_seek,
-    [SYSCALL_SHUTDOWN]  syscall_shutdown
+    [SYSCALL_SHUTDOWN]  syscall_shutdown,
+    [SYSCALL_SYNC]      syscall_sync,
+    [SYSCALL_FSYNC]     syscall_fsync,
+    [SYSCALL_GETDENTS]  syscall_getdents,
+    [SYSCALL_STAT]      syscall_stat,
+    [SYSCALL_PREAD]     syscall_pread,
+    [SYSCALL_PWRITE]    syscall_pwrite,
+    [SYSCALL_READV]     syscall_readv,
+    [SYSCALL_WRITEV]    syscall_writev,
+    [SYSCALL_MMAP]      syscall_mmap,
+    [SYSCALL_MUNMAP]    syscall_munmap,
+    [SYSCALL_MSYNC]     syscall_msync
 };
 
 #define NUM_SYSCALLS ((int32_t) (sizeof(syscall_handlers) / sizeof(syscall_t)))
@@ -110,15 +122,23 @@ sysarg_addr_uint(uint32_t addr, uint32_t *ret)
     return true;
 }
 
+/**
+ * Memory in between the heap and the stack is valid only if it lies in
+ * a file mapping allowing the access, WRITE telling if the kernel is
+ * going to write into it. Its pages get faulted in right away.
+ */
 bool
-sysarg_addr_mem(uint32_t addr, char **mem, size_t len)
+sysarg_addr_mem(uint32_t addr, char **mem, size_t len, bool write)
 {
     process_t *proc = running_proc();
 
-    if (addr >= USER_MAX || addr + len > USER_MAX || addr < USER_BASE
-        || (addr >= proc->heap_high && addr < proc->stack_low)
-        || (addr + len > proc->heap_high && addr + len <= proc->stack_low)
-        || (addr < proc->heap_high && addr + len > proc->heap_high)) {
+    bool invalid = addr >= USER_MAX || addr + len > USER_MAX
+                   || addr < USER_BASE;
+    bool unmapped = (addr >= proc->heap_high && addr < proc->stack_low)
+                    || (addr + len > proc->heap_high
+                        && addr + len <= proc->stack_low)
+                    || (addr < proc->heap_high && addr + len > proc->heap_high);
+    if (invalid || (unmapped && !mmap_fault_in(addr, len, write))) {
         warn("sysarg_addr_mem: invalid mem %p w/ len %d for %s",
              addr, len, proc->name);
         return false;
@@ -183,18 +203,19 @@ sysarg_get_uint(int8_t n, uint32_t *ret)
 
 /**
  * Fetch the n-th (starting from 0-th) 32-bit argument and interpret as
- * a pointer to a bytes array of length `len`. Returns true on success
- * and false if address invalid.
+ * a pointer to a bytes array of length `len`, which the kernel is going
+ * to write into if `write`. Returns true on success and false if address
+ * invalid.
  */
 bool
-sysarg_get_mem(int8_t n, char **mem, size_t len)
+sysarg_get_mem(int8_t n, char **mem, size_t len, bool write)
 {
     uint32_t ptr;
     if (!sysarg_get_int(n, (int32_t *) &ptr)) {
         warn("sysarg_get_mem: inner sysarg_get_int failed");
         return false;
     }
-    return sysarg_addr_mem(ptr, mem, len);
+    return sysarg_addr_mem(ptr, mem, len, write);
 }
 
 /**
@@ -40,6 +40,17 @@
 #define SYSCALL_FSTAT    20
 #define SYSCALL_SEEK     21
 #define SYSCALL_SHUTDOWN 22
+#define SYSCALL_SYNC     23
+#define SYSCALL_FSYNC    24
+#define SYSCALL_GETDENTS 25
+#define SYSCALL_STAT     26
+#define SYSCALL_PREAD    27
+#define SYSCALL_PWRITE   28
+#define SYSCALL_READV    29
+#define SYSCALL_WRITEV   30
+#define SYSCALL_MMAP     31
+#define SYSCALL_MUNMAP   32
+#define SYSCALL_MSYNC    33
 
 
 /**
@@ -99,12 +110,12 @@ void syscall(interrupt_state_t *state);
 
 bool sysarg_addr_int(uint32_t addr, int32_t *ret);
 bool sysarg_addr_uint(uint32_t addr, uint32_t *ret);
-bool sysarg_addr_mem(uint32_t addr, char **mem, size_t len);
+bool sysarg_addr_mem(uint32_t addr, char **mem, size_t len, bool write);
 int32_t sysarg_addr_str(uint32_t addr, char **str);
 
 bool sysarg_get_int(int8_t n, int32_t *ret);
 bool sysarg_get_uint(int8_t n, uint32_t *ret);
-bool sysarg_get_mem(int8_t n, char **mem, size_t len);
+bool sysarg_get_mem(int8_t n, char **mem, size_t len, bool write);
 int32_t sysarg_get_str(int8_t n, char **str);
 
 
@@ -32,6 +32,7 @@
 #include "device/timer.h"
 #include "device/keyboard.h"
 #include "device/idedisk.h"
+#include "device/iosched.h"
 
 #include "filesys/block.h"
 #include "filesys/vsfs.h"
@@ -121,14 +122,17 @@ kernel_main(unsigned long magic, unsigned long addr)
     _init_message("initializing IDE hard disk device driver");
     idedisk_init();
     _init_message_ok();
+    info("disk I/O scheduler policy: %s", iosched_name());
 
     /** Initialize the VSFS file system from disk. */
     _init_message("initializing VSFS file system from disk");
     filesys_init();
     initproc_init();
+    block_flusher_init();
     _init_message_ok();
     info("file system block size: %u KiB", BLOCK_SIZE);
     info("file system image has %u blocks", superblock.fs_blocks);
+    info("block buffer cache holds %u blocks", BLOCK_CACHE_BUFS);
 
     /** Executes `sti`, CPU starts taking in interrupts. */
     asm volatile ( "sti" );
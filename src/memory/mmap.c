@@ -0,0 +1,544 @@
+/**
+ * Memory-mapped files, backed by demand paging.
+ *
+ * Mappings of a process are placed in a fixed region of its address
+ * space, [MMAP_BASE, MMAP_MAX), and are recorded as VMAs in its PCB. No
+ * page of a mapping is present at first; the page fault handler maps it
+ * on first access. Dirty pages of a shared mapping are found through the
+ * dirty bits of their PTEs and written back to the file through the
+ * journal, like `write()` would do.
+ *
+ * Pages are mapped zero-copy: the PTE points to the frame of the page in
+ * the page cache, holding a reference on it. All shared mappings of a
+ * file page (also across fork) thus see the same memory, as does
+ * `read()`. A private mapping maps it read-only, and copies it into a
+ * frame of its own on the first write (copy-on-write). Bytes a shared
+ * mapping writes past the end of file land in the cached page but never
+ * in the file; writeback zeros them again. Pages lying wholly past the
+ * end of file have nothing to cache and get private zeroed frames.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mmap.h"
+#include "paging.h"
+
+#include "../common/debug.h"
+#include "../common/string.h"
+
+#include "../filesys/file.h"
+#include "../filesys/journal.h"
+
+#include "../process/process.h"
+#include "../process/scheduler.h"
+#include "../process/layout.h"
+
+
+/** Find the mapping of PROC containing VADDR. Returns NULL if none. */
+static vma_t *
+_vma_find(process_t *proc, uint32_t vaddr)
+{
+    for (vma_t *vma = proc->vmas; vma < &proc->vmas[MAX_VMAS]; ++vma) {
+        if (vma->used && vaddr >= vma->start && vaddr < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+/** Find an unused VMA slot of PROC. Returns NULL if none. */
+static vma_t *
+_vma_alloc(process_t *proc)
+{
+    for (vma_t *vma = proc->vmas; vma < &proc->vmas[MAX_VMAS]; ++vma) {
+        if (!vma->used)
+            return vma;
+    }
+    return NULL;
+}
+
+/**
+ * Find the lowest free address range of SIZE bytes in the mapping region
+ * of PROC. Returns its start, or 0 if none.
+ */
+static uint32_t
+_vma_place(process_t *proc, uint32_t size)
+{
+    uint32_t start = MMAP_BASE;
+
+    bool moved = true;
+    while (moved) {
+        if (size > MMAP_MAX - start)
+            return 0;
+
+        moved = false;
+        for (vma_t *vma = proc->vmas; vma < &proc->vmas[MAX_VMAS]; ++vma) {
+            if (vma->used && vma->start < start + size && start < vma->end) {
+                start = vma->end;
+                moved = true;
+            }
+        }
+    }
+
+    return start;
+}
+
+/**
+ * Unmap the pages of PROC within [START, END) of a mapping. Page cache
+ * frames get their references put back, private copies get freed. The
+ * caller must flush the TLB if PROC is running.
+ */
+static void
+_vma_unmap(process_t *proc, uint32_t start, uint32_t end)
+{
+    for (uint32_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        pte_t *pte = paging_walk_pgdir(proc->pgdir, vaddr, false);
+        if (pte == NULL || pte->present == 0)
+            continue;
+        if (pcache_frame_put(ENTRY_FRAME_ADDR(*pte))) {
+            pte->present = 0;
+            pte->writable = 0;
+            pte->dirty = 0;
+            pte->frame = 0;
+        }
+    }
+
+    paging_unmap_range(proc->pgdir, start, end);
+}
+
+/**
+ * Write the dirty pages of mapping VMA of PROC within [START, END) back
+ * to the file, and clear their dirty bits. Only the part within the file
+ * size is written, and the bytes of the page past it are zeroed, as the
+ * page cache expects. Does nothing for a private or read-only mapping.
+ * Returns false on failures.
+ */
+static bool
+_vma_writeback(process_t *proc, vma_t *vma, uint32_t start, uint32_t end)
+{
+    if (vma->flags != MMAP_SHARED || (vma->prot & MMAP_PROT_WRITE) == 0)
+        return true;
+
+    mem_inode_t *inode = vma->file->inode;
+    bool success = true, cleaned = false;
+
+    for (uint32_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        pte_t *pte = paging_walk_pgdir(proc->pgdir, vaddr, false);
+        if (pte == NULL || pte->present == 0 || pte->dirty == 0)
+            continue;
+
+        uint32_t file_offset = vma->offset + (vaddr - vma->start);
+        bool written = true;
+
+        if (!journal_begin()) {
+            success = false;
+            continue;
+        }
+        inode_lock(inode);
+
+        uint32_t size = inode->d_inode.size;
+        if (file_offset < size) {
+            uint32_t len = size - file_offset;
+            if (len > PAGE_SIZE)
+                len = PAGE_SIZE;
+            written = inode_write(inode, (char *) ENTRY_FRAME_ADDR(*pte),
+                                  file_offset, len) == len;
+            if (written && len < PAGE_SIZE)
+                memset((char *) ENTRY_FRAME_ADDR(*pte) + len, 0, PAGE_SIZE - len);
+        }
+
+        inode_unlock(inode);
+        journal_end();
+
+        if (!written) {
+            warn("mmap: failed to write back page at %p", vaddr);
+            success = false;
+            continue;
+        }
+        pte->dirty = 0;
+        cleaned = true;
+    }
+
+    /** Flush the TLB, so that later writes set the dirty bits again. */
+    if (cleaned)
+        paging_switch_pgdir(proc->pgdir);
+
+    return success;
+}
+
+
+/**
+ * Map LEN bytes of open file FILE from OFFSET on into the caller's
+ * address space. Returns the start address of the mapping, or 0 on
+ * failure.
+ */
+uint32_t
+mmap_map(file_t *file, uint32_t offset, uint32_t len, uint32_t prot,
+         uint32_t flags)
+{
+    process_t *proc = running_proc();
+
+    if (len == 0 || len > MMAP_MAX - MMAP_BASE) {
+        warn("mmap: invalid length %u", len);
+        return 0;
+    }
+    if (!ADDR_PAGE_ALIGNED(offset)) {
+        warn("mmap: offset %u is not page-aligned", offset);
+        return 0;
+    }
+    if (prot == 0 || (prot & ~(MMAP_PROT_READ | MMAP_PROT_WRITE)) != 0) {
+        warn("mmap: invalid protection bits %u", prot);
+        return 0;
+    }
+    if (flags != MMAP_SHARED && flags != MMAP_PRIVATE) {
+        warn("mmap: flags must be exactly one of shared and private");
+        return 0;
+    }
+
+    if (!file->readable) {
+        warn("mmap: file is not readable");
+        return 0;
+    }
+    if (flags == MMAP_SHARED && (prot & MMAP_PROT_WRITE) != 0
+        && !file->writable) {
+        warn("mmap: shared writable mapping of a file not writable");
+        return 0;
+    }
+
+    inode_lock(file->inode);
+    bool is_file = file->inode->d_inode.type == INODE_TYPE_FILE;
+    inode_unlock(file->inode);
+    if (!is_file) {
+        warn("mmap: can only map regular files");
+        return 0;
+    }
+
+    vma_t *vma = _vma_alloc(proc);
+    if (vma == NULL) {
+        warn("mmap: too many mappings, max %d", MAX_VMAS);
+        return 0;
+    }
+    uint32_t size = ADDR_PAGE_ROUND_UP(len);
+    uint32_t start = _vma_place(proc, size);
+    if (start == 0) {
+        warn("mmap: no free address range of %u bytes", size);
+        return 0;
+    }
+
+    vma->used = true;
+    vma->start = start;
+    vma->end = start + size;
+    vma->prot = prot;
+    vma->flags = flags;
+    vma->file = file;
+    vma->offset = offset;
+    readahead_init(&(vma->ra));
+    file_ref(file);
+
+    return start;
+}
+
+/**
+ * Unmap the pages in [ADDR, ADDR + LEN) of the caller, which must lie in
+ * a single mapping, writing back dirty ones of a shared mapping first.
+ * Unmapping the middle of a mapping splits it in two. Returns false on
+ * failures.
+ */
+bool
+mmap_unmap(uint32_t addr, uint32_t len)
+{
+    process_t *proc = running_proc();
+
+    if (!ADDR_PAGE_ALIGNED(addr) || len == 0 || len > MMAP_MAX - addr) {
+        warn("munmap: invalid range %p of length %u", addr, len);
+        return false;
+    }
+    uint32_t end = ADDR_PAGE_ROUND_UP(addr + len);
+
+    vma_t *vma = _vma_find(proc, addr);
+    if (vma == NULL || end > vma->end) {
+        warn("munmap: range %p - %p not within a mapping", addr, end);
+        return false;
+    }
+
+    vma_t *split = NULL;
+    if (addr > vma->start && end < vma->end) {
+        split = _vma_alloc(proc);
+        if (split == NULL) {
+            warn("munmap: too many mappings to split one, max %d", MAX_VMAS);
+            return false;
+        }
+    }
+
+    bool success = _vma_writeback(proc, vma, addr, end);
+    _vma_unmap(proc, addr, end);
+    paging_switch_pgdir(proc->pgdir);   /** Flush stale TLB entries. */
+
+    if (split != NULL) {
+        *split = *vma;
+        split->start = end;
+        split->offset += end - vma->start;
+        file_ref(split->file);
+        vma->end = addr;
+    } else if (addr == vma->start && end == vma->end) {
+        file_put(vma->file);
+        vma->file = NULL;
+        vma->used = false;
+    } else if (addr == vma->start) {
+        vma->offset += end - vma->start;
+        vma->start = end;
+    } else
+        vma->end = addr;
+
+    return success;
+}
+
+/**
+ * Write back dirty pages of shared mappings of the caller overlapping
+ * [ADDR, ADDR + LEN). Returns false on failures.
+ */
+bool
+mmap_sync(uint32_t addr, uint32_t len)
+{
+    process_t *proc = running_proc();
+
+    if (!ADDR_PAGE_ALIGNED(addr) || len > MMAP_MAX - addr) {
+        warn("msync: invalid range %p of length %u", addr, len);
+        return false;
+    }
+    uint32_t end = ADDR_PAGE_ROUND_UP(addr + len);
+
+    bool success = true;
+    for (vma_t *vma = proc->vmas; vma < &proc->vmas[MAX_VMAS]; ++vma) {
+        if (!vma->used || vma->end <= addr || vma->start >= end)
+            continue;
+
+        uint32_t start = addr > vma->start ? addr : vma->start;
+        uint32_t stop = end < vma->end ? end : vma->end;
+        if (!_vma_writeback(proc, vma, start, stop))
+            success = false;
+    }
+
+    return success;
+}
+
+
+/**
+ * Give the private mapping of PROC at PAGE, which maps a page cache frame
+ * read-only through PTE, a writable copy of its own. Returns false if
+ * out of memory, leaving the mapping as is.
+ */
+static bool
+_vma_copy_on_write(process_t *proc, uint32_t page, pte_t *pte)
+{
+    uint32_t old_paddr = ENTRY_FRAME_ADDR(*pte);
+    pte->present = 0;
+    uint32_t paddr = paging_map_upage(pte, true);
+    if (paddr == 0) {
+        warn("mmap_fault: cannot copy page at %p, out of memory?", page);
+        pte->present = 1;
+        return false;
+    }
+
+    memcpy((char *) paddr, (char *) old_paddr, PAGE_SIZE);
+    pcache_frame_put(old_paddr);
+    paging_switch_pgdir(proc->pgdir);   /** Flush the read-only entry. */
+    return true;
+}
+
+/**
+ * Handle a page fault at VADDR of the caller, if it lies in a mapping that
+ * allows the access. A page not PRESENT gets mapped to its frame in the
+ * page cache, read in from the file if not cached, prefetching ahead if
+ * faults go sequentially; or to a private copy of it if that is not
+ * possible or the private mapping is being written. A write to a page
+ * cache frame mapped by a private mapping makes a copy of it. Returns
+ * false if the fault is not for a mapping or cannot be served.
+ */
+bool
+mmap_fault(uint32_t vaddr, bool present, bool write)
+{
+    process_t *proc = running_proc();
+
+    vma_t *vma = _vma_find(proc, vaddr);
+    if (vma == NULL)
+        return false;
+    if (write && (vma->prot & MMAP_PROT_WRITE) == 0)
+        return false;
+
+    bool writable = (vma->prot & MMAP_PROT_WRITE) != 0;
+    bool private = vma->flags == MMAP_PRIVATE;
+    uint32_t page = ADDR_PAGE_ROUND_DN(vaddr);
+    pte_t *pte = paging_walk_pgdir(proc->pgdir, page, true);
+    if (pte == NULL) {
+        warn("mmap_fault: cannot walk pgdir, out of kheap memory?");
+        return false;
+    }
+
+    if (present) {
+        if (!write || !private || pte->writable)
+            return false;
+        return _vma_copy_on_write(proc, page, pte);
+    }
+
+    mem_inode_t *inode = vma->file->inode;
+    uint32_t file_offset = vma->offset + (page - vma->start);
+
+    inode_lock(inode);
+    uint32_t size = inode->d_inode.size;
+    uint32_t len = 0;
+    if (file_offset < size)
+        len = size - file_offset < PAGE_SIZE ? size - file_offset : PAGE_SIZE;
+    inode_readahead(inode, &(vma->ra), file_offset, len);
+
+    /** Map the page cache frame, keeping the reference got. */
+    if (!(private && write)) {
+        pcache_page_t *cached = inode_page_get(inode, file_offset / PAGE_SIZE);
+        if (cached != NULL) {
+            paging_map_uframe(pte, cached->paddr, writable && !private);
+            inode_unlock(inode);
+            return true;
+        }
+    }
+
+    /** Otherwise, read a private copy, leaving zeros past end of file. */
+    uint32_t paddr = paging_map_upage(pte, writable);
+    if (paddr == 0) {
+        warn("mmap_fault: cannot map new page, out of memory?");
+        inode_unlock(inode);
+        return false;
+    }
+    memset((char *) paddr, 0, PAGE_SIZE);
+    bool success = inode_read(inode, (char *) paddr, file_offset, len) == len;
+    inode_unlock(inode);
+
+    if (!success) {
+        warn("mmap_fault: failed to read in page at %p", page);
+        paging_unmap_range(proc->pgdir, page, page + PAGE_SIZE);
+        return false;
+    }
+
+    pte->dirty = 0;
+    return true;
+}
+
+
+/**
+ * Make sure [ADDR, ADDR + LEN) of the caller lies wholly in one mapping
+ * that allows the access, and fault in its pages, e.g. before the kernel
+ * touches a mapped syscall buffer. If WRITE, the kernel is going to write
+ * into it, so private pages get copied on write first, as kernel writes
+ * ignore read-only PTEs. Returns false if not possible.
+ */
+bool
+mmap_fault_in(uint32_t addr, size_t len, bool write)
+{
+    process_t *proc = running_proc();
+
+    vma_t *vma = _vma_find(proc, addr);
+    if (vma == NULL || len > vma->end - addr)
+        return false;
+    if (write && (vma->prot & MMAP_PROT_WRITE) == 0)
+        return false;
+
+    for (uint32_t vaddr = ADDR_PAGE_ROUND_DN(addr); vaddr < addr + len;
+         vaddr += PAGE_SIZE) {
+        pte_t *pte = paging_walk_pgdir(proc->pgdir, vaddr, false);
+        bool present = pte != NULL && pte->present == 1;
+        if (present && (!write || pte->writable == 1))
+            continue;
+        if (!mmap_fault(vaddr, present, write))
+            return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Copy the mappings of PARENT over to CHILD at fork. Page cache frames
+ * the parent maps are mapped into CHILD the same way, while private
+ * copies get copied. Returns false on failures, in which case CHILD is
+ * left with no mappings.
+ */
+bool
+mmap_copy(process_t *child, process_t *parent)
+{
+    for (size_t i = 0; i < MAX_VMAS; ++i) {
+        child->vmas[i] = parent->vmas[i];
+        if (child->vmas[i].used)
+            file_ref(child->vmas[i].file);
+    }
+
+    bool success = true;
+    for (vma_t *vma = child->vmas; vma < &child->vmas[MAX_VMAS]; ++vma) {
+        if (!vma->used)
+            continue;
+
+        for (uint32_t vaddr = vma->start; vaddr < vma->end && success;
+             vaddr += PAGE_SIZE) {
+            pte_t *src = paging_walk_pgdir(parent->pgdir, vaddr, false);
+            if (src == NULL || src->present == 0)
+                continue;
+            pte_t *dst = paging_walk_pgdir(child->pgdir, vaddr, true);
+            if (dst == NULL) {
+                success = false;
+                break;
+            }
+
+            uint32_t src_paddr = ENTRY_FRAME_ADDR(*src);
+            if (pcache_frame_ref(src_paddr)) {
+                paging_map_uframe(dst, src_paddr, src->writable);
+                continue;
+            }
+            uint32_t paddr = paging_map_upage(dst, src->writable);
+            if (paddr == 0) {
+                success = false;
+                break;
+            }
+            memcpy((char *) paddr, (char *) src_paddr, PAGE_SIZE);
+        }
+        if (!success)
+            break;
+    }
+    if (success)
+        return true;
+
+    warn("mmap_copy: failed to copy mapped pages");
+    for (vma_t *vma = child->vmas; vma < &child->vmas[MAX_VMAS]; ++vma) {
+        if (vma->used) {
+            _vma_unmap(child, vma->start, vma->end);
+            file_put(vma->file);
+            vma->file = NULL;
+            vma->used = false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Unmap all mappings of the caller, writing back dirty pages of shared
+ * ones, e.g. at exit or exec.
+ */
+void
+mmap_release(void)
+{
+    process_t *proc = running_proc();
+
+    bool unmapped = false;
+    for (vma_t *vma = proc->vmas; vma < &proc->vmas[MAX_VMAS]; ++vma) {
+        if (!vma->used)
+            continue;
+
+        _vma_writeback(proc, vma, vma->start, vma->end);
+        _vma_unmap(proc, vma->start, vma->end);
+        file_put(vma->file);
+        vma->file = NULL;
+        vma->used = false;
+        unmapped = true;
+    }
+
+    if (unmapped)
+        paging_switch_pgdir(proc->pgdir);
+}
@@ -0,0 +1,64 @@
+/**
+ * Memory-mapped files, backed by demand paging.
+ */
+
+
+#ifndef MMAP_H
+#define MMAP_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../filesys/file.h"
+
+
+/** Protection & flags for `mmap()`. */
+#define MMAP_PROT_READ  0x1
+#define MMAP_PROT_WRITE 0x2
+
+#define MMAP_SHARED  0x1
+#define MMAP_PRIVATE 0x2
+
+
+/**
+ * A file-backed virtual memory area of a process, mapping [START, END)
+ * to the open file from OFFSET on. Pages are mapped from the page cache
+ * on first access. Changes to a shared mapping are written back to the
+ * file on `munmap()`, `msync()` and exit, while a private mapping copies
+ * a page on write and keeps changes to itself. Mappings never extend the
+ * file; bytes past its end read as zeros and are not written back.
+ */
+struct vma {
+    bool used;
+    uint32_t start;         /** Page-aligned start address. */
+    uint32_t end;           /** Page-aligned end address. */
+    uint32_t prot;          /** MMAP_PROT_* bits. */
+    uint32_t flags;         /** MMAP_SHARED or MMAP_PRIVATE. */
+    file_t *file;           /** Mapped open file, referenced. */
+    uint32_t offset;        /** Page-aligned file offset mapped at START. */
+    readahead_t ra;         /** Readahead state of page faults. */
+};
+typedef struct vma vma_t;
+
+/** Max number of mappings per process. */
+#define MAX_VMAS 8
+
+
+/** Forward declaration, as `process.h` includes this header. */
+struct process;
+
+
+uint32_t mmap_map(file_t *file, uint32_t offset, uint32_t len, uint32_t prot,
+                  uint32_t flags);
+bool mmap_unmap(uint32_t addr, uint32_t len);
+bool mmap_sync(uint32_t addr, uint32_t len);
+
+bool mmap_fault(uint32_t vaddr, bool present, bool write);
+bool mmap_fault_in(uint32_t addr, size_t len, bool write);
+
+bool mmap_copy(struct process *child, struct process *parent);
+void mmap_release(void);
+
+
+#endif
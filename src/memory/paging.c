@@ -16,7 +16,10 @@
 
 #include "../interrupt/isr.h"
 
+#include "../filesys/pcache.h"
+
 #include "../memory/slabs.h"
+#include "../memory/mmap.h"
 
 #include "../process/process.h"
 #include "../process/scheduler.h"
@@ -159,7 +162,8 @@ paging_destroy_pgdir(pde_t *pgdir)
 
 /**
  * Find a free frame and map a user page (given by a pointer to its PTE)
- * into physical memory. Returns the physical address allocated, or 0 if
+ * into physical memory. If frames run out, clean pages of the page cache
+ * are reclaimed for it. Returns the physical address allocated, or 0 if
  * memory allocation failed.
  */
 uint32_t
@@ -171,6 +175,8 @@ paging_map_upage(pte_t *pte, bool writable)
     }
 
     uint32_t frame_num = bitmap_alloc(&frame_bitmap);
+    if (frame_num == NUM_FRAMES && pcache_reclaim(PCACHE_RECLAIM_PAGES) > 0)
+        frame_num = bitmap_alloc(&frame_bitmap);
     if (frame_num == NUM_FRAMES)
         return 0;
 
@@ -182,6 +188,101 @@ paging_map_upage(pte_t *pte, bool writable)
     return ENTRY_FRAME_ADDR(*pte);
 }
 
+/**
+ * Allocate NUM physically contiguous frames, the first one aligned to
+ * ALIGN frames, e.g. for DMA buffers or large pages. Returns the physical
+ * address of the first frame, or 0 if no such free range.
+ */
+uint32_t
+paging_alloc_frames(uint32_t num, uint32_t align)
+{
+    uint32_t frame_num = bitmap_alloc_range(&frame_bitmap, num, align,
+                                            BITMAP_NO_HINT);
+    if (frame_num == NUM_FRAMES)
+        return 0;
+
+    return frame_num * PAGE_SIZE;
+}
+
+/** Free NUM contiguous frames got from `paging_alloc_frames()`. */
+void
+paging_free_frames(uint32_t paddr, uint32_t num)
+{
+    bitmap_clear_range(&frame_bitmap, ADDR_PAGE_NUMBER(paddr), num);
+}
+
+/** Number of free frames, telling how much memory pressure there is. */
+uint32_t
+paging_num_free_frames(void)
+{
+    return bitmap_num_free(&frame_bitmap);
+}
+
+/**
+ * Map all pages within a virtual address range of a user page directory
+ * to newly allocated zeroed frames. The range is backed by physically
+ * contiguous frames if such a run is free, otherwise by frames found one
+ * at a time. Returns false if memory allocation failed, in which case
+ * nothing in the range is left mapped. The range must not be mapped.
+ */
+bool
+paging_map_urange(pde_t *pgdir, uint32_t va_start, uint32_t va_end,
+                  bool writable)
+{
+    va_start = ADDR_PAGE_ROUND_DN(va_start);
+    va_end = ADDR_PAGE_ROUND_UP(va_end);
+    uint32_t num = (va_end - va_start) / PAGE_SIZE;
+    if (num == 0)
+        return true;
+
+    uint32_t run_paddr = paging_alloc_frames(num, 1);
+
+    for (uint32_t i = 0; i < num; ++i) {
+        uint32_t vaddr = va_start + i * PAGE_SIZE;
+        pte_t *pte = paging_walk_pgdir(pgdir, vaddr, true);
+        uint32_t paddr = 0;
+        if (pte != NULL && run_paddr != 0) {
+            pte->present = 1;
+            pte->writable = writable ? 1 : 0;
+            pte->user = 1;
+            pte->frame = ADDR_PAGE_NUMBER(run_paddr) + i;
+            paddr = ENTRY_FRAME_ADDR(*pte);
+        } else if (pte != NULL) {
+            paddr = paging_map_upage(pte, writable);
+        }
+
+        if (paddr == 0) {
+            paging_unmap_range(pgdir, va_start, vaddr);
+            if (run_paddr != 0)
+                paging_free_frames(run_paddr + i * PAGE_SIZE, num - i);
+            return false;
+        }
+        memset((char *) paddr, 0, PAGE_SIZE);
+    }
+
+    return true;
+}
+
+/**
+ * Map an existing frame at PADDR, owned by someone else (e.g. the page
+ * cache), to the user PTE. It must be unmapped by clearing the PTE, not
+ * by `paging_unmap_range()` which would free the frame.
+ */
+void
+paging_map_uframe(pte_t *pte, uint32_t paddr, bool writable)
+{
+    if (pte->present == 1) {
+        error("map_uframe: page re-mapping detected");
+        return;
+    }
+
+    pte->present = 1;
+    pte->writable = writable ? 1 : 0;
+    pte->user = 1;
+    pte->dirty = 0;
+    pte->frame = ADDR_PAGE_NUMBER(paddr);
+}
+
 /** Map a lower-half kernel page to the user PTE. */
 void
 paging_map_kpage(pte_t *pte, uint32_t paddr)
@@ -371,6 +472,10 @@ page_fault_handler(interrupt_state_t *state)
         return;
     }
 
+    /** First access to a page of a file mapping, or copy-on-write. */
+    if (user && mmap_fault(faulty_addr, present, write))
+        return;
+
     /** Other page faults are considered truly harmful. */
     info("Caught page fault {\n"
          "  faulty addr = %p\n"
@@ -393,8 +498,11 @@ paging_init(void)
      * The frame bitmap also needs space, so allocate space for it in
      * our kernel heap. Clear it to zeros.
      */
-    uint8_t *frame_bits = (uint8_t *) _kalloc_temp(NUM_FRAMES / 8, false);
-    bitmap_init(&frame_bitmap, frame_bits, NUM_FRAMES);
+    uint8_t *frame_bits = (uint8_t *)
+        _kalloc_temp(BITMAP_BITS_SIZE(NUM_FRAMES), false);
+    uint16_t *frame_regions = (uint16_t *)
+        _kalloc_temp(BITMAP_NUM_REGIONS(NUM_FRAMES) * sizeof(uint16_t), false);
+    bitmap_init(&frame_bitmap, frame_bits, frame_regions, NUM_FRAMES);
 
     /**
      * Allocate the one-page space for the kernel's page directory in
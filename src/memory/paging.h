@@ -94,7 +94,14 @@ pte_t *paging_walk_pgdir(pde_t *pgdir, uint32_t vaddr, bool alloc);
 pte_t *paging_walk_pgdir_at_boot(pde_t *pgdir, uint32_t vaddr, bool alloc);
 void paging_destroy_pgdir(pde_t *pgdir);
 
+uint32_t paging_alloc_frames(uint32_t num, uint32_t align);
+void paging_free_frames(uint32_t paddr, uint32_t num);
+uint32_t paging_num_free_frames();
+
 uint32_t paging_map_upage(pte_t *pte, bool writable);
+bool paging_map_urange(pde_t *pgdir, uint32_t va_start, uint32_t va_end,
+                       bool writable);
+void paging_map_uframe(pte_t *pte, uint32_t paddr, bool writable);
 void paging_map_kpage(pte_t *pte, uint32_t paddr);
 void paging_unmap_range(pde_t *pgdir, uint32_t va_start, uint32_t va_end);
 bool paging_copy_range(pde_t *dstdir, pde_t *srcdir, uint32_t va_start,
@@ -7,6 +7,7 @@
 
 #include "sysmem.h"
 #include "paging.h"
+#include "mmap.h"
 
 #include "../common/debug.h"
 #include "../common/string.h"
@@ -14,6 +15,7 @@
 #include "../interrupt/syscall.h"
 
 #include "../process/scheduler.h"
+#include "../process/layout.h"
 
 
 /** int32_t setheap(uint32_t new_top); */
@@ -33,6 +35,10 @@ syscall_setheap(void)
         warn("setheap: heap meets stack, heap overflow");
         return SYS_FAIL_RC;
     }
+    if (new_top > MMAP_BASE) {
+        warn("setheap: heap meets file mappings, heap overflow");
+        return SYS_FAIL_RC;
+    }
 
     /**
      * Compare with current heap page allocation top. If exceeds the top
@@ -40,24 +46,75 @@ syscall_setheap(void)
      */
     uint32_t heap_page_high = ADDR_PAGE_ROUND_UP(proc->heap_high);
 
-    for (uint32_t vaddr = heap_page_high;
-         vaddr < new_top;
-         vaddr += PAGE_SIZE) {
-        pte_t *pte = paging_walk_pgdir(proc->pgdir, vaddr, true);
-        if (pte == NULL) {
-            warn("setheap: cannot walk pgdir, out of kheap memory?");
-            paging_unmap_range(proc->pgdir, heap_page_high, vaddr);
-            return SYS_FAIL_RC;
-        }
-        uint32_t paddr = paging_map_upage(pte, true);
-        if (paddr == 0) {
-            warn("setheap: cannot map new page, out of memory?");
-            paging_unmap_range(proc->pgdir, heap_page_high, vaddr);
-            return SYS_FAIL_RC;
-        }
-        memset((char *) paddr, 0, PAGE_SIZE);
+    if (new_top > heap_page_high
+        && !paging_map_urange(proc->pgdir, heap_page_high, new_top, true)) {
+        warn("setheap: cannot map new pages, out of memory?");
+        return SYS_FAIL_RC;
     }
 
     proc->heap_high = new_top;
     return 0;
 }
+
+
+/**
+ * int32_t mmap(int32_t fd, uint32_t offset, uint32_t len, uint32_t prot,
+ *              uint32_t flags);
+ */
+int32_t
+syscall_mmap(void)
+{
+    process_t *proc = running_proc();
+    int32_t fd;
+    uint32_t offset, len, prot, flags;
+
+    if (!sysarg_get_int(0, &fd))
+        return SYS_FAIL_RC;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROC || proc->files[fd] == NULL)
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(1, &offset))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(2, &len))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(3, &prot))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(4, &flags))
+        return SYS_FAIL_RC;
+
+    uint32_t addr = mmap_map(proc->files[fd], offset, len, prot, flags);
+    if (addr == 0)
+        return SYS_FAIL_RC;
+    return addr;
+}
+
+/** int32_t munmap(uint32_t addr, uint32_t len); */
+int32_t
+syscall_munmap(void)
+{
+    uint32_t addr, len;
+
+    if (!sysarg_get_uint(0, &addr))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(1, &len))
+        return SYS_FAIL_RC;
+
+    if (!mmap_unmap(addr, len))
+        return SYS_FAIL_RC;
+    return 0;
+}
+
+/** int32_t msync(uint32_t addr, uint32_t len); */
+int32_t
+syscall_msync(void)
+{
+    uint32_t addr, len;
+
+    if (!sysarg_get_uint(0, &addr))
+        return SYS_FAIL_RC;
+    if (!sysarg_get_uint(1, &len))
+        return SYS_FAIL_RC;
+
+    if (!mmap_sync(addr, len))
+        return SYS_FAIL_RC;
+    return 0;
+}
@@ -11,6 +11,9 @@
 
 
 int32_t syscall_setheap();
+int32_t syscall_mmap();
+int32_t syscall_munmap();
+int32_t syscall_msync();
 
 
 #endif
@@ -11,6 +11,9 @@
  *     `0x20000000` (and takes the size of at most 1MiB)
  *     
  *   - The stack begins at the top-most page (`0x40000000`), grows downwards
+ *
+ *   - File mappings of `mmap()` are placed in a 256MiB region right below
+ *     the max stack size limit
  *   
  *   - The region in-between is usable by the process heap, growing upwards
  */
@@ -39,5 +42,9 @@
 /** Max stack size limit is 4MiB. */
 #define STACK_MIN (USER_MAX - 0x00400000)
 
+/** Region of file mappings, which the heap must not grow into. */
+#define MMAP_MAX  STACK_MIN
+#define MMAP_BASE (MMAP_MAX - 0x10000000)
+
 
 #endif
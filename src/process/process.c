@@ -96,10 +96,12 @@ _alloc_new_process(void)
     proc->block_on = NOTHING;
     proc->pid = next_pid++;
     proc->target_tick = 0;
-    proc->wait_req  = NULL;
+    proc->wait_batch = NULL;
     proc->wait_lock = NULL;
     for (size_t i = 0; i < MAX_FILES_PER_PROC; ++i)
         proc->files[i] = NULL;
+    for (size_t i = 0; i < MAX_VMAS; ++i)
+        proc->vmas[i].used = false;
 
     spinlock_release(&ptable_lock);
 
@@ -238,6 +240,44 @@ initproc_init(void)
 }
 
 
+/**
+ * Create a kernel thread named NAME that runs ENTRY in kernel mode and
+ * never returns to user mode. It lives in the kernel page directory, has
+ * no parent, and should never return from ENTRY. Returns the thread, or
+ * NULL if failed.
+ */
+process_t *
+kthread_create(const char *name, void (*entry)(void))
+{
+    process_t *proc = _alloc_new_process();
+    if (proc == NULL) {
+        warn("kthread_create: failed to allocate new process");
+        return NULL;
+    }
+    strncpy(proc->name, name, sizeof(proc->name) - 1);
+    proc->parent = NULL;
+    proc->pgdir = kernel_pgdir;
+    proc->stack_low = 0;
+    proc->heap_high = 0;
+    proc->timeslice = 1;
+    proc->cwd = NULL;
+
+    /**
+     * Make `_new_process_entry()` return into ENTRY instead of the
+     * return-from-trap snippet. The trap state is left unused.
+     */
+    *(uint32_t *) (proc->context + 1) = (uint32_t) entry;
+
+    proc->killed = false;
+
+    spinlock_acquire(&ptable_lock);
+    proc->state = READY;
+    spinlock_release(&ptable_lock);
+
+    return proc;
+}
+
+
 /**
  * Fork a new process that is a duplicate of the caller process. Caller
  * is the parent process and the new one is the child process. Scheduling
@@ -298,7 +338,8 @@ process_fork(uint8_t timeslice)
     if (!paging_copy_range(child->pgdir, parent->pgdir,
                            USER_BASE, parent->heap_high)
         || !paging_copy_range(child->pgdir, parent->pgdir,
-                              parent->stack_low, USER_MAX)) {
+                              parent->stack_low, USER_MAX)
+        || !mmap_copy(child, parent)) {
         warn("fork: failed to copy parent memory state over to child");
         paging_unmap_range(child->pgdir, USER_BASE, parent->heap_high);
         paging_unmap_range(child->pgdir, parent->stack_low, USER_MAX);
@@ -401,6 +442,9 @@ process_exit(void)
     process_t *proc = running_proc();
     assert(proc != initproc);
 
+    /** Unmap file mappings, writing back shared ones. */
+    mmap_release();
+
     /** Close all open files. */
     for (size_t i = 0; i < MAX_FILES_PER_PROC; ++i) {
         if (proc->files[i] != NULL) {
@@ -16,6 +16,7 @@
 #include "../interrupt/isr.h"
 
 #include "../memory/paging.h"
+#include "../memory/mmap.h"
 
 #include "../filesys/block.h"
 #include "../filesys/file.h"
@@ -52,7 +53,8 @@ enum process_block_on {
     ON_WAIT,
     ON_KBDIN,
     ON_IDEDISK,
-    ON_LOCK
+    ON_LOCK,
+    ON_JOURNAL
 };
 typedef enum process_block_on process_block_on_t;
 
@@ -83,10 +85,11 @@ struct process {
     bool killed;                        /** True if should exit. */
     uint8_t timeslice;                  /** Timeslice length for scheduling. */
     uint32_t target_tick;               /** Target wake up timer tick. */
-    block_request_t *wait_req;          /** Waiting on this block request. */
+    block_batch_t *wait_batch;          /** Waiting on this block I/O batch. */
     parklock_t *wait_lock;              /** Waiting on this parking lock. */
     file_t *files[MAX_FILES_PER_PROC];  /** File descriptor -> open file. */
     mem_inode_t *cwd;                   /** Current working directory. */
+    vma_t vmas[MAX_VMAS];               /** File mappings. */
 };
 typedef struct process process_t;
 
@@ -100,6 +103,7 @@ extern process_t *initproc;
 
 void process_init();
 void initproc_init();
+process_t *kthread_create(const char *name, void (*entry)(void));
 
 void process_block(process_block_on_t reason);
 void process_unblock(process_t *proc);
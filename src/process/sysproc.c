@@ -15,6 +15,8 @@
 
 #include "../interrupt/syscall.h"
 
+#include "../filesys/vsfs.h"
+
 #include "../process/process.h"
 #include "../process/scheduler.h"
 
@@ -92,6 +94,9 @@ syscall_kill(void)
 int32_t
 syscall_shutdown(void)
 {
+    /** Commit the journal and write back dirty blocks before powering off. */
+    filesys_sync();
+
     /**
      * QEMU-specific!
      * Magic shutdown value of QEMU's default ACPI method.
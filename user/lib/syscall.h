@@ -47,6 +47,33 @@ struct dentry {
 } __attribute__((packed));
 typedef struct dentry dentry_t;
 
+/** Struct & flags for `getdents()`, see `sysfile.h`. */
+#define GETDENTS_STAT 0x1
+
+#define MAX_GETDENTS_COUNT 256
+
+struct dir_entry {
+    file_stat_t stat;
+    char filename[MAX_FILENAME];
+};
+typedef struct dir_entry dir_entry_t;
+
+/** Struct for `readv()` & `writev()`, see `sysfile.h`. */
+#define MAX_IOVECS 16
+
+struct iovec {
+    char *base;
+    uint32_t len;
+};
+typedef struct iovec iovec_t;
+
+/** Protection & flags for `mmap()`, see `mmap.h`. */
+#define MMAP_PROT_READ  0x1
+#define MMAP_PROT_WRITE 0x2
+
+#define MMAP_SHARED  0x1
+#define MMAP_PRIVATE 0x2
+
 
 /**
  * Externed from ASM `syscall.s`.
@@ -76,6 +103,19 @@ extern int32_t exec(char *path, char **argv);
 extern int32_t fstat(int32_t fd, file_stat_t *stat);
 extern int32_t seek(int32_t fd, uint32_t offset);
 extern void    shutdown();
+extern int32_t sync();
+extern int32_t fsync(int32_t fd);
+extern int32_t getdents(int32_t fd, dir_entry_t *buf, uint32_t count,
+                        uint32_t flags);
+extern int32_t stat(char *path, file_stat_t *stat);
+extern int32_t pread(int32_t fd, char *dst, uint32_t len, uint32_t offset);
+extern int32_t pwrite(int32_t fd, char *src, uint32_t len, uint32_t offset);
+extern int32_t readv(int32_t fd, iovec_t *iov, uint32_t iovcnt);
+extern int32_t writev(int32_t fd, iovec_t *iov, uint32_t iovcnt);
+extern int32_t mmap(int32_t fd, uint32_t offset, uint32_t len, uint32_t prot,
+                    uint32_t flags);
+extern int32_t munmap(uint32_t addr, uint32_t len);
+extern int32_t msync(uint32_t addr, uint32_t len);
 
 
 #endif
@@ -42,3 +42,14 @@ SYSCALL_LIBGEN  exec,     SYSCALL_EXEC
 SYSCALL_LIBGEN  fstat,    SYSCALL_FSTAT
 SYSCALL_LIBGEN  seek,     SYSCALL_SEEK
 SYSCALL_LIBGEN  shutdown, SYSCALL_SHUTDOWN
+SYSCALL_LIBGEN  sync,     SYSCALL_SYNC
+SYSCALL_LIBGEN  fsync,    SYSCALL_FSYNC
+SYSCALL_LIBGEN  getdents, SYSCALL_GETDENTS
+SYSCALL_LIBGEN  stat,     SYSCALL_STAT
+SYSCALL_LIBGEN  pread,    SYSCALL_PREAD
+SYSCALL_LIBGEN  pwrite,   SYSCALL_PWRITE
+SYSCALL_LIBGEN  readv,    SYSCALL_READV
+SYSCALL_LIBGEN  writev,   SYSCALL_WRITEV
+SYSCALL_LIBGEN  mmap,     SYSCALL_MMAP
+SYSCALL_LIBGEN  munmap,   SYSCALL_MUNMAP
+SYSCALL_LIBGEN  msync,    SYSCALL_MSYNC
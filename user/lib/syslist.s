@@ -33,3 +33,14 @@ SYSCALL_EXEC     = 19
 SYSCALL_FSTAT    = 20
 SYSCALL_SEEK     = 21
 SYSCALL_SHUTDOWN = 22
+SYSCALL_SYNC     = 23
+SYSCALL_FSYNC    = 24
+SYSCALL_GETDENTS = 25
+SYSCALL_STAT     = 26
+SYSCALL_PREAD    = 27
+SYSCALL_PWRITE   = 28
+SYSCALL_READV    = 29
+SYSCALL_WRITEV   = 30
+SYSCALL_MMAP     = 31
+SYSCALL_MUNMAP   = 32
+SYSCALL_MSYNC    = 33
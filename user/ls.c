@@ -13,7 +13,8 @@
 #include "lib/string.h"
 
 
-#define CONCAT_BUF_SIZE 300
+/** Number of entries fetched per `getdents()` call. */
+#define DENTS_BATCH 16
 
 
 static char *
@@ -40,65 +41,36 @@ _print_file_stat(char *filename, file_stat_t *stat)
 static void
 _list_directory(char *path)
 {
-    int8_t fd = open(path, OPEN_RD);
-    if (fd < 0) {
-        warn("ls: cannot open path '%s'", path);
-        return;
-    }
-
-    file_stat_t stat;
-    if (fstat(fd, &stat) != 0) {
+    file_stat_t stat_buf;
+    if (stat(path, &stat_buf) != 0) {
         warn("ls: cannot get stat of '%s'", path);
-        close(fd);
         return;
     }
 
     /** Listing on a regular file. */
-    if (stat.type == INODE_TYPE_FILE) {
-        _print_file_stat(_get_filename(path), &stat);
-        close(fd);
+    if (stat_buf.type == INODE_TYPE_FILE) {
+        _print_file_stat(_get_filename(path), &stat_buf);
         return;
     }
 
     /**
-     * Listing a directory, then read out its content, interpret as an
-     * array of directory entries.
+     * Listing a directory, then read out its entries in batches, each
+     * coming with its stat.
      */
-    char concat_buf[CONCAT_BUF_SIZE];
-    strncpy(concat_buf, path, CONCAT_BUF_SIZE - 2);
-    if (CONCAT_BUF_SIZE - 1 - strlen(concat_buf) < MAX_FILENAME) {
-        warn("ls: path '%s' too long", path);
-        close(fd);
+    int8_t fd = open(path, OPEN_RD);
+    if (fd < 0) {
+        warn("ls: cannot open path '%s'", path);
         return;
     }
-    char *name_buf = &concat_buf[strlen(concat_buf)];
-    *(name_buf++) = '/';
-    *name_buf = '\0';
-
-    dentry_t dentry;
-    while (read(fd, (char *) &dentry, sizeof(dentry_t)) == sizeof(dentry_t)) {
-        if (dentry.valid != 1)
-            continue;
-
-        strncpy(name_buf, dentry.filename, MAX_FILENAME);
-        int8_t inner_fd = open(concat_buf, OPEN_RD);
-        if (inner_fd < 0) {
-            warn("ls: cannot open path '%s'", concat_buf);
-            close(fd);
-            return;
-        }
-
-        file_stat_t inner_stat;
-        if (fstat(inner_fd, &inner_stat) != 0) {
-            warn("ls: cannot get stat of '%s'", concat_buf);
-            close(inner_fd);
-            close(fd);
-            return;
-        }
-
-        _print_file_stat(dentry.filename, &inner_stat);
-        close(inner_fd);
+
+    dir_entry_t dents[DENTS_BATCH];
+    int32_t num;
+    while ((num = getdents(fd, dents, DENTS_BATCH, GETDENTS_STAT)) > 0) {
+        for (int32_t i = 0; i < num; ++i)
+            _print_file_stat(dents[i].filename, &dents[i].stat);
     }
+    if (num < 0)
+        warn("ls: cannot read entries of '%s'", path);
 
     close(fd);
 }
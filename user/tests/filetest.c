@@ -9,9 +9,65 @@
 
 #include "../lib/debug.h"
 #include "../lib/printf.h"
+#include "../lib/string.h"
 #include "../lib/syscall.h"
 
 
+/**
+ * Positional & vectored I/O on file PATH, which holds "AAAAA". Neither
+ * pread nor pwrite may move the file offset, and iovec arrays too long or
+ * holding bad buffers must be refused as a whole.
+ */
+static void
+_file_io_test(char *path)
+{
+    int8_t fd = open(path, OPEN_RD | OPEN_WR);
+    printf("[P] Opened file '%s' -> %d\n", path, fd);
+    assert(fd >= 0);
+
+    char c = '\0';
+    assert(seek(fd, 2) == 0);
+    printf("[P] Pwritten to fd %d -> %d\n", fd, pwrite(fd, "B", 1, 0));
+    printf("[P] Pread from fd %d -> %d\n", fd, pread(fd, &c, 1, 0));
+    assert(c == 'B');
+    assert(read(fd, &c, 1) == 1);
+    printf("    byte read after at offset 3: %c\n", c);
+    assert(c == 'A');
+
+    char head[4] = "XYZ", body[6] = "12345", tail[3] = "!?";
+    iovec_t out[3] = {{head, 3}, {body, 5}, {tail, 2}};
+    assert(seek(fd, 5) == 0);
+    printf("[P] Writev to fd %d -> %d\n", fd, writev(fd, out, 3));
+
+    char head_in[4] = {0}, body_in[6] = {0}, tail_in[3] = {0};
+    iovec_t in[3] = {{head_in, 3}, {body_in, 5}, {tail_in, 2}};
+    assert(seek(fd, 5) == 0);
+    printf("[P] Readv from fd %d -> %d\n", fd, readv(fd, in, 3));
+    printf("    dst: %s|%s|%s\n", head_in, body_in, tail_in);
+    for (size_t i = 0; i < 3; ++i)
+        assert(memcmp(in[i].base, out[i].base, out[i].len) == 0);
+
+    iovec_t many[MAX_IOVECS + 1];
+    for (size_t i = 0; i < MAX_IOVECS + 1; ++i)
+        many[i] = (iovec_t) {head, 1};
+    int32_t ret = writev(fd, many, MAX_IOVECS + 1);
+    printf("[P] Writev of %d iovecs -> %d\n", MAX_IOVECS + 1, ret);
+    assert(ret < 0);
+    iovec_t bad[2] = {{head, 3}, {(char *) 0x1000, 5}};
+    ret = readv(fd, bad, 2);
+    printf("[P] Readv into a kernel address -> %d\n", ret);
+    assert(ret < 0);
+    assert(writev(fd, bad, 2) < 0);
+
+    file_stat_t stat_buf;
+    printf("[P] Stat file '%s' -> %d\n", path, stat(path, &stat_buf));
+    printf("    size: %d\n", stat_buf.size);
+    assert(stat_buf.type == INODE_TYPE_FILE && stat_buf.size == 15);
+
+    printf("[P] Closing fd %d -> %d\n", fd, close(fd));
+}
+
+
 void
 main(int argc, char *argv[])
 {
@@ -50,6 +106,7 @@ main(int argc, char *argv[])
         printf("[P] Read from fd %d -> %d\n", fd, read(fd, buf, 5));
         printf("    dst: %s\n", buf);
         printf("[P] Closing fd %d -> %d\n", fd, close(fd));
+        _file_io_test(filepath);
         printf("[P] Removing file '%s' -> %d\n", filepath, remove(filepath));
         printf("[P] Removing dir '%s' -> %d\n", dirname, remove(dirname));
     }
@@ -13,6 +13,143 @@
 #include "../lib/malloc.h"
 
 
+#define PAGE_SIZE 4096
+
+
+/** Read back the byte at OFFSET of open file FD through `read()`. */
+static char
+_file_byte_at(int8_t fd, uint32_t offset)
+{
+    char c = '\0';
+    assert(seek(fd, offset) == 0);
+    assert(read(fd, &c, 1) == 1);
+    return c;
+}
+
+static void
+_mmap_test(void)
+{
+    char filename[128] = "mmap.txt";
+    uint32_t len = 3 * PAGE_SIZE + 100;
+
+    printf("\nFile mappings...\n");
+    assert(create(filename, CREATE_FILE) == 0);
+    int8_t fd = open(filename, OPEN_RD | OPEN_WR);
+    assert(fd >= 0);
+    char *page = (char *) malloc(PAGE_SIZE);
+    assert(page != NULL);
+    for (uint32_t i = 0; i < 4; ++i) {
+        for (uint32_t j = 0; j < PAGE_SIZE; ++j)
+            page[j] = 'a' + i;
+        uint32_t chunk = i < 3 ? PAGE_SIZE : 100;
+        assert(write(fd, page, chunk) == (int32_t) chunk);
+    }
+    mfree(page);
+
+    // Shared writable mapping, msync, then read back through read().
+    char *shared = (char *) mmap(fd, 0, len, MMAP_PROT_READ | MMAP_PROT_WRITE,
+                                 MMAP_SHARED);
+    printf("Shared mapping: %p\n", shared);
+    assert((int32_t) shared > 0);
+    assert(shared[0] == 'a' && shared[PAGE_SIZE] == 'b');
+    assert(shared[3 * PAGE_SIZE + 99] == 'd' && shared[3 * PAGE_SIZE + 100] == '\0');
+    shared[0] = 'S';
+    shared[3 * PAGE_SIZE] = 'T';
+    printf("Synced shared mapping -> %d\n", msync((uint32_t) shared, len));
+    assert(_file_byte_at(fd, 0) == 'S');
+    assert(_file_byte_at(fd, 3 * PAGE_SIZE) == 'T');
+    file_stat_t stat;
+    assert(fstat(fd, &stat) == 0 && stat.size == len);
+
+    // Private mapping, whose writes must not reach the file.
+    char *private = (char *) mmap(fd, 0, len, MMAP_PROT_READ | MMAP_PROT_WRITE,
+                                  MMAP_PRIVATE);
+    printf("Private mapping: %p\n", private);
+    assert((int32_t) private > 0);
+    assert(private[0] == 'S');
+    private[0] = 'P';
+    private[3 * PAGE_SIZE] = 'Q';
+    assert(shared[0] == 'S' && shared[3 * PAGE_SIZE] == 'T');
+    printf("Unmapped private mapping -> %d\n", munmap((uint32_t) private, len));
+    assert(_file_byte_at(fd, 0) == 'S');
+    assert(_file_byte_at(fd, 3 * PAGE_SIZE) == 'T');
+
+    // Mapped memory as syscall buffers, faulted in by the kernel.
+    char copyname[128] = "mmap2.txt";
+    assert(create(copyname, CREATE_FILE) == 0);
+    int8_t fd2 = open(copyname, OPEN_RD | OPEN_WR);
+    assert(fd2 >= 0);
+    char *rdonly = (char *) mmap(fd, 0, len, MMAP_PROT_READ, MMAP_PRIVATE);
+    assert((int32_t) rdonly > 0);
+    printf("Written from mapping -> %d\n",
+           write(fd2, rdonly + PAGE_SIZE, PAGE_SIZE));
+    iovec_t iov[2] = {{rdonly, 1}, {rdonly + 3 * PAGE_SIZE, 1}};
+    assert(writev(fd2, iov, 2) == 2);
+    char pair[2];
+    assert(pread(fd2, pair, 2, 0) == 2 && pair[0] == 'b' && pair[1] == 'b');
+    assert(pread(fd2, pair, 2, PAGE_SIZE) == 2);
+    assert(pair[0] == 'S' && pair[1] == 'T');
+    assert(pread(fd2, rdonly, 1, 0) < 0);
+    private = (char *) mmap(fd, 0, len, MMAP_PROT_READ | MMAP_PROT_WRITE,
+                            MMAP_PRIVATE);
+    assert((int32_t) private > 0);
+    assert(pread(fd2, private, 1, 0) == 1 && private[0] == 'b');
+    assert(rdonly[0] == 'S' && _file_byte_at(fd, 0) == 'S');
+    assert(munmap((uint32_t) private, len) == 0);
+    assert(munmap((uint32_t) rdonly, len) == 0);
+    assert(close(fd2) == 0);
+    assert(remove(copyname) == 0);
+
+    // Partial munmap splitting the shared mapping in two.
+    printf("Unmapped middle page -> %d\n",
+           munmap((uint32_t) shared + PAGE_SIZE, PAGE_SIZE));
+    assert(shared[0] == 'S' && shared[2 * PAGE_SIZE] == 'c');
+    shared[2 * PAGE_SIZE] = 'U';
+    printf("Synced second half -> %d\n",
+           msync((uint32_t) shared + 2 * PAGE_SIZE, len - 2 * PAGE_SIZE));
+    assert(_file_byte_at(fd, 2 * PAGE_SIZE) == 'U');
+    assert(munmap((uint32_t) shared, PAGE_SIZE) == 0);
+    assert(munmap((uint32_t) shared + 2 * PAGE_SIZE, len - 2 * PAGE_SIZE) == 0);
+
+    // Fork with a live shared mapping, written by the child, also on the
+    // last page which both have touched. Writes of either must survive.
+    shared = (char *) mmap(fd, 0, len, MMAP_PROT_READ | MMAP_PROT_WRITE,
+                           MMAP_SHARED);
+    assert((int32_t) shared > 0);
+    assert(shared[PAGE_SIZE] == 'b');
+    assert(shared[3 * PAGE_SIZE] == 'T');
+    int8_t pid = fork(0);
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert(shared[0] == 'S');
+        shared[PAGE_SIZE] = 'C';
+        shared[3 * PAGE_SIZE + 1] = 'E';
+        shared[3 * PAGE_SIZE + 200] = 'X';  // Past end of file.
+        exit();
+    }
+    assert(wait() == pid);
+    printf("Child wrote through mapping: %c %c\n", shared[PAGE_SIZE],
+           shared[3 * PAGE_SIZE + 1]);
+    assert(shared[PAGE_SIZE] == 'C' && shared[3 * PAGE_SIZE + 1] == 'E');
+    assert(_file_byte_at(fd, PAGE_SIZE) == 'C');
+    assert(_file_byte_at(fd, 3 * PAGE_SIZE + 1) == 'E');
+    shared[3 * PAGE_SIZE + 2] = 'F';
+    assert(munmap((uint32_t) shared, len) == 0);
+    assert(_file_byte_at(fd, 3 * PAGE_SIZE + 1) == 'E');
+    assert(_file_byte_at(fd, 3 * PAGE_SIZE + 2) == 'F');
+    assert(fstat(fd, &stat) == 0 && stat.size == len);
+
+    // Bytes written past end of file read back as zeros when remapped.
+    shared = (char *) mmap(fd, 0, len, MMAP_PROT_READ, MMAP_SHARED);
+    assert((int32_t) shared > 0);
+    assert(shared[3 * PAGE_SIZE + 200] == '\0');
+    assert(munmap((uint32_t) shared, len) == 0);
+
+    assert(close(fd) == 0);
+    printf("Removed file '%s' -> %d\n", filename, remove(filename));
+}
+
+
 void
 main(int argc, char *argv[])
 {
@@ -36,5 +173,7 @@ main(int argc, char *argv[])
     mfree(buf3);
     mfree(buf2);
 
+    _mmap_test();
+
     exit();
 }